@@ -0,0 +1,341 @@
+// Native benchmark harness.  Runs the same CLucene calls as the Index and
+// Search paths of clucene_bindings.cpp, without node, so regressions can be
+// told apart from binding/V8 overhead (see bench/driver.js for the latter).
+//
+// Usage: clucene_bench [--docs N] [--queries N] [--seed N] [--index PATH]
+//                      [--concurrency 1,2,4,8]
+// Prints one JSON object to stdout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <CLucene.h>
+#include "repl_tchar.h"
+
+using namespace lucene::index;
+using namespace lucene::analysis;
+using namespace lucene::document;
+using namespace lucene::search;
+using namespace lucene::queryParser;
+
+static const char* SYLLABLES[] = { "ka", "lo", "mi", "ne", "ru", "ta", "shi", "po", "ve", "zu", "da", "ge" };
+static const uint32_t SYLLABLE_COUNT = 12;
+static const uint32_t VOCABULARY_SIZE = 5000;
+
+// Must stay in sync with bench/corpus.js
+struct Random {
+    Random(uint32_t seed) : state(seed ? seed : 1) { }
+
+    uint32_t next() {
+        uint32_t x = state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        state = x;
+        return x;
+    }
+
+    uint32_t below(uint32_t n) { return next() % n; }
+
+    uint32_t rank(uint32_t n) {
+        uint64_t a = below(n), b = below(n);
+        return (uint32_t)(a * b / n);
+    }
+
+    uint32_t state;
+};
+
+static std::string word(uint32_t rank) {
+    uint32_t k = rank + 1;
+    std::string result;
+    while (k > 0) {
+        result += SYLLABLES[k % SYLLABLE_COUNT];
+        k /= SYLLABLE_COUNT;
+    }
+    return result;
+}
+
+struct BenchDocument {
+    std::string id, name, body;
+};
+
+static BenchDocument corpus_document(uint32_t seed, uint32_t i) {
+    Random random(seed + i * 2654435761u);
+    BenchDocument doc;
+    char id[16];
+    snprintf(id, sizeof(id), "%u", i);
+    doc.id = id;
+    doc.name = word(random.rank(VOCABULARY_SIZE));
+    doc.name += " ";
+    doc.name += word(random.rank(VOCABULARY_SIZE));
+    uint32_t length = 20 + random.below(40);
+    for (uint32_t j = 0; j < length; ++j) {
+        if (j > 0) {
+            doc.body += " ";
+        }
+        doc.body += word(random.rank(VOCABULARY_SIZE));
+    }
+    return doc;
+}
+
+static std::string corpus_query(uint32_t seed, uint32_t i) {
+    Random random(seed ^ (i * 40503u + 7));
+    switch (i % 3) {
+    case 0:
+        return "body:" + word(random.rank(VOCABULARY_SIZE));
+    case 1:
+        return "name:" + word(random.rank(VOCABULARY_SIZE)).substr(0, 4) + "*";
+    default:
+        return "body:" + word(random.rank(VOCABULARY_SIZE)) + " AND body:" + word(random.rank(VOCABULARY_SIZE));
+    }
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void add_field(Document& doc, const char* name, const std::string& value, int flags) {
+    TCHAR* key = STRDUP_AtoT(name);
+    TCHAR* text = STRDUP_AtoT(value.c_str());
+    doc.add(*_CLNEW Field(key, text, flags));
+    free(key);
+    free(text);
+}
+
+static int64_t directory_size(const std::string& path) {
+    int64_t total = 0;
+    DIR* dir = opendir(path.c_str());
+    if (dir == 0) {
+        return 0;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != 0) {
+        struct stat st;
+        std::string file = path + "/" + entry->d_name;
+        if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            total += st.st_size;
+        }
+    }
+    closedir(dir);
+    return total;
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+
+// Mirrors Lucene::Index: same writer settings, updateDocument keyed on _id
+static double ingest(const std::string& index, uint32_t seed, uint32_t docs) {
+    standard::StandardAnalyzer analyzer;
+    IndexWriter writer(index.c_str(), &analyzer, true);
+    writer.setRAMBufferSizeMB(5);
+    writer.setMaxFieldLength(0x7FFFFFFFL);
+    writer.setUseCompoundFile(false);
+
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < docs; ++i) {
+        BenchDocument source = corpus_document(seed, i);
+        Document doc;
+        add_field(doc, "_id", source.id, Field::STORE_YES | Field::INDEX_UNTOKENIZED);
+        add_field(doc, "_type", "bench", Field::STORE_YES | Field::INDEX_UNTOKENIZED);
+        add_field(doc, "name", source.name, Field::STORE_YES | Field::INDEX_TOKENIZED);
+        add_field(doc, "body", source.body, Field::STORE_NO | Field::INDEX_TOKENIZED);
+
+        TCHAR* id = STRDUP_AtoT(source.id.c_str());
+        Term* term = _CLNEW Term(_T("_id"), id);
+        writer.updateDocument(term, &doc);
+        _CLDECDELETE(term);
+        free(id);
+    }
+    writer.close();
+    return (now_ns() - start) / 1e9;
+}
+
+struct SearchThread {
+    IndexReader* reader;
+    uint32_t seed;
+    uint32_t first;
+    uint32_t count;
+    std::vector<uint64_t> latencies;
+    uint64_t hits;
+};
+
+// Best score first, ties in index order; scored_doc in clucene_bindings.cpp
+struct ScoredDoc {
+    ScoredDoc(int32_t doc_, float_t score_) : doc(doc_), score(score_) { }
+
+    bool operator<(const ScoredDoc& other) const {
+        return score > other.score || (score == other.score && doc < other.doc);
+    }
+
+    int32_t doc;
+    float_t score;
+};
+
+// The module's collect_matches, scored and without a tenant or deadline:
+// rewrite, then drive the scorer into an unlimited LimitedCollector
+static void collect_matches(IndexSearcher& searcher, IndexReader* reader, Query* query, std::vector<ScoredDoc>& hits) {
+    Query* rewritten = searcher.rewrite(query);
+    Weight* weight = rewritten->weight(&searcher);
+    Scorer* scorer = weight->scorer(reader);
+    while (scorer != 0 && scorer->next()) {
+        hits.push_back(ScoredDoc(scorer->doc(), scorer->score()));
+    }
+    _CLDELETE(scorer);
+    _CLLDELETE(weight);
+    if (rewritten != query) {
+        _CLLDELETE(rewritten);
+    }
+}
+
+// The module's sort_hits: best first, scaled into 0..1 the way Hits does it
+static void sort_hits(std::vector<ScoredDoc>& hits) {
+    std::sort(hits.begin(), hits.end());
+    if (!hits.empty() && hits[0].score > 1.0f) {
+        float_t norm = 1.0f / hits[0].score;
+        for (size_t i = 0; i < hits.size(); ++i) {
+            hits[i].score *= norm;
+        }
+    }
+}
+
+// The module's load_hits: every stored field of every hit, converted the
+// way load_fields converts them
+static void load_hits(IndexReader* reader, const std::vector<ScoredDoc>& hits) {
+    for (size_t i = 0; i < hits.size(); ++i) {
+        Document doc;
+        reader->document(hits[i].doc, doc);
+        Document::FieldsType* fields = const_cast<Document::FieldsType*>(doc.getFields());
+        DocumentFieldEnumeration fieldEnum(fields->begin(), fields->end());
+        while (fieldEnum.hasMoreElements()) {
+            Field* field = fieldEnum.nextElement();
+            char* name = STRDUP_TtoA(field->name());
+            char* value = STRDUP_TtoA(field->stringValue());
+            free(name);
+            free(value);
+        }
+    }
+}
+
+// Mirrors Lucene::Search: parse, collect_matches, sort_hits, load_hits
+static void* search_thread(void* arg) {
+    SearchThread* thread = static_cast<SearchThread*>(arg);
+    standard::StandardAnalyzer analyzer;
+    IndexSearcher searcher(thread->reader);
+    thread->hits = 0;
+    for (uint32_t i = thread->first; i < thread->first + thread->count; ++i) {
+        uint64_t start = now_ns();
+        TCHAR* queryString = STRDUP_AtoT(corpus_query(thread->seed, i).c_str());
+        Query* query = QueryParser::parse(queryString, _T("_id"), &analyzer);
+        free(queryString);
+        std::vector<ScoredDoc> hits;
+        collect_matches(searcher, thread->reader, query, hits);
+        sort_hits(hits);
+        load_hits(thread->reader, hits);
+        thread->hits += hits.size();
+        _CLLDELETE(query);
+        thread->latencies.push_back(now_ns() - start);
+    }
+    return 0;
+}
+
+static void search_level(IndexReader* reader, uint32_t seed, uint32_t queries, uint32_t concurrency, bool last) {
+    std::vector<SearchThread> threads(concurrency);
+    std::vector<pthread_t> handles(concurrency);
+    uint32_t perThread = queries / concurrency;
+
+    uint64_t start = now_ns();
+    for (uint32_t t = 0; t < concurrency; ++t) {
+        threads[t].reader = reader;
+        threads[t].seed = seed;
+        threads[t].first = t * perThread;
+        threads[t].count = perThread;
+        pthread_create(&handles[t], 0, search_thread, &threads[t]);
+    }
+    std::vector<uint64_t> latencies;
+    uint64_t hits = 0;
+    for (uint32_t t = 0; t < concurrency; ++t) {
+        pthread_join(handles[t], 0);
+        latencies.insert(latencies.end(), threads[t].latencies.begin(), threads[t].latencies.end());
+        hits += threads[t].hits;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("    {\"concurrency\": %u, \"queries\": %u, \"hits\": %llu, \"qps\": %.1f, \"p50\": %llu, \"p99\": %llu}%s\n",
+        concurrency, (uint32_t)latencies.size(), (unsigned long long)hits, latencies.size() / seconds,
+        (unsigned long long)percentile(latencies, 50), (unsigned long long)percentile(latencies, 99),
+        last ? "" : ",");
+}
+
+int main(int argc, char** argv) {
+    uint32_t docs = 50000, queries = 20000, seed = 42;
+    std::string index = "./bench.index";
+    std::vector<uint32_t> levels;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--docs") == 0) {
+            docs = strtoul(argv[i + 1], 0, 10);
+        } else if (strcmp(argv[i], "--queries") == 0) {
+            queries = strtoul(argv[i + 1], 0, 10);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            seed = strtoul(argv[i + 1], 0, 10);
+        } else if (strcmp(argv[i], "--index") == 0) {
+            index = argv[i + 1];
+        } else if (strcmp(argv[i], "--concurrency") == 0) {
+            for (char* level = strtok(argv[i + 1], ","); level != 0; level = strtok(0, ",")) {
+                levels.push_back(strtoul(level, 0, 10));
+            }
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (levels.empty()) {
+        levels.push_back(1);
+        levels.push_back(2);
+        levels.push_back(4);
+        levels.push_back(8);
+    }
+
+    try {
+        double ingestSeconds = ingest(index, seed, docs);
+
+        printf("{\n  \"harness\": \"native\",\n  \"seed\": %u,\n", seed);
+        printf("  \"ingest\": {\"docs\": %u, \"seconds\": %.3f, \"docsPerSec\": %.1f},\n",
+            docs, ingestSeconds, docs / ingestSeconds);
+        printf("  \"indexBytes\": %lld,\n", (long long)directory_size(index));
+        printf("  \"search\": [\n");
+
+        IndexReader* reader = IndexReader::open(index.c_str());
+        for (size_t i = 0; i < levels.size(); ++i) {
+            search_level(reader, seed, queries, levels[i] > 0 ? levels[i] : 1, i + 1 == levels.size());
+        }
+        reader->close();
+        _CLLDELETE(reader);
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        printf("  ],\n  \"maxRssBytes\": %lld\n}\n", (long long)usage.ru_maxrss * 1024);
+    } catch (CLuceneError& E) {
+        fprintf(stderr, "CLucene error: %s\n", E.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+// Deterministic benchmark corpus.  bench/bench.cpp implements the same
+// generator, so the native harness and the JS driver index identical documents
+// for a given seed.
+
+var SYLLABLES = ['ka', 'lo', 'mi', 'ne', 'ru', 'ta', 'shi', 'po', 've', 'zu', 'da', 'ge'];
+var VOCABULARY_SIZE = 5000;
+
+// xorshift32; every operation stays within 32 bits so JS and C++ agree
+function Random(seed) {
+    this.state = (seed >>> 0) || 1;
+}
+
+Random.prototype.next = function () {
+    var x = this.state;
+    x ^= x << 13; x >>>= 0;
+    x ^= x >>> 17;
+    x ^= x << 5; x >>>= 0;
+    this.state = x;
+    return x;
+};
+
+Random.prototype.below = function (n) {
+    return this.next() % n;
+};
+
+// Skewed towards low ranks so a few words are very common, like real text
+Random.prototype.rank = function (n) {
+    var a = this.below(n), b = this.below(n);
+    return Math.floor(a * b / n);
+};
+
+function word(rank) {
+    var k = rank + 1, result = '';
+    while (k > 0) {
+        result += SYLLABLES[k % SYLLABLES.length];
+        k = Math.floor(k / SYLLABLES.length);
+    }
+    return result;
+}
+
+function Corpus(seed) {
+    this.seed = seed;
+}
+
+// Returns {id, name, body} for document i; independent of generation order
+Corpus.prototype.document = function (i) {
+    var random = new Random(this.seed + i * 2654435761);
+    var name = word(random.rank(VOCABULARY_SIZE)) + ' ' + word(random.rank(VOCABULARY_SIZE));
+    var length = 20 + random.below(40), body = [];
+    for (var j = 0; j < length; ++j) {
+        body.push(word(random.rank(VOCABULARY_SIZE)));
+    }
+    return { id: String(i), name: name, body: body.join(' ') };
+};
+
+// Returns the i-th benchmark query string
+Corpus.prototype.query = function (i) {
+    var random = new Random(this.seed ^ (i * 40503 + 7));
+    switch (i % 3) {
+    case 0:
+        return 'body:' + word(random.rank(VOCABULARY_SIZE));
+    case 1:
+        return 'name:' + word(random.rank(VOCABULARY_SIZE)).substr(0, 4) + '*';
+    default:
+        return 'body:' + word(random.rank(VOCABULARY_SIZE)) + ' AND body:' + word(random.rank(VOCABULARY_SIZE));
+    }
+};
+
+exports.Corpus = Corpus;
+exports.word = word;
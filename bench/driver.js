@@ -0,0 +1,159 @@
+// Benchmarks the module end to end: addDocuments (Index/AfterIndex),
+// search (Search/AfterSearch) and getDocuments at several concurrency levels,
+// over the deterministic corpus from bench/corpus.js.
+//
+// Usage: node bench/driver.js [--docs N] [--queries N] [--seed N] [--batch N]
+//                             [--index PATH] [--concurrency 1,4,16,64]
+// Prints one JSON object to stdout; bench/bench.cpp is its native counterpart.
+
+var fs = require('fs');
+var path = require('path');
+
+var cl = require('../clucene').CLucene;
+var Corpus = require('./corpus').Corpus;
+
+var options = {
+    docs: 50000,
+    queries: 20000,
+    seed: 42,
+    batch: 500,
+    index: './bench.index',
+    concurrency: '1,4,16,64'
+};
+
+for (var i = 2; i + 1 < process.argv.length; i += 2) {
+    var name = process.argv[i].replace(/^--/, '');
+    if (!(name in options)) {
+        console.error('Unknown option ' + process.argv[i]);
+        process.exit(1);
+    }
+    options[name] = typeof options[name] === 'number' ? Number(process.argv[i + 1]) : process.argv[i + 1];
+}
+
+var levels = options.concurrency.split(',').map(Number);
+var corpus = new Corpus(options.seed);
+var clucene = new cl.Lucene();
+
+function nowNs() {
+    var t = process.hrtime();
+    return t[0] * 1e9 + t[1];
+}
+
+function removeIndex(dir) {
+    if (!fs.existsSync(dir)) {
+        return;
+    }
+    fs.readdirSync(dir).forEach(function (file) {
+        fs.unlinkSync(path.join(dir, file));
+    });
+    fs.rmdirSync(dir);
+}
+
+function indexSize(dir) {
+    return fs.readdirSync(dir).reduce(function (total, file) {
+        return total + fs.statSync(path.join(dir, file)).size;
+    }, 0);
+}
+
+function percentile(sorted, p) {
+    if (sorted.length === 0) {
+        return 0;
+    }
+    return sorted[Math.round(p / 100 * (sorted.length - 1))];
+}
+
+function ingest(done) {
+    var next = 0, start = nowNs();
+    function addBatch() {
+        if (next >= options.docs) {
+            clucene.closeWriter();
+            var seconds = (nowNs() - start) / 1e9;
+            return done({ docs: options.docs, seconds: seconds, docsPerSec: options.docs / seconds });
+        }
+        var docs = {};
+        for (var end = Math.min(next + options.batch, options.docs); next < end; ++next) {
+            var source = corpus.document(next), doc = new cl.Document();
+            doc.addField('_type', 'bench', cl.STORE_YES|cl.INDEX_UNTOKENIZED);
+            doc.addField('name', source.name, cl.STORE_YES|cl.INDEX_TOKENIZED);
+            doc.addField('body', source.body, cl.STORE_NO|cl.INDEX_TOKENIZED);
+            docs[source.id] = doc;
+        }
+        clucene.addDocuments(docs, options.index, function (err) {
+            if (err) {
+                throw new Error('Indexing failed: ' + err);
+            }
+            addBatch();
+        });
+    }
+    addBatch();
+}
+
+// Keeps `concurrency` requests outstanding until `total` have completed
+function runLevel(concurrency, total, request, done) {
+    var issued = 0, completed = 0, latencies = [], start = nowNs();
+    function issue() {
+        var i = issued++, sent = nowNs();
+        request(i, function (err) {
+            if (err) {
+                throw new Error('Request failed: ' + err);
+            }
+            latencies.push(nowNs() - sent);
+            if (++completed === total) {
+                var seconds = (nowNs() - start) / 1e9;
+                latencies.sort(function (a, b) { return a - b; });
+                return done({
+                    concurrency: concurrency,
+                    queries: total,
+                    qps: total / seconds,
+                    p50: percentile(latencies, 50),
+                    p99: percentile(latencies, 99)
+                });
+            }
+            if (issued < total) {
+                issue();
+            }
+        });
+    }
+    for (var c = 0; c < Math.min(concurrency, total); ++c) {
+        issue();
+    }
+}
+
+function runLevels(request, done) {
+    var results = [];
+    (function next(l) {
+        if (l >= levels.length) {
+            return done(results);
+        }
+        runLevel(levels[l], options.queries, request, function (result) {
+            results.push(result);
+            next(l + 1);
+        });
+    })(0);
+}
+
+function search(i, callback) {
+    clucene.search(options.index, corpus.query(i), callback);
+}
+
+function lookup(i, callback) {
+    clucene.getDocuments(options.index, [String((i * 7919) % options.docs)], callback);
+}
+
+removeIndex(options.index);
+ingest(function (ingestResult) {
+    runLevels(search, function (searchResults) {
+        runLevels(lookup, function (lookupResults) {
+            console.log(JSON.stringify({
+                harness: 'node',
+                seed: options.seed,
+                ingest: ingestResult,
+                indexBytes: indexSize(options.index),
+                search: searchResults,
+                lookup: lookupResults,
+                rssBytes: process.memoryUsage().rss,
+                stats: clucene.stats().totals
+            }, null, 2));
+        });
+    });
+});
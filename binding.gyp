@@ -13,6 +13,22 @@
                     "-lclucene-core"
                 ]
             }
+        },
+        {
+            "target_name": "clucene_bench",
+            "type": "executable",
+            "include_dirs": [
+                "src"
+            ],
+            "cflags!": [ "-fno-exceptions" ],
+            "cflags_cc!": [ "-fno-exceptions" ],
+            "sources": ["bench/bench.cpp"],
+            "link_settings": {
+                "libraries": [
+                    "-lclucene-core",
+                    "-lpthread"
+                ]
+            }
         }
     ]
 }
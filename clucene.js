@@ -13,4 +13,70 @@ clucene.TERMVECTOR_WITH_POSITIONS = 512 | 1024;
 clucene.TERMVECTOR_WITH_OFFSETS = 512 | 2048;
 clucene.TERMVECTOR_WITH_POSITIONS_OFFSETS = (512 | 1024) | (512 | 2048);
 
+clucene.DIRECTORY_FS = 0;
+clucene.DIRECTORY_MMAP = 1;
+clucene.DIRECTORY_RAM = 2;
+
+clucene.ANALYZER_STANDARD = 'standard';
+clucene.ANALYZER_SIMPLE = 'simple';
+clucene.ANALYZER_WHITESPACE = 'whitespace';
+clucene.ANALYZER_KEYWORD = 'keyword';
+clucene.ANALYZER_STOP = 'stop';
+clucene.ANALYZER_SNOWBALL = 'snowball';
+
+// search, searchMany and count return a handle whose abort() stops the job
+// at its next check.  search and searchMany then call back with the hits
+// found so far and results.truncated set, count with an error.
+function abortHandle(lucene, job) {
+    return {
+        abort: function () {
+            return lucene.abort(job);
+        }
+    };
+}
+
+var search = clucene.Lucene.prototype.search;
+clucene.Lucene.prototype.search = function () {
+    return abortHandle(this, search.apply(this, arguments));
+};
+
+var count = clucene.Lucene.prototype.count;
+clucene.Lucene.prototype.count = function () {
+    return abortHandle(this, count.apply(this, arguments));
+};
+
+// searchMany(index, queries, [options], [callback]) returns a Promise when
+// called without a callback; the Promise has abort() too.  Node before 0.12
+// has no Promise of its own, so set clucene.Promise to a library's (e.g. Q's
+// or bluebird's) constructor there.
+clucene.Promise = typeof Promise === 'function' ? Promise : undefined;
+
+var searchMany = clucene.Lucene.prototype.searchMany;
+clucene.Lucene.prototype.searchMany = function (index, queries, options, callback) {
+    if (typeof options === 'function') {
+        callback = options;
+        options = {};
+    }
+    options = options || {};
+    if (callback) {
+        return abortHandle(this, searchMany.call(this, index, queries, options, callback));
+    }
+
+    if (typeof clucene.Promise !== 'function') {
+        throw new Error('searchMany needs a callback or clucene.Promise');
+    }
+    var self = this, job;
+    var promise = new clucene.Promise(function (resolve, reject) {
+        job = searchMany.call(self, index, queries, options, function (err, results) {
+            if (err) {
+                reject(new Error(err));
+            } else {
+                resolve(results);
+            }
+        });
+    });
+    promise.abort = abortHandle(self, job).abort;
+    return promise;
+};
+
 exports.CLucene = clucene;
\ No newline at end of file
@@ -0,0 +1,309 @@
+#ifndef _NODE_CLUCENE_JSON_FLATTENER_H
+#define _NODE_CLUCENE_JSON_FLATTENER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// One scalar of a flattened JSON document.  path joins the object keys
+// leading to it with dots; array elements share their array's path, so an
+// array becomes several values of one field.
+struct json_field_t
+{
+    json_field_t(const std::string& path_, const std::string& value_) : path(path_), value(value_) { }
+
+    std::string path;
+    std::string value;  // strings unescaped (UTF-8), numbers as written, booleans as true/false
+};
+
+// Parses a JSON document (RFC 4627, a top-level object) and appends its
+// scalars to fields in document order; nulls are left out.  Throws a
+// std::string describing the first syntax error and where it is.
+class JSONFlattener
+{
+public:
+    // Deepest nesting of objects and arrays accepted
+    enum { MAX_DEPTH = 64 };
+
+    static void flatten(const char* text, size_t length, std::vector<json_field_t>& fields) {
+        JSONFlattener parser(text, length, fields);
+        parser.skipSpace();
+        if (parser.peek() != '{') {
+            parser.fail("expected an object");
+        }
+        std::string path;
+        parser.parseValue(path, 0);
+        parser.skipSpace();
+        if (parser.pos_ != parser.end_) {
+            parser.fail("unexpected text after the document");
+        }
+    }
+
+private:
+    JSONFlattener(const char* text, size_t length, std::vector<json_field_t>& fields)
+        : begin_(text), pos_(text), end_(text + length), fields_(fields) { }
+
+    void fail(const char* what) const {
+        char where[32];
+        snprintf(where, sizeof(where), " at offset %lu", (unsigned long)(pos_ - begin_));
+        throw std::string(what) + where;
+    }
+
+    int peek() const { return pos_ < end_ ? (unsigned char)*pos_ : -1; }
+
+    void skipSpace() {
+        while (pos_ < end_ && (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\n' || *pos_ == '\r')) {
+            ++pos_;
+        }
+    }
+
+    void expect(char c) {
+        skipSpace();
+        if (peek() != c) {
+            char what[16];
+            snprintf(what, sizeof(what), "expected '%c'", c);
+            fail(what);
+        }
+        ++pos_;
+    }
+
+    bool literal(const char* word) {
+        size_t length = strlen(word);
+        if ((size_t)(end_ - pos_) < length || memcmp(pos_, word, length) != 0) {
+            return false;
+        }
+        pos_ += length;
+        return true;
+    }
+
+    void parseValue(std::string& path, uint32_t depth) {
+        skipSpace();
+        switch (peek()) {
+        case '{':
+            parseObject(path, depth + 1);
+            break;
+        case '[':
+            parseArray(path, depth + 1);
+            break;
+        case '"': {
+            std::string value;
+            parseString(value);
+            fields_.push_back(json_field_t(path, value));
+            break;
+        }
+        case 't':
+            if (!literal("true")) {
+                fail("invalid literal");
+            }
+            fields_.push_back(json_field_t(path, "true"));
+            break;
+        case 'f':
+            if (!literal("false")) {
+                fail("invalid literal");
+            }
+            fields_.push_back(json_field_t(path, "false"));
+            break;
+        case 'n':
+            if (!literal("null")) {
+                fail("invalid literal");
+            }
+            break;
+        default:
+            parseNumber(path);
+        }
+    }
+
+    void parseObject(std::string& path, uint32_t depth) {
+        if (depth > MAX_DEPTH) {
+            fail("nested too deep");
+        }
+        ++pos_;
+        skipSpace();
+        if (peek() == '}') {
+            ++pos_;
+            return;
+        }
+        size_t prefix = path.size();
+        for (;;) {
+            skipSpace();
+            if (peek() != '"') {
+                fail("expected a key");
+            }
+            if (prefix > 0) {
+                path += '.';
+            }
+            parseString(path);
+            expect(':');
+            parseValue(path, depth);
+            path.resize(prefix);
+            skipSpace();
+            if (peek() == ',') {
+                ++pos_;
+            } else if (peek() == '}') {
+                ++pos_;
+                return;
+            } else {
+                fail("expected ',' or '}'");
+            }
+        }
+    }
+
+    void parseArray(std::string& path, uint32_t depth) {
+        if (depth > MAX_DEPTH) {
+            fail("nested too deep");
+        }
+        ++pos_;
+        skipSpace();
+        if (peek() == ']') {
+            ++pos_;
+            return;
+        }
+        for (;;) {
+            parseValue(path, depth);
+            skipSpace();
+            if (peek() == ',') {
+                ++pos_;
+            } else if (peek() == ']') {
+                ++pos_;
+                return;
+            } else {
+                fail("expected ',' or ']'");
+            }
+        }
+    }
+
+    void parseNumber(const std::string& path) {
+        const char* start = pos_;
+        if (peek() == '-') {
+            ++pos_;
+        }
+        if (!digits()) {
+            fail("unexpected character");
+        }
+        if (peek() == '.') {
+            ++pos_;
+            if (!digits()) {
+                fail("expected a digit");
+            }
+        }
+        if (peek() == 'e' || peek() == 'E') {
+            ++pos_;
+            if (peek() == '+' || peek() == '-') {
+                ++pos_;
+            }
+            if (!digits()) {
+                fail("expected a digit");
+            }
+        }
+        fields_.push_back(json_field_t(path, std::string(start, pos_)));
+    }
+
+    bool digits() {
+        const char* start = pos_;
+        while (pos_ < end_ && *pos_ >= '0' && *pos_ <= '9') {
+            ++pos_;
+        }
+        return pos_ > start;
+    }
+
+    // Appends the unescaped string starting at pos_ to out
+    void parseString(std::string& out) {
+        ++pos_;
+        for (;;) {
+            const char* run = pos_;
+            while (pos_ < end_ && *pos_ != '"' && *pos_ != '\\' && (unsigned char)*pos_ >= 0x20) {
+                ++pos_;
+            }
+            out.append(run, pos_);
+            if (pos_ >= end_) {
+                fail("unterminated string");
+            }
+            if (*pos_ == '"') {
+                ++pos_;
+                return;
+            }
+            if (*pos_ != '\\') {
+                fail("control character in string");
+            }
+            ++pos_;
+            switch (peek()) {
+            case '"': out += '"'; break;
+            case '\\': out += '\\'; break;
+            case '/': out += '/'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                uint32_t code = hex4();
+                // A surrogate pair encodes one code point above U+FFFF
+                if (code >= 0xD800 && code <= 0xDBFF && end_ - pos_ >= 7 && pos_[1] == '\\' && pos_[2] == 'u') {
+                    pos_ += 2;
+                    uint32_t low = hex4();
+                    if (low < 0xDC00 || low > 0xDFFF) {
+                        fail("invalid surrogate pair");
+                    }
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUTF8(out, code);
+                break;
+            }
+            default:
+                fail("invalid escape");
+            }
+            ++pos_;
+        }
+    }
+
+    // Reads the four hex digits after the 'u' at pos_, leaving pos_ on the last one
+    uint32_t hex4() {
+        if (end_ - pos_ < 5) {
+            fail("truncated \\u escape");
+        }
+        uint32_t code = 0;
+        for (int i = 1; i <= 4; ++i) {
+            char c = pos_[i];
+            code <<= 4;
+            if (c >= '0' && c <= '9') {
+                code |= c - '0';
+            } else if (c >= 'a' && c <= 'f') {
+                code |= c - 'a' + 10;
+            } else if (c >= 'A' && c <= 'F') {
+                code |= c - 'A' + 10;
+            } else {
+                fail("invalid \\u escape");
+            }
+        }
+        pos_ += 4;
+        return code;
+    }
+
+    static void appendUTF8(std::string& out, uint32_t code) {
+        if (code < 0x80) {
+            out += (char)code;
+        } else if (code < 0x800) {
+            out += (char)(0xC0 | (code >> 6));
+            out += (char)(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+            out += (char)(0xE0 | (code >> 12));
+            out += (char)(0x80 | ((code >> 6) & 0x3F));
+            out += (char)(0x80 | (code & 0x3F));
+        } else {
+            out += (char)(0xF0 | (code >> 18));
+            out += (char)(0x80 | ((code >> 12) & 0x3F));
+            out += (char)(0x80 | ((code >> 6) & 0x3F));
+            out += (char)(0x80 | (code & 0x3F));
+        }
+    }
+
+    const char* begin_;
+    const char* pos_;
+    const char* end_;
+    std::vector<json_field_t>& fields_;
+};
+
+#endif
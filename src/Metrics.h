@@ -0,0 +1,257 @@
+#ifndef _NODE_CLUCENE_METRICS_H
+#define _NODE_CLUCENE_METRICS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <uv.h>
+
+// Counters are only ever touched through these, so worker threads can record
+// without taking a lock.
+static inline void metrics_add(volatile uint64_t* counter, uint64_t amount) {
+    __sync_fetch_and_add(counter, amount);
+}
+
+static inline void metrics_add(volatile int64_t* gauge, int64_t amount) {
+    __sync_fetch_and_add(gauge, amount);
+}
+
+static inline void metrics_set(volatile int64_t* gauge, int64_t value) {
+    __sync_lock_test_and_set(gauge, value);
+}
+
+// Lock-free log-linear histogram in the spirit of HdrHistogram: every power of
+// two is split into SUB_BUCKETS linear buckets, so any recorded value is
+// reported with at most 1/SUB_BUCKETS (12.5%) relative error.
+class LatencyHistogram {
+public:
+    enum {
+        SUB_BUCKET_BITS = 3,
+        SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+        BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS
+    };
+
+    LatencyHistogram() : count_(0), sum_(0), max_(0) {
+        memset((void*)counts_, 0, sizeof(counts_));
+    }
+
+    void record(uint64_t value) {
+        metrics_add(&counts_[bucketOf(value)], 1);
+        metrics_add(&count_, 1);
+        metrics_add(&sum_, value);
+        uint64_t max = max_;
+        while (value > max && !__sync_bool_compare_and_swap(&max_, max, value)) {
+            max = max_;
+        }
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t sum() const { return sum_; }
+    uint64_t max() const { return max_; }
+
+    // Upper bound of the bucket holding the p-th percentile (0 < p <= 100).
+    // Concurrent writers may make the answer very slightly stale, which is
+    // fine for monitoring.
+    uint64_t percentile(double p) const {
+        uint64_t total = count_;
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t target = (uint64_t)(p / 100.0 * total + 0.5);
+        if (target == 0) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            seen += counts_[b];
+            if (seen >= target) {
+                uint64_t upper = bucketUpperBound(b);
+                return upper < max_ ? upper : (uint64_t)max_;
+            }
+        }
+        return max_;
+    }
+
+private:
+    static size_t bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return (size_t)value;
+        }
+        int exponent = 63 - __builtin_clzll(value);
+        int shift = exponent - SUB_BUCKET_BITS;
+        size_t sub = (size_t)((value >> shift) & (SUB_BUCKETS - 1));
+        return (size_t)(shift + 1) * SUB_BUCKETS + sub;
+    }
+
+    static uint64_t bucketUpperBound(size_t bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        size_t shift = bucket / SUB_BUCKETS - 1;
+        uint64_t sub = bucket % SUB_BUCKETS;
+        return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+
+    volatile uint64_t counts_[BUCKETS];
+    volatile uint64_t count_;
+    volatile uint64_t sum_;
+    volatile uint64_t max_;
+};
+
+enum {
+    OP_SEARCH = 0,
+    OP_SEARCH_MANY,
+    OP_GET_DOCUMENTS,
+    OP_INDEX,
+    OP_DELETE,
+    OP_OPTIMIZE,
+    OP_DOC_COUNT,
+    OP_TERMS,
+    OP_INDEX_STATS,
+    OP_SNAPSHOT,
+    OP_REBUILD,
+    OP_TENANT_STATS,
+    OP_COUNT_MATCHES,
+    OP_COUNT
+};
+
+static const char* const OP_NAMES[OP_COUNT] = {
+    "search", "searchMany", "getDocuments", "index", "delete", "optimize", "getDocumentCount",
+    "terms", "indexStats", "snapshot", "rebuild", "tenantStats", "count"
+};
+
+// Native memory the module holds, by what holds it
+enum {
+    MEM_RESULTS = 0,    // search and lookup results waiting to become V8 objects
+    MEM_BATCHES,        // documents handed to addDocument(s) and not indexed yet
+    MEM_WRITER,         // the IndexWriter RAM buffer, as last sampled
+    MEM_CACHES,         // term snapshots and tenant filter bits
+    MEM_READERS,        // open indexes, see Lucene::estimate_memory
+    MEM_KINDS
+};
+
+static const char* const MEM_NAMES[MEM_KINDS] = {
+    "results", "batches", "writer", "caches", "readers"
+};
+
+struct OperationMetrics {
+    OperationMetrics() : count(0), errors(0) { }
+
+    void record(uint64_t latency, bool failed) {
+        metrics_add(&count, 1);
+        if (failed) {
+            metrics_add(&errors, 1);
+        }
+        latency_.record(latency);
+    }
+
+    volatile uint64_t count;
+    volatile uint64_t errors;
+    LatencyHistogram latency_;
+};
+
+// Everything we count about one index; Metrics::totals() sums up all indexes.
+struct IndexMetrics {
+    IndexMetrics() : docsIndexed(0), docsDeleted(0), flushes(0), merges(0), writerCloses(0), optimizes(0),
+        readerOpens(0), readerReopens(0), cacheHits(0), evictions(0) {
+        memset((void*)memory, 0, sizeof(memory));
+    }
+
+    OperationMetrics ops[OP_COUNT];
+    volatile uint64_t docsIndexed;
+    volatile uint64_t docsDeleted;
+    volatile uint64_t flushes;       // RAM buffer written out as a new segment
+    volatile uint64_t merges;        // segment merges the writer ran
+    volatile uint64_t writerCloses;  // writer flushed and closed (closeWriter, close)
+    volatile uint64_t optimizes;     // optimize() calls, including rebuild's
+    volatile uint64_t readerOpens;   // cache misses: no reader was cached
+    volatile uint64_t readerReopens; // cached reader was stale and got reopened
+    volatile uint64_t cacheHits;     // cached reader was still current
+    volatile uint64_t evictions;     // reader and directory closed to stay within the pool limits
+    volatile int64_t memory[MEM_KINDS];  // native bytes held, see MEM_RESULTS
+};
+
+// Process-wide registry.  IndexMetrics are never freed, so a pointer handed
+// out by forIndex() stays valid for the life of the process.
+class Metrics {
+public:
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    IndexMetrics* forIndex(const std::string& index) {
+        uv_mutex_lock(&lock_);
+        IndexMetrics*& metrics = indexes_[index];
+        if (metrics == 0) {
+            metrics = new IndexMetrics;
+        }
+        uv_mutex_unlock(&lock_);
+        return metrics;
+    }
+
+    // Calls visit(name, metrics) for every index seen so far
+    template <typename Visitor>
+    void each(Visitor& visit) {
+        uv_mutex_lock(&lock_);
+        for (std::map<std::string, IndexMetrics*>::const_iterator it = indexes_.begin(); it != indexes_.end(); ++it) {
+            visit(it->first, *it->second);
+        }
+        uv_mutex_unlock(&lock_);
+    }
+
+    IndexMetrics& totals() { return totals_; }
+
+    void recordOp(IndexMetrics* index, int op, uint64_t latency, bool failed) {
+        totals_.ops[op].record(latency, failed);
+        if (index != 0) {
+            index->ops[op].record(latency, failed);
+        }
+    }
+
+    void addCounter(IndexMetrics* index, volatile uint64_t IndexMetrics::* counter, uint64_t amount) {
+        metrics_add(&(totals_.*counter), amount);
+        if (index != 0) {
+            metrics_add(&(index->*counter), amount);
+        }
+    }
+
+    void addMemory(IndexMetrics* index, int kind, int64_t amount) {
+        metrics_add(&totals_.memory[kind], amount);
+        if (index != 0) {
+            metrics_add(&index->memory[kind], amount);
+        }
+    }
+
+    // For sizes that are sampled rather than counted, like the writer's RAM buffer
+    void setMemory(IndexMetrics* index, int kind, int64_t bytes) {
+        int64_t old = __sync_lock_test_and_set(&index->memory[kind], bytes);
+        metrics_add(&totals_.memory[kind], bytes - old);
+    }
+
+    // Native bytes held across all indexes
+    int64_t memoryBytes() const {
+        int64_t total = 0;
+        for (int kind = 0; kind < MEM_KINDS; ++kind) {
+            total += totals_.memory[kind];
+        }
+        return total;
+    }
+
+    // Jobs handed to uv_queue_work that have not started running yet
+    volatile int64_t queueDepth;
+    // Last sampled size of the IndexWriter RAM buffer
+    volatile int64_t ramBufferBytes;
+
+private:
+    Metrics() : queueDepth(0), ramBufferBytes(0) {
+        uv_mutex_init(&lock_);
+    }
+
+    uv_mutex_t lock_;
+    std::map<std::string, IndexMetrics*> indexes_;
+    IndexMetrics totals_;
+};
+
+#endif
@@ -1,15 +1,34 @@
 #include <iostream>
 #include <v8.h>
 #include <node.h>
+#include <node_buffer.h>
 //Thanks bnoordhuis and jerrysv from #node.js
 
 #include <sstream>
+#include <set>
+#include <deque>
+#include <algorithm>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include <CLucene.h>
+#include <CLucene/search/Filter.h>
+#include <CLucene/util/BitSet.h>
 #include <CLucene/index/IndexModifier.h>
+#include <CLucene/index/MergePolicy.h>
+#include <CLucene/index/MergeScheduler.h>
+#ifdef NODE_CLUCENE_HAVE_SNOWBALL
+#include <CLucene/snowball/SnowballAnalyzer.h>
+#endif
 #include "Misc.h"
 #include "repl_tchar.h"
 #include "StringBuffer.h"
+#include "Metrics.h"
+#include "JSONFlattener.h"
 
 using namespace node;
 using namespace v8;
@@ -44,399 +63,5026 @@ const static int CL_MAX_DIR = 220;
       return ThrowException(Exception::TypeError(String::New("Expected a " #TYPE " type."))); \
   }
 
-class LuceneDocument : public ObjectWrap {
+// Trailing "[options], callback" arguments; options defaults to an empty object
+#define OPT_OBJ_REQ_FUN_ARGS(I, OPTS, VAR) \
+  if (args.Length() < (I + 1) || !args[args.Length() - 1]->IsFunction()) { \
+      return ThrowException(Exception::TypeError(String::New("The last argument must be a Function"))); \
+  } \
+  Local<Function> VAR = Local<Function>::Cast(args[args.Length() - 1]); \
+  Local<Object> OPTS = (args.Length() > (I + 1) && args[I]->IsObject()) ? args[I]->ToObject() : Object::New();
+
+// Writes to an index that is being rebuilt would be lost when the new copy is swapped in
+#define REQ_NOT_REBUILDING(LUCENE, I) \
+  if (LUCENE->rebuilding(LUCENE->resolve(*v8::String::Utf8Value(args[I])))) { \
+      return ThrowException(Exception::Error(String::New("The index is being rebuilt"))); \
+  }
+
+// Documents to index must fit in setMemoryLimits' maxRequestMB
+#define REQ_BATCH_WITHIN_LIMIT(LUCENE, BYTES) \
+  if (LUCENE->maxRequestBytes_ > 0 && (BYTES) > LUCENE->maxRequestBytes_) { \
+      return ThrowException(Exception::RangeError(String::New("ENOMEM: the documents are above maxRequestMB"))); \
+  }
+
+// A query string or a query tree.  Trees are built into VAR (a Query*) right
+// away; VAR stays 0 for strings, which the job parses itself.
+#define REQ_QUERY_ARG(I, VAR) \
+  if (args.Length() < (I + 1) || !(args[I]->IsString() || args[I]->IsObject())) { \
+      return ThrowException(Exception::TypeError(String::New("Argument " #I " must be a query string or a query tree"))); \
+  } \
+  Query* VAR = 0; \
+  if (!args[I]->IsString()) { \
+      try { \
+          VAR = build_query(args[I]); \
+      } catch (std::string& E) { \
+          return ThrowException(Exception::TypeError(String::New(E.c_str()))); \
+      } catch (CLuceneError& E) { \
+          return ThrowException(Exception::TypeError(String::New(E.what()))); \
+      } \
+  }
+
+// Reads options.tenant into VAR; calls on a tenant-mode index must name their tenant
+#define REQ_TENANT(LUCENE, I, OPTS, VAR) \
+  tenant_scope_t VAR; \
+  const char* VAR##Error = LUCENE->tenant_scope(LUCENE->resolve(*v8::String::Utf8Value(args[I])), OPTS, VAR); \
+  if (VAR##Error != 0) { \
+      return ThrowException(Exception::TypeError(String::New(VAR##Error))); \
+  }
+
+// For calls that would see every tenant's documents: throws when the index
+// is in tenant mode
+#define REQ_NO_TENANT(LUCENE, I, WHY) \
+  if (LUCENE->tenantFields_.find(LUCENE->resolve(*v8::String::Utf8Value(args[I]))) != LUCENE->tenantFields_.end()) { \
+      return ThrowException(Exception::Error(String::New("The index is in tenant mode: " WHY))); \
+  }
+
+// Reads opts[name] as an array of strings; leaves out untouched if it is not an array
+static void opt_string_array(Handle<Object> opts, const char* name, std::vector<std::string>& out) {
+    Local<Value> value = opts->Get(String::NewSymbol(name));
+    if (!value->IsArray()) {
+        return;
+    }
+    Local<v8::Array> array = Local<v8::Array>::Cast(value);
+    for (uint32_t i = 0; i < array->Length(); ++i) {
+        out.push_back(*String::Utf8Value(array->Get(i)));
+    }
+}
+
+static bool opt_bool(Handle<Object> opts, const char* name, bool defaultValue) {
+    Local<Value> value = opts->Get(String::NewSymbol(name));
+    return value->IsUndefined() ? defaultValue : value->BooleanValue();
+}
+
+// High resolution (ns) timings of the phases of one request.  They are always
+// recorded, but only handed to the callback when it asked for {timings: true}.
+struct phase_timings_t
+{
+    phase_timings_t() : enabled(false), queuedAt(0), queue(0), reader(0), parse(0),
+        search(0), load(0), convert(0) { }
+
+    // Called on the main thread right before uv_queue_work
+    void queued() {
+        queuedAt = uv_hrtime();
+        metrics_add(&Metrics::instance().queueDepth, 1);
+    }
+
+    // Called from the threadpool when the job starts running
+    uint64_t started() {
+        uint64_t now = uv_hrtime();
+        queue = now - queuedAt;
+        metrics_add(&Metrics::instance().queueDepth, -1);
+        return now;
+    }
+
+    // Time since the request was queued
+    uint64_t elapsed() const {
+        return uv_hrtime() - queuedAt;
+    }
+
+    // Returns the time elapsed since since and resets since to now
+    static uint64_t lap(uint64_t& since) {
+        uint64_t now = uv_hrtime();
+        uint64_t elapsed = now - since;
+        since = now;
+        return elapsed;
+    }
+
+    Local<Object> ToObject() const {
+        Local<Object> result = Object::New();
+        result->Set(String::NewSymbol("queue"), Number::New((double)queue));
+        result->Set(String::NewSymbol("reader"), Number::New((double)reader));
+        result->Set(String::NewSymbol("parse"), Number::New((double)parse));
+        result->Set(String::NewSymbol("search"), Number::New((double)search));
+        result->Set(String::NewSymbol("load"), Number::New((double)load));
+        result->Set(String::NewSymbol("convert"), Number::New((double)convert));
+        result->Set(String::NewSymbol("total"), Number::New((double)(queue + reader + parse + search + load + convert)));
+        return result;
+    }
+
+    bool enabled;
+    uint64_t queuedAt;
+    uint64_t queue;     // waiting in the threadpool queue
+    uint64_t reader;    // acquiring (opening or reopening) the reader
+    uint64_t parse;     // parsing the query
+    uint64_t search;    // running the query and collecting hits
+    uint64_t load;      // loading stored fields
+    uint64_t convert;   // building the V8 result objects
+};
+
+static uint32_t opt_uint(Handle<Object> opts, const char* name, uint32_t defaultValue) {
+    Local<Value> value = opts->Get(String::NewSymbol(name));
+    return value->IsNumber() ? value->Uint32Value() : defaultValue;
+}
+
+struct scored_doc
+{
+    scored_doc(int32_t doc_, float_t score_) : doc(doc_), score(score_) { }
+
+    // Best score first, ties in index order, the same order Hits uses
+    bool operator<(const scored_doc& other) const {
+        return score > other.score || (score == other.score && doc < other.doc);
+    }
+
+    int32_t doc;
+    float_t score;
+};
+
+// Thrown out of LimitedCollector::collect to stop a search early
+struct collect_limit_exceeded
+{
+    enum Reason { MAX_HITS, DEADLINE, ABORTED };
+    collect_limit_exceeded(Reason reason_) : reason(reason_) { }
+    Reason reason;
+};
+
+// options.timeoutMs as a uv_hrtime() deadline counted from now, 0 for none
+static uint64_t opt_deadline(Handle<Object> opts) {
+    uint32_t timeoutMs = opt_uint(opts, "timeoutMs", 0);
+    return timeoutMs > 0 ? uv_hrtime() + (uint64_t)timeoutMs * 1000000 : 0;
+}
+
+// When a job has to stop: a deadline (uv_hrtime() based, 0 for none) and/or
+// a flag another thread sets to abort it (0 for none)
+class CollectDeadline
+{
 public:
-    static void Initialize(v8::Handle<v8::Object> target) {
+    CollectDeadline(uint64_t deadline, const volatile int32_t* aborted)
+        : deadline_(deadline), aborted_(aborted), calls_(0) { }
+
+    bool expired() const {
+        return (aborted_ != 0 && *aborted_) || (deadline_ != 0 && uv_hrtime() > deadline_);
+    }
+
+    // Throws once the job has to stop
+    void check() const {
+        if (aborted_ != 0 && *aborted_) {
+            throw collect_limit_exceeded(collect_limit_exceeded::ABORTED);
+        }
+        if (deadline_ != 0 && uv_hrtime() > deadline_) {
+            throw collect_limit_exceeded(collect_limit_exceeded::DEADLINE);
+        }
+    }
+
+    // check() for every document visited; uv_hrtime is cheap but not free,
+    // so only look at the clock now and then
+    void tick() {
+        if ((deadline_ != 0 || aborted_ != 0) && (calls_++ & 0xff) == 0) {
+            check();
+        }
+    }
+
+private:
+    uint64_t deadline_;
+    const volatile int32_t* aborted_;
+    uint32_t calls_;
+};
+
+// Gathers every hit of a search, but gives up once maxHits have been collected
+// or the deadline has passed or the job was aborted.  Whatever was collected
+// up to that point stays in hits.  Fed by collect_matches, which stops the
+// scorer cleanly when collect throws; never hand it to IndexSearcher::search.
+class LimitedCollector
+{
+public:
+    LimitedCollector(size_t maxHits, uint64_t deadline_, const volatile int32_t* aborted = 0)
+        : deadline(deadline_, aborted), maxHits_(maxHits) { }
+
+    void collect(const int32_t doc, const float_t score) {
+        if (hits.size() >= maxHits_) {
+            throw collect_limit_exceeded(collect_limit_exceeded::MAX_HITS);
+        }
+        hits.push_back(scored_doc(doc, score));
+    }
+
+    std::vector<scored_doc> hits;
+    // Checked by collect_matches as it walks the matches
+    CollectDeadline deadline;
+
+private:
+    size_t maxHits_;
+};
+
+// Only counts hits, giving up like LimitedCollector
+class CountingCollector
+{
+public:
+    CountingCollector(size_t limit, uint64_t deadline_, const volatile int32_t* aborted)
+        : count(0), deadline(deadline_, aborted), limit_(limit) { }
+
+    void collect(const int32_t doc, const float_t score) {
+        if (count >= limit_) {
+            throw collect_limit_exceeded(collect_limit_exceeded::MAX_HITS);
+        }
+        ++count;
+    }
+
+    size_t count;
+    CollectDeadline deadline;
+
+private:
+    size_t limit_;
+};
+
+// Thrown by memory_charge_t::add once a request holds more than its limit
+struct memory_limit_exceeded
+{
+};
+
+// Native bytes one job or cache entry holds for an index, counted in
+// IndexMetrics::memory until it goes away.  add may run on any thread.
+struct memory_charge_t
+{
+    memory_charge_t() : metrics(0), kind(MEM_RESULTS), limit(0), bytes(0) { }
+    ~memory_charge_t() { add(-bytes); }
+
+    void init(IndexMetrics* metrics_, int kind_, int64_t limit_ = 0) {
+        metrics = metrics_;
+        kind = kind_;
+        limit = limit_;
+    }
+
+    // Counts amount even when it throws, so the destructor gives it all back
+    void add(int64_t amount) {
+        bytes += amount;
+        Metrics::instance().addMemory(metrics, kind, amount);
+        if (limit > 0 && bytes > limit) {
+            throw memory_limit_exceeded();
+        }
+    }
+
+    IndexMetrics* metrics;
+    int kind;
+    int64_t limit;      // 0: no limit
+    int64_t bytes;
+};
+
+// Tells V8 about the native memory it can't see, so that garbage collection
+// feels the pressure.  Batches are left out: they are Documents, which report
+// their own bytes.  Main thread only.
+static void report_external_memory() {
+    static int64_t reported = 0;
+    Metrics& metrics = Metrics::instance();
+    int64_t bytes = metrics.memoryBytes() - metrics.totals().memory[MEM_BATCHES];
+    if (bytes != reported) {
+        V8::AdjustAmountOfExternalAllocatedMemory(bytes - reported);
+        reported = bytes;
+    }
+}
+
+struct analyzer_spec_t
+{
+    analyzer_spec_t(const std::string& kind_ = "standard") : kind(kind_), hasStopWords(false) { }
+
+    std::string kind;               // standard, simple, whitespace, keyword, stop or snowball
+    bool hasStopWords;              // false: the analyzer's own default list
+    std::vector<std::string> stopWords;
+    std::string language;           // snowball only
+};
+
+// A PerFieldAnalyzerWrapper built from analyzer_spec_ts, together with the
+// stop word strings the analyzers keep pointing into.
+class AnalyzerSet
+{
+public:
+    // Throws std::string when a spec can't be built
+    AnalyzerSet(const analyzer_spec_t& defaultSpec, const std::map<std::string, analyzer_spec_t>& fieldSpecs) : wrapper_(0) {
+        try {
+            wrapper_ = _CLNEW PerFieldAnalyzerWrapper(build(defaultSpec));
+            for (std::map<std::string, analyzer_spec_t>::const_iterator it = fieldSpecs.begin(); it != fieldSpecs.end(); ++it) {
+                TCHAR* field = STRDUP_AtoT(it->first.c_str());
+                wrapper_->addAnalyzer(field, build(it->second));
+                free(field);
+            }
+        } catch (...) {
+            release();
+            throw;
+        }
+    }
+
+    ~AnalyzerSet() {
+        release();
+    }
+
+    Analyzer* analyzer() { return wrapper_; }
+
+private:
+    const TCHAR** stop_words(const analyzer_spec_t& spec) {
+        if (!spec.hasStopWords) {
+            return 0;
+        }
+        const TCHAR** list = new const TCHAR*[spec.stopWords.size() + 1];
+        for (size_t i = 0; i < spec.stopWords.size(); ++i) {
+            strings_.push_back(STRDUP_AtoT(spec.stopWords[i].c_str()));
+            list[i] = strings_.back();
+        }
+        list[spec.stopWords.size()] = 0;
+        lists_.push_back(list);
+        return list;
+    }
+
+    Analyzer* build(const analyzer_spec_t& spec) {
+        if (spec.kind == "standard") {
+            const TCHAR** stopWords = stop_words(spec);
+            return stopWords ? _CLNEW standard::StandardAnalyzer(stopWords) : _CLNEW standard::StandardAnalyzer();
+        } else if (spec.kind == "simple") {
+            return _CLNEW SimpleAnalyzer();
+        } else if (spec.kind == "whitespace") {
+            return _CLNEW WhitespaceAnalyzer();
+        } else if (spec.kind == "keyword") {
+            return _CLNEW KeywordAnalyzer();
+        } else if (spec.kind == "stop") {
+            const TCHAR** stopWords = stop_words(spec);
+            return stopWords ? _CLNEW StopAnalyzer(stopWords) : _CLNEW StopAnalyzer();
+        } else if (spec.kind == "snowball") {
+#ifdef NODE_CLUCENE_HAVE_SNOWBALL
+            strings_.push_back(STRDUP_AtoT(spec.language.empty() ? "English" : spec.language.c_str()));
+            return _CLNEW snowball::SnowballAnalyzer(strings_.back(), stop_words(spec));
+#else
+            throw std::string("The snowball analyzer needs CLucene contribs; rebuild with NODE_CLUCENE_HAVE_SNOWBALL");
+#endif
+        }
+        throw "Unknown analyzer " + spec.kind;
+    }
+
+    void release() {
+        _CLDELETE(wrapper_);
+        for (size_t i = 0; i < lists_.size(); ++i) {
+            delete[] lists_[i];
+        }
+        for (size_t i = 0; i < strings_.size(); ++i) {
+            free(strings_[i]);
+        }
+        lists_.clear();
+        strings_.clear();
+    }
+
+    PerFieldAnalyzerWrapper* wrapper_;
+    std::vector<TCHAR*> strings_;
+    std::vector<const TCHAR**> lists_;
+};
+
+// Replays tokens that were produced outside of CLucene, so fields fed with it
+// skip analysis entirely.  Owned (and deleted) by the Field it is set on.
+class PreTokenizedStream : public TokenStream
+{
+public:
+    struct token_t
+    {
+        TCHAR* text;
+        int32_t increment;  // position increment, as in Token::setPositionIncrement
+        int32_t start;      // character offsets into the original text
+        int32_t end;
+    };
+
+    PreTokenizedStream() : next_(0) { }
+
+    ~PreTokenizedStream() {
+        for (size_t i = 0; i < tokens_.size(); ++i) {
+            free(tokens_[i].text);
+        }
+    }
+
+    // Takes ownership of text
+    void add(TCHAR* text, int32_t increment, int32_t start, int32_t end) {
+        token_t token = { text, increment, start, end };
+        tokens_.push_back(token);
+    }
+
+    Token* next(Token* token) {
+        if (next_ >= tokens_.size()) {
+            return NULL;
+        }
+        const token_t& current = tokens_[next_++];
+        token->set(current.text, current.start, current.end);
+        token->setPositionIncrement(current.increment);
+        return token;
+    }
+
+    void close() { }
+
+    // Lets a document holding this stream be indexed more than once
+    void reset() { next_ = 0; }
+
+private:
+    std::vector<token_t> tokens_;
+    size_t next_;
+};
+
+struct highlight_spec_t
+{
+    highlight_spec_t() : fragments(3), size(100), pre("<em>"), post("</em>") { }
+
+    bool enabled() const { return !field.empty(); }
+
+    std::string field;      // stored field the fragments are cut from
+    uint32_t fragments;     // at most this many fragments per hit
+    uint32_t size;          // fragment length in characters
+    std::string pre;        // wrapped around every match
+    std::string post;
+};
+
+// Reads {highlight: 'field'} or {highlight: {field, fragments, size, pre, post}}
+static void opt_highlight(Handle<Object> opts, highlight_spec_t& spec) {
+    Local<Value> value = opts->Get(String::NewSymbol("highlight"));
+    if (value->IsString()) {
+        spec.field = *String::Utf8Value(value);
+        return;
+    }
+    if (!value->IsObject()) {
+        return;
+    }
+    Local<Object> highlight = value->ToObject();
+    spec.field = *String::Utf8Value(highlight->Get(String::NewSymbol("field")));
+    spec.fragments = opt_uint(highlight, "fragments", spec.fragments);
+    spec.size = std::max(opt_uint(highlight, "size", spec.size), (uint32_t)1);
+    if (highlight->Get(String::NewSymbol("pre"))->IsString()) {
+        spec.pre = *String::Utf8Value(highlight->Get(String::NewSymbol("pre")));
+    }
+    if (highlight->Get(String::NewSymbol("post"))->IsString()) {
+        spec.post = *String::Utf8Value(highlight->Get(String::NewSymbol("post")));
+    }
+}
+
+// Cuts fragments with the query's matches marked out of a stored field.  Match
+// offsets come from the term vector when the field was indexed with
+// TERMVECTOR_WITH_OFFSETS; otherwise the stored text is analyzed again.
+// Built once per query, on the worker thread.
+class Highlighter
+{
+public:
+    typedef std::basic_string<TCHAR> tstring;
+
+    Highlighter(const highlight_spec_t& spec, Query* query, IndexReader* reader, Analyzer* analyzer)
+        : spec_(spec), reader_(reader), analyzer_(analyzer), field_(STRDUP_AtoT(spec.field.c_str()))
+    {
+        // Prefix, wildcard and range queries only know their terms once rewritten
+        Query* rewritten = query;
+        TermSet terms;
+        try {
+            for (Query* next = rewritten->rewrite(reader); next != rewritten; next = rewritten->rewrite(reader)) {
+                if (rewritten != query) {
+                    _CLLDELETE(rewritten);
+                }
+                rewritten = next;
+            }
+            rewritten->extractTerms(&terms);
+        } catch (...) {
+            release_terms(terms);
+            if (rewritten != query) {
+                _CLLDELETE(rewritten);
+            }
+            free(field_);
+            throw;
+        }
+
+        for (TermSet::iterator it = terms.begin(); it != terms.end(); ++it) {
+            if (_tcscmp((*it)->field(), field_) == 0) {
+                terms_.insert(tstring((*it)->text()));
+            }
+        }
+        release_terms(terms);
+        if (rewritten != query) {
+            _CLLDELETE(rewritten);
+        }
+    }
+
+    ~Highlighter() {
+        free(field_);
+    }
+
+    // Appends up to spec.fragments fragments of doc, best first
+    void highlight(int32_t docId, Document& doc, std::vector<std::string>& out) const {
+        const TCHAR* text = doc.get(field_);
+        if (text == 0 || terms_.empty()) {
+            return;
+        }
+        std::vector<span_t> spans;
+        if (!term_vector_spans(docId, spans)) {
+            analyzed_spans(text, spans);
+        }
+        fragments(text, spans, out);
+    }
+
+private:
+    struct span_t
+    {
+        span_t(int32_t start_, int32_t end_) : start(start_), end(end_) { }
+        bool operator<(const span_t& other) const { return start < other.start; }
+        int32_t start;
+        int32_t end;
+    };
+
+    struct fragment_t
+    {
+        fragment_t(int32_t start_, int32_t end_, size_t first_, size_t last_)
+            : start(start_), end(end_), first(first_), last(last_) { }
+        // Most matches first, ties in text order
+        bool operator<(const fragment_t& other) const {
+            return last - first > other.last - other.first ||
+                (last - first == other.last - other.first && start < other.start);
+        }
+        int32_t start;
+        int32_t end;
+        size_t first;   // matches [first, last) fall into this fragment
+        size_t last;
+    };
+
+    static void release_terms(TermSet& terms) {
+        for (TermSet::iterator it = terms.begin(); it != terms.end(); ++it) {
+            Term* term = *it;
+            _CLDECDELETE(term);
+        }
+        terms.clear();
+    }
+
+    static std::string utf8(const TCHAR* text, int32_t length) {
+        tstring piece(text, length);
+        char* converted = STRDUP_TtoA(piece.c_str());
+        std::string result(converted);
+        free(converted);
+        return result;
+    }
+
+    // False when the field has no term vector with offsets for docId
+    bool term_vector_spans(int32_t docId, std::vector<span_t>& spans) const {
+        TermFreqVector* vector = reader_->getTermFreqVector(docId, field_);
+        if (vector == 0) {
+            return false;
+        }
+        TermPositionVector* positions = vector->__asTermPositionVector();
+        bool haveOffsets = positions != 0 && positions->size() > 0 && positions->getOffsets(0) != 0;
+        if (haveOffsets) {
+            for (std::set<tstring>::const_iterator it = terms_.begin(); it != terms_.end(); ++it) {
+                int32_t index = positions->indexOf(it->c_str());
+                if (index < 0) {
+                    continue;
+                }
+                const ArrayBase<TermVectorOffsetInfo*>* offsets = positions->getOffsets(index);
+                for (size_t k = 0; offsets != 0 && k < offsets->length; ++k) {
+                    spans.push_back(span_t(offsets->values[k]->getStartOffset(), offsets->values[k]->getEndOffset()));
+                }
+            }
+        }
+        _CLLDELETE(vector);
+        return haveOffsets;
+    }
+
+    void analyzed_spans(const TCHAR* text, std::vector<span_t>& spans) const {
+        StringReader input(text, -1, false);
+        TokenStream* stream = analyzer_->tokenStream(field_, &input);
+        try {
+            Token token;
+            while (stream->next(&token) != 0) {
+                if (terms_.count(tstring(token.termBuffer(), token.termLength())) > 0) {
+                    spans.push_back(span_t(token.startOffset(), token.endOffset()));
+                }
+            }
+        } catch (...) {
+            stream->close();
+            _CLDELETE(stream);
+            throw;
+        }
+        stream->close();
+        _CLDELETE(stream);
+    }
+
+    // Splits text into windows of about spec.size characters (stretched so no
+    // word or match is cut in two) and renders the ones with the most matches
+    void fragments(const TCHAR* text, std::vector<span_t>& spans, std::vector<std::string>& out) const {
+        int32_t length = (int32_t)_tcslen(text);
+        std::sort(spans.begin(), spans.end());
+
+        // Overlapping spans (stacked synonyms, repeated terms) become one match
+        std::vector<span_t> matches;
+        for (size_t i = 0; i < spans.size(); ++i) {
+            int32_t end = std::min(spans[i].end, length);
+            if (spans[i].start < 0 || spans[i].start >= end) {
+                continue;
+            }
+            if (!matches.empty() && spans[i].start <= matches.back().end) {
+                matches.back().end = std::max(matches.back().end, end);
+            } else {
+                matches.push_back(span_t(spans[i].start, end));
+            }
+        }
+
+        std::vector<fragment_t> candidates;
+        size_t next = 0;
+        for (int32_t start = 0; start < length && next < matches.size(); ) {
+            // Windows start and end on word boundaries
+            while (start < length && _istspace(text[start])) {
+                ++start;
+            }
+            int32_t end = std::min(length, start + (int32_t)spec_.size);
+            while (end < length && !_istspace(text[end])) {
+                ++end;
+            }
+            size_t first = next;
+            while (next < matches.size() && matches[next].start < end) {
+                end = std::max(end, matches[next].end);
+                ++next;
+            }
+            if (next > first) {
+                candidates.push_back(fragment_t(start, end, first, next));
+            }
+            start = end;
+        }
+        std::sort(candidates.begin(), candidates.end());
+
+        for (size_t i = 0; i < candidates.size() && i < spec_.fragments; ++i) {
+            const fragment_t& fragment(candidates[i]);
+            std::string result;
+            int32_t at = fragment.start;
+            for (size_t m = fragment.first; m < fragment.last; ++m) {
+                result += utf8(text + at, matches[m].start - at);
+                result += spec_.pre;
+                result += utf8(text + matches[m].start, matches[m].end - matches[m].start);
+                result += spec_.post;
+                at = matches[m].end;
+            }
+            result += utf8(text + at, fragment.end - at);
+            out.push_back(result);
+        }
+    }
+
+    highlight_spec_t spec_;
+    IndexReader* reader_;
+    Analyzer* analyzer_;
+    TCHAR* field_;
+    std::set<tstring> terms_;
+};
+
+// Lucene names generations of segments_N and .del files in base 36
+static int64_t parse_base36(const std::string& digits) {
+    int64_t value = 0;
+    for (size_t i = 0; i < digits.size(); ++i) {
+        char c = digits[i];
+        int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'z') ? c - 'a' + 10 : -1;
+        if (digit < 0) {
+            return -1;
+        }
+        value = value * 36 + digit;
+    }
+    return value;
+}
+
+static std::string base36(int64_t value) {
+    std::string digits;
+    do {
+        int digit = (int)(value % 36);
+        digits.insert(digits.begin(), (char)(digit < 10 ? '0' + digit : 'a' + digit - 10));
+        value /= 36;
+    } while (value > 0);
+    return digits;
+}
+
+// Generation N of a segments_N file name ("segments" is generation 0), -1
+// for anything else
+static int64_t segments_generation(const std::string& file) {
+    if (file == "segments") {
+        return 0;
+    }
+    if (file.compare(0, 9, "segments_") != 0) {
+        return -1;
+    }
+    return parse_base36(file.substr(9));
+}
+
+// SerialMergeScheduler's loop (merges run one at a time on the thread that
+// asked for them), counting each merge in metrics
+class CountingMergeScheduler : public MergeScheduler
+{
+public:
+    explicit CountingMergeScheduler(IndexMetrics* metrics) : metrics_(metrics) {
+        uv_mutex_init(&lock_);
+    }
+
+    ~CountingMergeScheduler() {
+        uv_mutex_destroy(&lock_);
+    }
+
+    void merge(IndexWriter* writer) {
+        uv_mutex_lock(&lock_);
+        try {
+            for (MergePolicy::OneMerge* merge = writer->getNextMerge(); merge != 0; merge = writer->getNextMerge()) {
+                writer->merge(merge);
+                Metrics::instance().addCounter(metrics_, &IndexMetrics::merges, 1);
+            }
+        } catch (...) {
+            uv_mutex_unlock(&lock_);
+            throw;
+        }
+        uv_mutex_unlock(&lock_);
+    }
+
+    void close() { }
+
+    static const char* getClassName() { return "CountingMergeScheduler"; }
+    const char* getObjectName() const { return getClassName(); }
+
+private:
+    IndexMetrics* metrics_;
+    uv_mutex_t lock_;
+};
+
+// Keeps only the last commit, like KeepOnlyLastCommitDeletionPolicy, except
+// for commits pinned by a running snapshot.  Every writer and reader this
+// module opens on an index shares that index's policy.
+class SnapshotDeletionPolicy : public IndexDeletionPolicy
+{
+public:
+    SnapshotDeletionPolicy() : oldestLive_(0) {
+        uv_mutex_init(&lock_);
+    }
+
+    ~SnapshotDeletionPolicy() {
+        uv_mutex_destroy(&lock_);
+    }
+
+    void onInit(std::vector<IndexCommitPoint*>& commits) {
+        onCommit(commits);
+    }
+
+    void onCommit(std::vector<IndexCommitPoint*>& commits) {
+        uv_mutex_lock(&lock_);
+        int64_t oldestLive = -1;
+        for (size_t i = 0; i < commits.size(); ++i) {
+            std::string segments = commits[i]->getSegmentsFileName();
+            int64_t generation = segments_generation(segments);
+            if (i + 1 < commits.size() && pins_.find(segments) == pins_.end()) {
+                condemned_.insert(generation);
+                commits[i]->deleteCommit();
+            } else if (oldestLive < 0 || generation < oldestLive) {
+                oldestLive = generation;
+            }
+        }
+        // Commits are never older than the ones they replace, so everything
+        // below the oldest commit still around is gone for good; only the
+        // condemned commits between pinned ones need remembering
+        if (oldestLive >= 0) {
+            oldestLive_ = oldestLive;
+            condemned_.erase(condemned_.begin(), condemned_.lower_bound(oldestLive));
+        }
+        uv_mutex_unlock(&lock_);
+    }
+
+    // Keeps the commit written to segmentsFile alive until unpin.  Fails if
+    // the commit has already been handed to the deleter.
+    bool pin(const std::string& segmentsFile) {
+        int64_t generation = segments_generation(segmentsFile);
+        uv_mutex_lock(&lock_);
+        bool pinned = generation >= oldestLive_ && condemned_.find(generation) == condemned_.end();
+        if (pinned) {
+            pins_.insert(segmentsFile);
+        }
+        uv_mutex_unlock(&lock_);
+        return pinned;
+    }
+
+    // The commit gets deleted with the next commit that comes along
+    void unpin(const std::string& segmentsFile) {
+        uv_mutex_lock(&lock_);
+        std::multiset<std::string>::iterator it = pins_.find(segmentsFile);
+        if (it != pins_.end()) {
+            pins_.erase(it);
+        }
+        uv_mutex_unlock(&lock_);
+    }
+
+    static const char* getClassName() { return "SnapshotDeletionPolicy"; }
+    const char* getObjectName() const { return getClassName(); }
+
+private:
+    uv_mutex_t lock_;
+    std::multiset<std::string> pins_;
+    // Generations handed to the deleter that are newer than oldestLive_
+    std::set<int64_t> condemned_;
+    int64_t oldestLive_;
+};
+
+// Which tenant a call on a tenant-mode index is for; field is empty when the
+// index is not in tenant mode
+struct tenant_scope_t
+{
+    bool enabled() const { return !field.empty(); }
+
+    std::string field;
+    std::string tenant;
+};
+
+// Deepest bool nesting build_query accepts
+const static uint32_t MAX_QUERY_TREE_DEPTH = 32;
+
+// Tenants whose filter bits are kept per Lucene object
+const static size_t TENANT_CACHE_SIZE = 1024;
+
+// Joins tenant and id in the _uid of a tenant-mode document; tenants may not
+// contain it
+const static char TENANT_UID_SEPARATOR = '\x1f';
+
+// The documents of one tenant as of one reader version.  Jobs hold a
+// reference while they use the bits, so the cache can replace or evict an
+// entry under them.
+struct tenant_bits_t
+{
+    tenant_bits_t() : version(0), maxDoc(0), bits(0), refs(0), lastUsed(0) { }
+    ~tenant_bits_t() { _CLDELETE(bits); }
+
+    int64_t version;
+    int32_t maxDoc;
+    BitSet* bits;
+    int32_t refs;
+    uint64_t lastUsed;
+    memory_charge_t memory;
+};
+
+// Operation classes that get their own admission limits
+enum {
+    ADMIT_SEARCH = 0,   // search, searchMany, count, getDocuments, terms, getDocumentCount, tenantStats
+    ADMIT_INDEX,        // addDocument, addDocuments, addJSON
+    ADMIT_DELETE,       // deleteDocument, deleteDocumentsByType
+    ADMIT_MAINTENANCE,  // optimize, indexStats, snapshot, rebuild
+    ADMIT_CLASSES
+};
+
+static const char* const ADMIT_NAMES[ADMIT_CLASSES] = { "search", "index", "delete", "maintenance" };
+
+// Bounds how many jobs of each class are in the threadpool (maxInFlight) and
+// how many more wait here for a free slot (maxQueued), so a burst cannot pile
+// up batons without limit.  A job that does not fit fails with EBUSY: the new
+// one, or with shedOldest the one that has waited longest.  While the native
+// memory in Metrics is above maxMemory, searches and indexing fail with ENOMEM.
+// Main thread only.
+class AdmissionControl
+{
+public:
+    AdmissionControl() : maxMemory_(0) { }
+
+    struct limits_t
+    {
+        limits_t() : maxInFlight(0), maxQueued(0), shedOldest(false) { }
+
+        uint32_t maxInFlight;   // 0: no limit, so nothing ever waits here
+        uint32_t maxQueued;
+        bool shedOldest;
+    };
+
+    struct stats_t
+    {
+        stats_t() : inFlight(0), queued(0), admitted(0), rejected(0), shed(0), overMemory(0) { }
+
+        uint32_t inFlight;
+        uint32_t queued;
+        uint64_t admitted;
+        uint64_t rejected;      // turned away because the queue was full
+        uint64_t shed;          // dropped from the queue to make room
+        uint64_t overMemory;    // turned away because of maxMemory
+    };
+
+    // Hands req to uv_queue_work now, once a slot frees up, or fails it with
+    // EBUSY in baton->error.  Either way after runs exactly once, from the
+    // event loop.
+    template <typename Baton>
+    void admit(int cls, uv_work_t* req, uv_work_cb work, uv_after_work_cb after) {
+        Baton* baton = static_cast<Baton*>(req->data);
+        job_t job = { this, cls, req, work, after, &baton->error, &baton->timings };
+        class_t& c = classes_[cls];
+
+        if (maxMemory_ > 0 && (cls == ADMIT_SEARCH || cls == ADMIT_INDEX) &&
+            Metrics::instance().memoryBytes() >= maxMemory_) {
+            ++c.stats.overMemory;
+            reject(job, "ENOMEM: native memory is above maxTotalMB");
+        } else if (c.limits.maxInFlight == 0 || c.stats.inFlight < c.limits.maxInFlight) {
+            start(job);
+        } else if (c.queue.size() < c.limits.maxQueued) {
+            c.queue.push_back(job);
+        } else if (c.limits.shedOldest && !c.queue.empty()) {
+            job_t oldest = c.queue.front();
+            c.queue.pop_front();
+            c.queue.push_back(job);
+            ++c.stats.shed;
+            reject(oldest, std::string("EBUSY: ") + ADMIT_NAMES[cls] + " request shed for a newer one");
+        } else {
+            ++c.stats.rejected;
+            reject(job, std::string("EBUSY: ") + ADMIT_NAMES[cls] + " queue is full");
+        }
+    }
+
+    const limits_t& limits(int cls) const { return classes_[cls].limits; }
+
+    // Jobs already queued stay queued if the new limits are lower
+    void setLimits(int cls, const limits_t& limits) {
+        classes_[cls].limits = limits;
+        dispatch(cls);
+    }
+
+    // Bytes of native memory (see Metrics::memoryBytes) above which searches
+    // and indexing are turned away; 0 for no limit
+    int64_t maxMemory() const { return maxMemory_; }
+    void setMaxMemory(int64_t bytes) { maxMemory_ = bytes; }
+
+    stats_t stats(int cls) const {
+        stats_t stats = classes_[cls].stats;
+        stats.queued = (uint32_t)classes_[cls].queue.size();
+        return stats;
+    }
+
+private:
+    struct job_t
+    {
+        AdmissionControl* owner;
+        int cls;
+        uv_work_t* req;
+        uv_work_cb work;
+        uv_after_work_cb after;
+        std::string* error;
+        phase_timings_t* timings;
+    };
+
+    struct class_t
+    {
+        limits_t limits;
+        stats_t stats;
+        std::deque<job_t> queue;
+    };
+
+    typedef std::map<uv_work_t*, job_t> RunningMap;
+
+    // Jobs in the threadpool, so AfterAdmitted can find their class and after
+    static RunningMap& running() {
+        static RunningMap jobs;
+        return jobs;
+    }
+
+    void start(const job_t& job) {
+        class_t& c = classes_[job.cls];
+        ++c.stats.inFlight;
+        ++c.stats.admitted;
+        running()[job.req] = job;
+        uv_queue_work(uv_default_loop(), job.req, job.work, AfterAdmitted);
+    }
+
+    void dispatch(int cls) {
+        class_t& c = classes_[cls];
+        while (!c.queue.empty() && (c.limits.maxInFlight == 0 || c.stats.inFlight < c.limits.maxInFlight)) {
+            job_t job = c.queue.front();
+            c.queue.pop_front();
+            start(job);
+        }
+    }
+
+    // The job never reaches its work function.  Cancelling right after
+    // queueing only fails if a thread already took it, and then Rejected
+    // returns at once; both end in after on the next loop iteration.
+    static void reject(const job_t& job, const std::string& error) {
+        job.error->assign(error);
+        job.timings->started();
+        uv_queue_work(uv_default_loop(), job.req, Rejected, job.after);
+        uv_cancel(reinterpret_cast<uv_req_t*>(job.req));
+    }
+
+    static void Rejected(uv_work_t* req) { }
+
+    // Frees the slot before after runs: after drops the job's reference on
+    // the Lucene object, which may be the last one
+    static void AfterAdmitted(uv_work_t* req, int status) {
+        RunningMap::iterator it = running().find(req);
+        job_t job = it->second;
+        running().erase(it);
+        --job.owner->classes_[job.cls].stats.inFlight;
+        job.owner->dispatch(job.cls);
+        job.after(req, status);
+        report_external_memory();
+    }
+
+    class_t classes_[ADMIT_CLASSES];
+    int64_t maxMemory_;
+};
+
+class LuceneDocument : public ObjectWrap {
+public:
+    static void Initialize(v8::Handle<v8::Object> target) {
+        HandleScope scope;
+
+        Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+        t->InstanceTemplate()->SetInternalFieldCount(1);
+
+        NODE_SET_PROTOTYPE_METHOD(t, "addField", AddField);
+        NODE_SET_PROTOTYPE_METHOD(t, "addTokens", AddTokens);
+        NODE_SET_PROTOTYPE_METHOD(t, "clear", Clear);
+
+        target->Set(String::NewSymbol("Document"), t->GetFunction());
+    }
+
+    Document* document() { return &doc_; }
+
+    // Rough native size of the fields added so far
+    int64_t bytes() const { return bytes_; }
+
+    void Ref() { ObjectWrap::Ref(); }
+    void Unref() { ObjectWrap::Unref(); }
+
+protected:
+    static Handle<Value> New(const Arguments& args) {
+        HandleScope scope;
+
+        LuceneDocument* newDoc = new LuceneDocument();
+        newDoc->Wrap(args.This());
+
+        return scope.Close(args.This());
+    }
+
+    // args:
+    //   String* key
+    //   String* or Buffer* value
+    //   Integer flags
+    static Handle<Value> AddField(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+        if (Buffer::HasInstance(args[1])) {
+            REQ_NUM_ARG(2);
+            return scope.Close(AddBinaryField(args));
+        }
+        REQ_STR_ARG(1);
+        REQ_NUM_ARG(2);
+        
+        LuceneDocument* docWrapper = ObjectWrap::Unwrap<LuceneDocument>(args.This());
+
+        TCHAR* key = STRDUP_AtoT(*String::Utf8Value(args[0]));
+        TCHAR* value = STRDUP_AtoT(*String::Utf8Value(args[1]));
+
+        try {
+            Field* field = _CLNEW Field(key, value, args[2]->Int32Value());
+            int64_t bytes = sizeof(Field) + (_tcslen(key) + _tcslen(value)) * sizeof(TCHAR);
+            delete key;
+            delete value;
+            docWrapper->document()->add(*field);
+            docWrapper->account(bytes);
+        } catch (CLuceneError& E) {
+            delete key;
+            delete value;
+            return scope.Close(ThrowException(Exception::TypeError(String::New(E.what()))));
+        } catch(...) {
+            delete key;
+            delete value;
+            return scope.Close(ThrowException(Exception::Error(String::New("Unknown internal error while adding field"))));
+        }
+        
+        return scope.Close(Undefined());
+    }
+
+    // Stores the bytes of a Buffer as they are; no charset conversion happens
+    // on the way in or out.  Binary fields are stored only, never indexed.
+    static Handle<Value> AddBinaryField(const Arguments& args) {
+        LuceneDocument* docWrapper = ObjectWrap::Unwrap<LuceneDocument>(args.This());
+        int32_t flags = args[2]->Int32Value();
+        if (!(flags & (Field::STORE_YES | Field::STORE_COMPRESS))) {
+            return ThrowException(Exception::TypeError(String::New("Binary fields must be STORE_YES or STORE_COMPRESS")));
+        }
+        if ((flags & (Field::INDEX_TOKENIZED | Field::INDEX_UNTOKENIZED)) || (flags & Field::TERMVECTOR_YES)) {
+            return ThrowException(Exception::TypeError(String::New("Binary fields can't be indexed")));
+        }
+        flags |= Field::INDEX_NO;
+
+        Local<Object> buffer = args[1]->ToObject();
+        size_t length = Buffer::Length(buffer);
+        TCHAR* key = STRDUP_AtoT(*String::Utf8Value(args[0]));
+
+        try {
+            ValueArray<uint8_t>* data = _CLNEW ValueArray<uint8_t>(length);
+            memcpy(data->values, Buffer::Data(buffer), length);
+            // The field takes ownership of data
+            Field* field = _CLNEW Field(key, data, flags, false);
+            int64_t bytes = sizeof(Field) + _tcslen(key) * sizeof(TCHAR) + length;
+            free(key);
+            docWrapper->document()->add(*field);
+            docWrapper->account(bytes);
+        } catch (CLuceneError& E) {
+            free(key);
+            return ThrowException(Exception::TypeError(String::New(E.what())));
+        } catch(...) {
+            free(key);
+            return ThrowException(Exception::Error(String::New("Unknown internal error while adding field")));
+        }
+
+        return Undefined();
+    }
+
+    // args:
+    //   String* key
+    //   Array* tokens [String*]
+    //   Array* positions (optional) [Integer], non-decreasing token positions
+    //   Array* offsets (optional) [[Integer start, Integer end]]
+    //   Integer flags
+    static Handle<Value> AddTokens(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+        REQ_ARG_COUNT_AND_TYPE(1, Array);
+        if (!args[args.Length() - 1]->IsNumber()) {
+            return ThrowException(Exception::TypeError(String::New("The last argument must be the field flags")));
+        }
+
+        LuceneDocument* docWrapper = ObjectWrap::Unwrap<LuceneDocument>(args.This());
+        int32_t flags = args[args.Length() - 1]->Int32Value();
+        if ((flags & Field::STORE_YES) || (flags & Field::STORE_COMPRESS)) {
+            return ThrowException(Exception::TypeError(String::New("Pre-tokenized fields can't be stored")));
+        }
+        if (!(flags & Field::INDEX_TOKENIZED)) {
+            return ThrowException(Exception::TypeError(String::New("Pre-tokenized fields must be INDEX_TOKENIZED")));
+        }
+
+        Local<v8::Array> tokens = Local<v8::Array>::Cast(args[1]);
+        Local<v8::Array> positions;
+        Local<v8::Array> offsets;
+        if (args.Length() > 3 && args[2]->IsArray()) {
+            positions = Local<v8::Array>::Cast(args[2]);
+        }
+        if (args.Length() > 4 && args[3]->IsArray()) {
+            offsets = Local<v8::Array>::Cast(args[3]);
+        }
+        if ((!positions.IsEmpty() && positions->Length() != tokens->Length()) ||
+            (!offsets.IsEmpty() && offsets->Length() != tokens->Length())) {
+            return ThrowException(Exception::RangeError(String::New("positions and offsets need one entry per token")));
+        }
+
+        PreTokenizedStream* stream = new PreTokenizedStream();
+        int32_t lastPosition = -1;
+        int32_t cursor = 0;
+        int64_t bytes = sizeof(Field) + sizeof(PreTokenizedStream);
+        for (uint32_t i = 0; i < tokens->Length(); ++i) {
+            TCHAR* text = STRDUP_AtoT(*String::Utf8Value(tokens->Get(i)));
+            int32_t length = (int32_t)_tcslen(text);
+
+            int32_t position = positions.IsEmpty() ? lastPosition + 1 : positions->Get(i)->Int32Value();
+            // Without offsets, pretend the tokens were separated by single spaces
+            int32_t start = cursor, end = cursor + length;
+            if (!offsets.IsEmpty() && offsets->Get(i)->IsArray()) {
+                Local<v8::Array> offset = Local<v8::Array>::Cast(offsets->Get(i));
+                start = offset->Get(0)->Int32Value();
+                end = offset->Get(1)->Int32Value();
+            }
+            if (position < lastPosition || position < 0 || end < start) {
+                free(text);
+                delete stream;
+                return ThrowException(Exception::RangeError(String::New("Token positions must not decrease and offsets must not be reversed")));
+            }
+
+            stream->add(text, position - lastPosition, start, end);
+            bytes += sizeof(PreTokenizedStream::token_t) + (length + 1) * sizeof(TCHAR);
+            lastPosition = position;
+            cursor = end + 1;
+        }
+
+        TCHAR* key = STRDUP_AtoT(*String::Utf8Value(args[0]));
+        try {
+            Field* field = _CLNEW Field(key, flags);
+            field->setValue(stream);
+            bytes += _tcslen(key) * sizeof(TCHAR);
+            free(key);
+            docWrapper->document()->add(*field);
+            docWrapper->account(bytes);
+        } catch (CLuceneError& E) {
+            free(key);
+            return scope.Close(ThrowException(Exception::TypeError(String::New(E.what()))));
+        } catch(...) {
+            free(key);
+            return scope.Close(ThrowException(Exception::Error(String::New("Unknown internal error while adding tokens"))));
+        }
+
+        return scope.Close(Undefined());
+    }
+
+    static Handle<Value> Clear(const Arguments& args) {
+        HandleScope scope;
+
+        LuceneDocument* docWrapper = ObjectWrap::Unwrap<LuceneDocument>(args.This());
+        docWrapper->document()->clear();
+        docWrapper->account(-docWrapper->bytes_);
+
+        return scope.Close(Undefined());
+    }
+
+    // The fields live outside the V8 heap; tell its GC what they cost
+    void account(int64_t amount) {
+        bytes_ += amount;
+        V8::AdjustAmountOfExternalAllocatedMemory(amount);
+    }
+
+    LuceneDocument() : ObjectWrap(), bytes_(0) {
+    }
+
+    ~LuceneDocument() {
+        account(-bytes_);
+    }
+private:
+    Document doc_;
+    int64_t bytes_;
+};
+
+class Lucene : public ObjectWrap {
+
+    static Persistent<FunctionTemplate> s_ct;
+
+public:
+    enum {
+        DIRECTORY_FS = 0,   // plain read() based FSDirectory
+        DIRECTORY_MMAP = 1, // FSDirectory reading through mmap
+        DIRECTORY_RAM = 2   // whole index copied into a RAMDirectory
+    };
+    
+private:
+    int m_count;
+    typedef std::map<std::string,IndexReader*> IndexReaderMap;
+    IndexReaderMap readers_;
+    struct directory_entry_t {
+        Directory* directory;
+        uint64_t loadedAt;
+        IndexMetrics* metrics;
+        uint64_t lastUsed;      // useClock_ at the last acquire_reader
+        int64_t memoryBytes;    // estimate, see estimate_memory
+    };
+    typedef std::map<std::string, directory_entry_t> DirectoryMap;
+    DirectoryMap directories_;
+    // A directory is closed once neither directories_ nor any reader opened
+    // on it (cached, leased or retired) refers to it any more, so dropping a
+    // RAM copy never pulls the files out from under a running search.
+    std::map<Directory*, int32_t> directoryRefs_;
+    std::map<IndexReader*, Directory*> readerDirectories_;
+    struct index_options_t {
+        index_options_t() : directoryMode(DIRECTORY_FS), refreshInterval(0) {}
+        int directoryMode;
+        // Only used by DIRECTORY_RAM: how often (ms) the in-memory copy is
+        // reloaded from disk.  0 means load once and keep it.
+        uint64_t refreshInterval;
+    };
+    typedef std::map<std::string, index_options_t> IndexOptionsMap;
+    IndexOptionsMap options_;
+    // Readers are shared between threadpool jobs.  A reader that gets replaced
+    // (reopen, close_reader) while jobs still hold it is parked in retired_ and
+    // destroyed by the last release_reader.
+    struct lease_t {
+        lease_t() : count(0) { }
+        int32_t count;
+        std::string index;
+    };
+    typedef std::map<IndexReader*, lease_t> ReaderLeaseMap;
+    ReaderLeaseMap leases_;
+    std::set<IndexReader*> retired_;
+    uv_mutex_t readersLock_;
+    // Pool limits for directories_ (and their readers); 0 means no limit.
+    // Idle indexes are closed least recently used first.
+    uint32_t maxOpen_;
+    int64_t maxMemory_;
+    uint64_t useClock_;
+    // Opened by index jobs on the threadpool, closed on the main thread;
+    // writerLock_ guards both.  Taken after readersLock_, never before.
+    IndexWriter* writer_;
+    std::string writerIndex_;
+    uv_mutex_t writerLock_;
+    // Shared by the writer and the query parser.  Replaced sets are kept until
+    // the Lucene object goes away, since running jobs may still be using them.
+    analyzer_spec_t defaultAnalyzer_;
+    std::map<std::string, analyzer_spec_t> fieldAnalyzers_;
+    AnalyzerSet* analyzers_;
+    std::vector<AnalyzerSet*> retiredAnalyzers_;
+    // terms({cache: true}) snapshots of one field's term dictionary, keyed by
+    // index and field and rebuilt whenever the reader version moves on
+    struct term_entry_t {
+        term_entry_t(const std::string& text_, int32_t docFreq_) : text(text_), docFreq(docFreq_) { }
+        bool operator<(const term_entry_t& other) const { return text < other.text; }
+        std::string text;
+        int32_t docFreq;
+    };
+    struct term_cache_t {
+        term_cache_t() : refs(1) { }
+        int64_t version;
+        std::vector<term_entry_t> terms;   // sorted by text
+        memory_charge_t memory;
+        int refs;                          // termCaches_'s plus each lookup's
+    };
+    typedef std::map<std::pair<std::string, std::string>, term_cache_t*> TermCacheMap;
+    TermCacheMap termCaches_;
+    uv_mutex_t termCachesLock_;
+    // One per index, handed to every writer and reader opened on it
+    std::map<std::string, SnapshotDeletionPolicy*> policies_;
+    // Replaced when rebuild() swaps an index; kept until the Lucene object
+    // goes away, since running jobs may still be using them
+    std::vector<SnapshotDeletionPolicy*> retiredPolicies_;
+    uv_mutex_t policiesLock_;
+    // Indexes with a rebuild() running; only touched on the main thread
+    std::set<std::string> rebuilding_;
+    // alias name -> index path.  Resolved on the main thread when a call is
+    // made, so jobs already queued keep the index they were started on.
+    std::map<std::string, std::string> aliases_;
+    // index -> tenant field for indexes in tenant mode; only touched on the main thread
+    std::map<std::string, std::string> tenantFields_;
+    // Filter bits per index and tenant, least recently used dropped first
+    typedef std::map<std::pair<std::string, std::string>, tenant_bits_t*> TenantBitsMap;
+    TenantBitsMap tenantBits_;
+    uint64_t tenantClock_;
+    uv_mutex_t tenantBitsLock_;
+    // job id -> abort flag of a running search, searchMany or count; only
+    // touched on the main thread
+    std::map<uint32_t, volatile int32_t*> jobs_;
+    uint32_t nextJob_;
+    // Every async call goes through here on its way to the threadpool
+    AdmissionControl admission_;
+    // setMemoryLimits' maxRequestMB in bytes, 0 for no limit
+    int64_t maxRequestBytes_;
+
+private:
+    static void release_directory(Directory* directory) {
+        directory->close();
+        _CLLDECDELETE(directory);
+    }
+
+    Directory* open_directory(const std::string &index, const index_options_t& options) {
+        FSDirectory* fsDirectory = FSDirectory::getDirectory(index.c_str());
+        // getDirectory hands every caller the same instance for a path, so
+        // the flag is set either way or a previous mode would stick
+        fsDirectory->setUseMMap(options.directoryMode == DIRECTORY_MMAP);
+        if (options.directoryMode == DIRECTORY_RAM) {
+            // Copy every file of the index into memory so that term dictionary
+            // and postings reads never go back to the filesystem
+            RAMDirectory* ramDirectory = _CLNEW RAMDirectory(fsDirectory);
+            release_directory(fsDirectory);
+            return ramDirectory;
+        }
+        return fsDirectory;
+    }
+
+    // Must be called with readersLock_ held
+    index_options_t index_options(const std::string& index) const {
+        IndexOptionsMap::const_iterator it = options_.find(index);
+        return it != options_.end() ? it->second : index_options_t();
+    }
+
+    // The directory cached for index, or 0 when there is none yet or its RAM
+    // copy is due for a refresh; a stale copy is dropped together with the
+    // reader that points into it.
+    // Must be called with readersLock_ held
+    Directory* cached_directory(const std::string& index, const index_options_t& options) {
+        DirectoryMap::iterator dir_it = directories_.find(index);
+        if (dir_it == directories_.end()) {
+            return 0;
+        }
+        bool stale = options.directoryMode == DIRECTORY_RAM && options.refreshInterval > 0 &&
+            Misc::currentTimeMillis() - dir_it->second.loadedAt >= options.refreshInterval;
+        if (stale) {
+            close_directory(index);
+            return 0;
+        }
+        dir_it->second.lastUsed = ++useClock_;
+        return dir_it->second.directory;
+    }
+
+    // Caches directory, opened outside the lock, for index.  If another job
+    // cached one in the meantime that one is kept and directory released.
+    // Returns the cached directory.
+    // Must be called with readersLock_ held
+    Directory* install_directory(const std::string& index, Directory* directory) {
+        DirectoryMap::iterator dir_it = directories_.find(index);
+        if (dir_it != directories_.end()) {
+            release_directory(directory);
+            dir_it->second.lastUsed = ++useClock_;
+            return dir_it->second.directory;
+        }
+        directory_entry_t entry;
+        entry.directory = directory;
+        entry.loadedAt = Misc::currentTimeMillis();
+        entry.metrics = Metrics::instance().forIndex(index);
+        entry.lastUsed = ++useClock_;
+        entry.memoryBytes = 0;
+        directories_[index] = entry;
+        ref_directory(directory);
+        return directory;
+    }
+
+    // Rough heap cost of an open index: the whole index for RAM directories,
+    // otherwise the parts a reader loads up front (term index, norms and
+    // deletions).  mmap'ed and page-cached data is not counted.
+    static int64_t estimate_memory(Directory* directory, bool inMemory) {
+        std::vector<std::string> files;
+        directory->list(&files);
+        int64_t total = 0;
+        for (size_t i = 0; i < files.size(); ++i) {
+            size_t dot = files[i].rfind('.');
+            std::string ext = dot == std::string::npos ? "" : files[i].substr(dot + 1);
+            bool separateNorms = ext.size() > 1 && (ext[0] == 'f' || ext[0] == 's') && isdigit(ext[1]);
+            if (inMemory || ext == "tii" || ext == "nrm" || ext == "del" || separateNorms) {
+                total += directory->fileLength(files[i].c_str());
+            }
+        }
+        return total;
+    }
+
+    // Closes least recently used indexes that no job is using until the pool
+    // is within maxOpen_ and maxMemory_.  keep is never closed.
+    // Must be called with readersLock_ held
+    void evict(const std::string& keep) {
+        if (maxOpen_ == 0 && maxMemory_ == 0) {
+            return;
+        }
+        for (;;) {
+            int64_t memory = 0;
+            for (DirectoryMap::iterator it = directories_.begin(); it != directories_.end(); ++it) {
+                memory += it->second.memoryBytes;
+            }
+            bool overOpen = maxOpen_ > 0 && directories_.size() > maxOpen_;
+            bool overMemory = maxMemory_ > 0 && memory > maxMemory_;
+            if (!overOpen && !overMemory) {
+                return;
+            }
+
+            std::string writerIndex = writer_index();
+            std::set<std::string> busy;
+            for (ReaderLeaseMap::iterator it = leases_.begin(); it != leases_.end(); ++it) {
+                busy.insert(it->second.index);
+            }
+            DirectoryMap::iterator victim = directories_.end();
+            for (DirectoryMap::iterator it = directories_.begin(); it != directories_.end(); ++it) {
+                if (it->first != keep && it->first != writerIndex && busy.find(it->first) == busy.end() &&
+                    (victim == directories_.end() || it->second.lastUsed < victim->second.lastUsed)) {
+                    victim = it;
+                }
+            }
+            if (victim == directories_.end()) {
+                // Everything else is in use; go over the limit rather than wait
+                return;
+            }
+            Metrics::instance().addCounter(victim->second.metrics, &IndexMetrics::evictions, 1);
+            close_directory(std::string(victim->first));
+        }
+    }
+
+    // Must be called with readersLock_ held
+    void close_directory(const std::string& index) {
+        drop_reader(index);
+        DirectoryMap::iterator it = directories_.find(index);
+        if (it != directories_.end()) {
+            unref_directory(it->second.directory);
+            forget_directory(it);
+        }
+    }
+
+    // Must be called with readersLock_ held
+    void ref_directory(Directory* directory) {
+        ++directoryRefs_[directory];
+    }
+
+    // Must be called with readersLock_ held
+    void unref_directory(Directory* directory) {
+        std::map<Directory*, int32_t>::iterator it = directoryRefs_.find(directory);
+        if (it == directoryRefs_.end() || --it->second > 0) {
+            return;
+        }
+        directoryRefs_.erase(it);
+        release_directory(directory);
+    }
+
+    // Must be called with readersLock_ held
+    void forget_directory(DirectoryMap::iterator it) {
+        Metrics::instance().addMemory(it->second.metrics, MEM_READERS, -it->second.memoryBytes);
+        directories_.erase(it);
+    }
+
+    SnapshotDeletionPolicy* deletion_policy(const std::string& index) {
+        uv_mutex_lock(&policiesLock_);
+        SnapshotDeletionPolicy*& policy = policies_[index];
+        if (policy == 0) {
+            policy = new SnapshotDeletionPolicy();
+        }
+        uv_mutex_unlock(&policiesLock_);
+        return policy;
+    }
+
+    // The next writer or reader opened on index gets a fresh policy
+    void retire_deletion_policy(const std::string& index) {
+        uv_mutex_lock(&policiesLock_);
+        std::map<std::string, SnapshotDeletionPolicy*>::iterator it = policies_.find(index);
+        if (it != policies_.end()) {
+            retiredPolicies_.push_back(it->second);
+            policies_.erase(it);
+        }
+        uv_mutex_unlock(&policiesLock_);
+    }
+
+    // Same as IndexWriter(path, analyzer, create), but with the index's
+    // deletion policy so running snapshots keep their files
+    // The index the writer is open on, or "" if there is none
+    std::string writer_index() {
+        uv_mutex_lock(&writerLock_);
+        std::string index = writerIndex_;
+        uv_mutex_unlock(&writerLock_);
+        return index;
+    }
+
+    IndexWriter* open_writer(const std::string& index, bool create) {
+        IndexWriter* writer = _CLNEW IndexWriter(FSDirectory::getDirectory(index.c_str()), true, analyzer(), create,
+            deletion_policy(index), true);
+        // The writer owns (and deletes) its scheduler
+        writer->setMergeScheduler(_CLNEW CountingMergeScheduler(Metrics::instance().forIndex(index)));
+        return writer;
+    }
+
+    // Must be called with readersLock_ held
+    void track_reader(IndexReader* reader, Directory* directory) {
+        readerDirectories_[reader] = directory;
+        ref_directory(directory);
+    }
+
+    // Must be called with readersLock_ held
+    void destroy_reader(IndexReader* reader) {
+        Directory* directory = 0;
+        std::map<IndexReader*, Directory*>::iterator it = readerDirectories_.find(reader);
+        if (it != readerDirectories_.end()) {
+            directory = it->second;
+            readerDirectories_.erase(it);
+        }
+        try {
+            reader->close();
+            _CLLDELETE(reader);
+        } catch (...) {
+            if (directory != 0) {
+                unref_directory(directory);
+            }
+            throw;
+        }
+        if (directory != 0) {
+            unref_directory(directory);
+        }
+    }
+
+    // Must be called with readersLock_ held
+    void retire_reader(IndexReader* reader) {
+        if (leases_.find(reader) != leases_.end()) {
+            retired_.insert(reader);
+        } else {
+            destroy_reader(reader);
+        }
+    }
+
+    // Must be called with readersLock_ held
+    void drop_reader(const std::string& index) {
+        IndexReaderMap::iterator it = readers_.find(index);
+        if (it != readers_.end()) {
+            IndexReader* reader = it->second;
+            readers_.erase(it);
+            retire_reader(reader);
+        }
+    }
+
+    void close_reader(const std::string& index) {
+        uv_mutex_lock(&readersLock_);
+        try {
+            drop_reader(index);
+        } catch (...) {
+            uv_mutex_unlock(&readersLock_);
+            throw;
+        }
+        uv_mutex_unlock(&readersLock_);
+    }
+
+    // A reader of the delete's own on the index on disk.  The cached reader
+    // can be a RAM copy, whose deletions would never reach the disk, so
+    // deletes never go through it.  Hand it to commit_deletes when done.
+    IndexReader* open_delete_reader(const std::string& index, Directory*& directory) {
+        directory = FSDirectory::getDirectory(index.c_str());
+        try {
+            return IndexReader::open(directory, false, deletion_policy(index));
+        } catch (...) {
+            release_directory(directory);
+            directory = 0;
+            throw;
+        }
+    }
+
+    // Writes the deletions made through reader to disk and closes it, then
+    // lets the cached reader go (a RAM copy entirely, so the next read loads
+    // it again) so that the next job sees them
+    void commit_deletes(const std::string& index, IndexReader* reader, Directory* directory) {
+        try {
+            reader->close();
+        } catch (...) {
+            _CLLDELETE(reader);
+            release_directory(directory);
+            throw;
+        }
+        _CLLDELETE(reader);
+        release_directory(directory);
+
+        uv_mutex_lock(&readersLock_);
+        try {
+            if (index_options(index).directoryMode == DIRECTORY_RAM) {
+                close_directory(index);
+            } else {
+                drop_reader(index);
+            }
+        } catch (...) {
+            uv_mutex_unlock(&readersLock_);
+            throw;
+        }
+        uv_mutex_unlock(&readersLock_);
+    }
+
+    // Closes a reader from open_delete_reader after a failure; whatever it
+    // deleted is lost
+    static void abandon_deletes(IndexReader* reader, Directory* directory) {
+        if (reader != 0) {
+            try {
+                reader->close();
+            } catch (...) {
+            }
+            _CLLDELETE(reader);
+        }
+        if (directory != 0) {
+            release_directory(directory);
+        }
+    }
+
+    // Returns the cached (reopened if needed) reader for index.  The reader
+    // stays valid until the matching release_reader, even if another job
+    // reopens or closes the index in the meantime.
+    // Directories and readers are opened and reopened outside readersLock_,
+    // so the synchronous calls never wait on the filesystem: the directory
+    // and cached reader are looked up (and pinned) under the lock, the I/O
+    // runs unlocked, and the result is swapped into the cache under the lock
+    // unless another job has moved the cache on meanwhile.
+    IndexReader* acquire_reader(const std::string& index, std::string& error) {
+        IndexMetrics* metrics = Metrics::instance().forIndex(index);
+        Directory* directory = 0;   // holds a reference of ours while set
+        IndexReader* cached = 0;    // leased by us while set
+        IndexReader* reader = 0;
+        try {
+            index_options_t options;
+            uv_mutex_lock(&readersLock_);
+            try {
+                options = index_options(index);
+                directory = cached_directory(index, options);
+                if (directory != 0) {
+                    ref_directory(directory);
+                    cached = lease_cached_reader(index);
+                }
+            } catch (...) {
+                uv_mutex_unlock(&readersLock_);
+                throw;
+            }
+            uv_mutex_unlock(&readersLock_);
+
+            if (directory == 0) {
+                Directory* opened = open_directory(index, options);
+                uv_mutex_lock(&readersLock_);
+                try {
+                    directory = install_directory(index, opened);
+                    ref_directory(directory);
+                    cached = lease_cached_reader(index);
+                } catch (...) {
+                    uv_mutex_unlock(&readersLock_);
+                    throw;
+                }
+                uv_mutex_unlock(&readersLock_);
+            }
+
+            if (cached == 0) {
+                // Nothing is ever written through a RAM copy, and its commits
+                // are not the disk's, so only disk readers share the policy
+                reader = IndexReader::open(directory, false,
+                    options.directoryMode == DIRECTORY_RAM ? 0 : deletion_policy(index));
+            } else {
+                reader = cached->reopen();
+            }
+            int64_t memoryBytes = reader != cached ? estimate_memory(directory, options.directoryMode == DIRECTORY_RAM) : 0;
+
+            uv_mutex_lock(&readersLock_);
+            try {
+                if (reader == cached) {
+                    // Our lease on the cached reader becomes the caller's
+                    Metrics::instance().addCounter(metrics, &IndexMetrics::cacheHits, 1);
+                    cached = 0;
+                } else {
+                    Metrics::instance().addCounter(metrics,
+                        cached == 0 ? &IndexMetrics::readerOpens : &IndexMetrics::readerReopens, 1);
+                    track_reader(reader, directory);
+                    lease_t& lease = leases_[reader];
+                    lease.index = index;
+                    ++lease.count;
+                    install_reader(index, directory, cached, reader, memoryBytes);
+                }
+            } catch (...) {
+                uv_mutex_unlock(&readersLock_);
+                throw;
+            }
+            uv_mutex_unlock(&readersLock_);
+        } catch (CLuceneError& E) {
+            error.assign(E.what());
+        } catch (...) {
+            error = "Got an unknown exception \n";
+        }
+
+        uv_mutex_lock(&readersLock_);
+        try {
+            if (!error.empty() && reader != 0 && reader != cached) {
+                // Opened but never handed out
+                if (leases_.find(reader) != leases_.end()) {
+                    unlease_reader(reader);
+                } else {
+                    destroy_reader(reader);
+                }
+            }
+            unlease_reader(cached);
+            if (directory != 0) {
+                unref_directory(directory);
+            }
+        } catch (...) {
+            // Whatever failed to close is gone either way
+        }
+        uv_mutex_unlock(&readersLock_);
+        return error.empty() ? reader : 0;
+    }
+
+    // Leases the reader cached for index, if any.
+    // Must be called with readersLock_ held
+    IndexReader* lease_cached_reader(const std::string& index) {
+        IndexReaderMap::iterator it = readers_.find(index);
+        if (it == readers_.end()) {
+            return 0;
+        }
+        lease_t& lease = leases_[it->second];
+        lease.index = index;
+        ++lease.count;
+        return it->second;
+    }
+
+    // Makes reader, just opened on directory in place of previous (0 when
+    // there was none), the cached reader of index.  If the cache has moved on
+    // since previous was looked up, reader is only used by the job that
+    // opened it and goes away with its last lease.
+    // Must be called with readersLock_ held
+    void install_reader(const std::string& index, Directory* directory, IndexReader* previous,
+        IndexReader* reader, int64_t memoryBytes) {
+        IndexReaderMap::iterator it = readers_.find(index);
+        DirectoryMap::iterator dir_it = directories_.find(index);
+        bool current = dir_it != directories_.end() && dir_it->second.directory == directory &&
+            (it == readers_.end() ? previous == 0 : it->second == previous);
+        if (!current) {
+            retired_.insert(reader);
+            return;
+        }
+        if (it != readers_.end()) {
+            readers_.erase(it);
+            retire_reader(previous);
+        }
+        readers_[index] = reader;
+        directory_entry_t& entry = dir_it->second;
+        Metrics::instance().addMemory(entry.metrics, MEM_READERS, memoryBytes - entry.memoryBytes);
+        entry.memoryBytes = memoryBytes;
+        evict(index);
+    }
+
+    // Like acquire_reader, but never opens or reopens anything: returns 0 when
+    // no reader is cached for index yet.  Used by the synchronous calls, which
+    // must not touch the filesystem on the event loop.
+    IndexReader* acquire_cached_reader(const std::string& index) {
+        IndexReader* reader = 0;
+        uv_mutex_lock(&readersLock_);
+        IndexReaderMap::iterator it = readers_.find(index);
+        if (it != readers_.end()) {
+            reader = it->second;
+            lease_t& lease = leases_[reader];
+            lease.index = index;
+            ++lease.count;
+        }
+        uv_mutex_unlock(&readersLock_);
+        return reader;
+    }
+
+    void release_reader(IndexReader* reader) {
+        if (reader == 0) {
+            return;
+        }
+        uv_mutex_lock(&readersLock_);
+        unlease_reader(reader);
+        uv_mutex_unlock(&readersLock_);
+    }
+
+    // Must be called with readersLock_ held
+    void unlease_reader(IndexReader* reader) {
+        if (reader == 0) {
+            return;
+        }
+        ReaderLeaseMap::iterator it = leases_.find(reader);
+        if (it != leases_.end() && --it->second.count <= 0) {
+            leases_.erase(it);
+            if (retired_.erase(reader) > 0) {
+                try {
+                    destroy_reader(reader);
+                } catch (...) {
+                    // Cached readers are only ever read from (deletes use
+                    // readers of their own), so closing loses nothing
+                }
+            }
+        }
+    }
+
+    // A new field:value Term; the caller releases it with _CLDECDELETE
+    static Term* make_term(const std::string& field, const std::string& value) {
+        TCHAR* key = STRDUP_AtoT(field.c_str());
+        TCHAR* text = STRDUP_AtoT(value.c_str());
+        Term* term = _CLNEW Term(key, text);
+        free(key);
+        free(text);
+        return term;
+    }
+
+    // Fills scope for a call on index.  Returns why the call can't go ahead
+    // when the index is in tenant mode but options names no usable tenant,
+    // otherwise 0.
+    const char* tenant_scope(const std::string& index, Handle<Object> options, tenant_scope_t& scope) const {
+        std::map<std::string, std::string>::const_iterator it = tenantFields_.find(index);
+        if (it == tenantFields_.end()) {
+            return 0;
+        }
+        Local<Value> tenant = options->Get(String::NewSymbol("tenant"));
+        if (!tenant->IsString() || tenant->ToString()->Length() == 0) {
+            return "The index is in tenant mode: options.tenant is required";
+        }
+        std::string name = *v8::String::Utf8Value(tenant);
+        // Would make tenant_uid ambiguous across tenants
+        if (name.find(TENANT_UID_SEPARATOR) != std::string::npos) {
+            return "options.tenant must not contain \\x1f";
+        }
+        scope.field = it->second;
+        scope.tenant = name;
+        return 0;
+    }
+
+    // Lets abort(job) reach the flag until unregister_job
+    uint32_t register_job(volatile int32_t* aborted) {
+        uint32_t job = ++nextJob_;
+        jobs_[job] = aborted;
+        return job;
+    }
+
+    void unregister_job(uint32_t job) {
+        jobs_.erase(job);
+    }
+
+    // Ids are only unique within a tenant; _uid holds tenant and id together
+    static std::string tenant_uid(const tenant_scope_t& scope, const std::string& id) {
+        return scope.tenant + TENANT_UID_SEPARATOR + id;
+    }
+
+    static BitSet* collect_tenant_bits(IndexReader* reader, const tenant_scope_t& scope) {
+        BitSet* bits = _CLNEW BitSet(reader->maxDoc());
+        Term* term = make_term(scope.field, scope.tenant);
+        TermDocs* termDocs = 0;
+        try {
+            termDocs = reader->termDocs(term);
+            while (termDocs->next()) {
+                bits->set(termDocs->doc());
+            }
+        } catch (...) {
+            if (termDocs != 0) {
+                termDocs->close();
+                _CLDELETE(termDocs);
+            }
+            _CLDECDELETE(term);
+            _CLDELETE(bits);
+            throw;
+        }
+        termDocs->close();
+        _CLDELETE(termDocs);
+        _CLDECDELETE(term);
+        return bits;
+    }
+
+    // Must be called with tenantBitsLock_ held
+    static void unref_tenant_bits(tenant_bits_t* entry) {
+        if (--entry->refs == 0) {
+            delete entry;
+        }
+    }
+
+    // The documents of scope's tenant in reader, cached until the reader
+    // changes.  Returns 0 outside tenant mode, or when build is false and
+    // nothing is cached.  Pair with release_tenant_bits.
+    tenant_bits_t* acquire_tenant_bits(const std::string& index, IndexReader* reader, const tenant_scope_t& scope,
+        bool build = true) {
+        if (!scope.enabled()) {
+            return 0;
+        }
+        std::pair<std::string, std::string> key(index, scope.tenant);
+        int64_t version = reader->getVersion();
+        int32_t maxDoc = reader->maxDoc();
+
+        uv_mutex_lock(&tenantBitsLock_);
+        TenantBitsMap::iterator it = tenantBits_.find(key);
+        if (it != tenantBits_.end() && it->second->version == version && it->second->maxDoc == maxDoc) {
+            tenant_bits_t* entry = it->second;
+            ++entry->refs;
+            entry->lastUsed = ++tenantClock_;
+            uv_mutex_unlock(&tenantBitsLock_);
+            return entry;
+        }
+        uv_mutex_unlock(&tenantBitsLock_);
+        if (!build) {
+            return 0;
+        }
+
+        // Collected outside the lock; two jobs racing here just both build the bits
+        tenant_bits_t* entry = new tenant_bits_t;
+        entry->version = version;
+        entry->maxDoc = maxDoc;
+        try {
+            entry->bits = collect_tenant_bits(reader, scope);
+        } catch (...) {
+            delete entry;
+            throw;
+        }
+        entry->memory.init(Metrics::instance().forIndex(index), MEM_CACHES);
+        entry->memory.add(sizeof(tenant_bits_t) + sizeof(BitSet) + maxDoc / 8 + 1);
+
+        uv_mutex_lock(&tenantBitsLock_);
+        entry->refs = 2;    // the cache's and the caller's
+        entry->lastUsed = ++tenantClock_;
+        tenant_bits_t*& slot = tenantBits_[key];
+        if (slot != 0) {
+            unref_tenant_bits(slot);
+        }
+        slot = entry;
+        while (tenantBits_.size() > TENANT_CACHE_SIZE) {
+            TenantBitsMap::iterator victim = tenantBits_.begin();
+            for (TenantBitsMap::iterator it = tenantBits_.begin(); it != tenantBits_.end(); ++it) {
+                if (it->second->lastUsed < victim->second->lastUsed) {
+                    victim = it;
+                }
+            }
+            unref_tenant_bits(victim->second);
+            tenantBits_.erase(victim);
+        }
+        uv_mutex_unlock(&tenantBitsLock_);
+        return entry;
+    }
+
+    void release_tenant_bits(tenant_bits_t* entry) {
+        if (entry == 0) {
+            return;
+        }
+        uv_mutex_lock(&tenantBitsLock_);
+        unref_tenant_bits(entry);
+        uv_mutex_unlock(&tenantBitsLock_);
+    }
+
+    void drop_tenant_bits(const std::string& index) {
+        uv_mutex_lock(&tenantBitsLock_);
+        for (TenantBitsMap::iterator it = tenantBits_.begin(); it != tenantBits_.end(); ) {
+            if (it->first.first == index) {
+                unref_tenant_bits(it->second);
+                tenantBits_.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        uv_mutex_unlock(&tenantBitsLock_);
+    }
+public:
+
+    static void Init(Handle<Object> target) {
+        HandleScope scope;
+
+        Local<FunctionTemplate> t = FunctionTemplate::New(New);
+
+        s_ct = Persistent<FunctionTemplate>::New(t);
+        s_ct->InstanceTemplate()->SetInternalFieldCount(1);
+        s_ct->SetClassName(String::NewSymbol("Lucene"));
+
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "addDocument", AddDocumentAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "addDocuments", AddDocumentsAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "addJSON", AddJSONAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "deleteDocument", DeleteDocumentAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "deleteDocumentsByType", DeleteDocumentsByTypeAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "search", SearchAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "optimize", OptimizeAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "closeWriter", CloseWriter);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "getDocumentCount", GetDocumentCountAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setDirectoryMode", SetDirectoryMode);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "getDocuments", GetDocumentsAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "stats", Stats);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "searchSync", SearchSync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "searchMany", SearchManyAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setAnalyzer", SetAnalyzer);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setFieldAnalyzer", SetFieldAnalyzer);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "getDocumentSync", GetDocumentSync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "terms", TermsAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "indexStats", IndexStatsAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "snapshot", SnapshotAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "rebuild", RebuildAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "alias", Alias);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "close", Close);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setPoolLimits", SetPoolLimits);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setAdmissionLimits", SetAdmissionLimits);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setMemoryLimits", SetMemoryLimits);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "setTenantField", SetTenantField);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "tenantStats", TenantStatsAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "count", CountAsync);
+        NODE_SET_PROTOTYPE_METHOD(s_ct, "abort", Abort);
+
+        target->Set(String::NewSymbol("Lucene"), s_ct->GetFunction());
+    }
+
+    Lucene() : ObjectWrap(), m_count(0), maxOpen_(0), maxMemory_(0), useClock_(0), writer_(0), analyzers_(0),
+        tenantClock_(0), nextJob_(0), maxRequestBytes_(0) {
+        uv_mutex_init(&readersLock_);
+        uv_mutex_init(&termCachesLock_);
+        uv_mutex_init(&policiesLock_);
+        uv_mutex_init(&tenantBitsLock_);
+        uv_mutex_init(&writerLock_);
+        // _id and _type are always indexed untokenized, so query them verbatim
+        fieldAnalyzers_["_id"] = analyzer_spec_t("keyword");
+        fieldAnalyzers_["_type"] = analyzer_spec_t("keyword");
+        analyzers_ = new AnalyzerSet(defaultAnalyzer_, fieldAnalyzers_);
+    }
+
+    // Only runs once no job holds a reference any more (every job Ref()s us),
+    // so nothing can be using the writer, readers or directories
+    ~Lucene() {
+        try {
+            close_writer();
+        } catch (...) {
+            // Nobody left to report to
+        }
+        uv_mutex_lock(&readersLock_);
+        while (!directories_.empty()) {
+            try {
+                close_directory(std::string(directories_.begin()->first));
+            } catch (...) {
+                forget_directory(directories_.begin());
+            }
+        }
+        for (IndexReaderMap::iterator it = readers_.begin(); it != readers_.end(); ++it) {
+            retire_reader(it->second);
+        }
+        readers_.clear();
+        for (std::set<IndexReader*>::iterator it = retired_.begin(); it != retired_.end(); ++it) {
+            try {
+                destroy_reader(*it);
+            } catch (...) {
+            }
+        }
+        retired_.clear();
+        leases_.clear();
+        // Whatever a failed close left behind
+        for (std::map<Directory*, int32_t>::iterator it = directoryRefs_.begin(); it != directoryRefs_.end(); ++it) {
+            try {
+                release_directory(it->first);
+            } catch (...) {
+            }
+        }
+        directoryRefs_.clear();
+        readerDirectories_.clear();
+        uv_mutex_unlock(&readersLock_);
+
+        delete analyzers_;
+        for (size_t i = 0; i < retiredAnalyzers_.size(); ++i) {
+            delete retiredAnalyzers_[i];
+        }
+        for (TermCacheMap::iterator it = termCaches_.begin(); it != termCaches_.end(); ++it) {
+            delete it->second;
+        }
+        uv_mutex_destroy(&termCachesLock_);
+        for (std::map<std::string, SnapshotDeletionPolicy*>::iterator it = policies_.begin(); it != policies_.end(); ++it) {
+            delete it->second;
+        }
+        for (size_t i = 0; i < retiredPolicies_.size(); ++i) {
+            delete retiredPolicies_[i];
+        }
+        uv_mutex_destroy(&policiesLock_);
+        for (TenantBitsMap::iterator it = tenantBits_.begin(); it != tenantBits_.end(); ++it) {
+            delete it->second;
+        }
+        uv_mutex_destroy(&tenantBitsLock_);
+        uv_mutex_destroy(&readersLock_);
+        uv_mutex_destroy(&writerLock_);
+    }
+
+    Analyzer* analyzer() { return analyzers_->analyzer(); }
+
+    bool rebuilding(const std::string& index) const { return rebuilding_.find(index) != rebuilding_.end(); }
+
+    // The index path behind an alias; anything else is taken to be a path
+    std::string resolve(const std::string& name) const {
+        std::map<std::string, std::string>::const_iterator it = aliases_.find(name);
+        return it != aliases_.end() ? it->second : name;
+    }
+
+    static Handle<Value> New(const Arguments& args) {
+        HandleScope scope;
+        Lucene* lucene = new Lucene();
+        lucene->writer_ = 0;
+        lucene->Wrap(args.This());
+        return scope.Close(args.This());
+    }
+    
+    typedef std::vector<std::pair<std::string, LuceneDocument*> > DocsAndIds;
+
+    static Local<Object> histogram_to_object(const LatencyHistogram& histogram) {
+        Local<Object> result = Object::New();
+        uint64_t count = histogram.count();
+        result->Set(String::NewSymbol("count"), Number::New((double)count));
+        result->Set(String::NewSymbol("mean"), Number::New(count > 0 ? (double)histogram.sum() / count : 0));
+        result->Set(String::NewSymbol("p50"), Number::New((double)histogram.percentile(50)));
+        result->Set(String::NewSymbol("p90"), Number::New((double)histogram.percentile(90)));
+        result->Set(String::NewSymbol("p99"), Number::New((double)histogram.percentile(99)));
+        result->Set(String::NewSymbol("p999"), Number::New((double)histogram.percentile(99.9)));
+        result->Set(String::NewSymbol("max"), Number::New((double)histogram.max()));
+        return result;
+    }
+
+    static Local<Object> memory_to_object(const IndexMetrics& metrics) {
+        Local<Object> result = Object::New();
+        for (int kind = 0; kind < MEM_KINDS; ++kind) {
+            result->Set(String::NewSymbol(MEM_NAMES[kind]), Number::New((double)metrics.memory[kind]));
+        }
+        return result;
+    }
+
+    static Local<Object> index_metrics_to_object(const IndexMetrics& metrics) {
+        Local<Object> result = Object::New();
+        result->Set(String::NewSymbol("docsIndexed"), Number::New((double)metrics.docsIndexed));
+        result->Set(String::NewSymbol("docsDeleted"), Number::New((double)metrics.docsDeleted));
+        result->Set(String::NewSymbol("flushes"), Number::New((double)metrics.flushes));
+        result->Set(String::NewSymbol("merges"), Number::New((double)metrics.merges));
+        result->Set(String::NewSymbol("writerCloses"), Number::New((double)metrics.writerCloses));
+        result->Set(String::NewSymbol("optimizes"), Number::New((double)metrics.optimizes));
+        result->Set(String::NewSymbol("readerOpens"), Number::New((double)metrics.readerOpens));
+        result->Set(String::NewSymbol("readerReopens"), Number::New((double)metrics.readerReopens));
+        result->Set(String::NewSymbol("cacheHits"), Number::New((double)metrics.cacheHits));
+        result->Set(String::NewSymbol("evictions"), Number::New((double)metrics.evictions));
+
+        Local<Object> operations = Object::New();
+        for (int op = 0; op < OP_COUNT; ++op) {
+            Local<Object> operation = Object::New();
+            operation->Set(String::NewSymbol("count"), Number::New((double)metrics.ops[op].count));
+            operation->Set(String::NewSymbol("errors"), Number::New((double)metrics.ops[op].errors));
+            operation->Set(String::NewSymbol("latency"), histogram_to_object(metrics.ops[op].latency_));
+            operations->Set(String::NewSymbol(OP_NAMES[op]), operation);
+        }
+        result->Set(String::NewSymbol("operations"), operations);
+        result->Set(String::NewSymbol("memory"), memory_to_object(metrics));
+        return result;
+    }
+
+    struct index_metrics_collector {
+        index_metrics_collector(Local<Object> target_) : target(target_) { }
+        void operator()(const std::string& index, const IndexMetrics& metrics) {
+            target->Set(String::New(index.c_str()), index_metrics_to_object(metrics));
+        }
+        Local<Object> target;
+    };
+
+    // Returns process-wide counters, latency histograms (ns) and native memory
+    // (bytes), in total and per index, plus this object's admission queues.
+    static Handle<Value> Stats(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+
+        Metrics& metrics = Metrics::instance();
+        Local<Object> result = Object::New();
+        result->Set(String::NewSymbol("queueDepth"), Number::New((double)metrics.queueDepth));
+        result->Set(String::NewSymbol("ramBufferBytes"), Number::New((double)metrics.ramBufferBytes));
+        result->Set(String::NewSymbol("totals"), index_metrics_to_object(metrics.totals()));
+
+        Local<Object> indexes = Object::New();
+        index_metrics_collector collector(indexes);
+        metrics.each(collector);
+        result->Set(String::NewSymbol("indexes"), indexes);
+
+        Local<Object> admission = Object::New();
+        for (int cls = 0; cls < ADMIT_CLASSES; ++cls) {
+            AdmissionControl::stats_t stats = lucene->admission_.stats(cls);
+            const AdmissionControl::limits_t& limits = lucene->admission_.limits(cls);
+            Local<Object> entry = Object::New();
+            entry->Set(String::NewSymbol("inFlight"), Integer::NewFromUnsigned(stats.inFlight));
+            entry->Set(String::NewSymbol("queued"), Integer::NewFromUnsigned(stats.queued));
+            entry->Set(String::NewSymbol("admitted"), Number::New((double)stats.admitted));
+            entry->Set(String::NewSymbol("rejected"), Number::New((double)stats.rejected));
+            entry->Set(String::NewSymbol("shed"), Number::New((double)stats.shed));
+            entry->Set(String::NewSymbol("overMemory"), Number::New((double)stats.overMemory));
+            entry->Set(String::NewSymbol("maxInFlight"), Integer::NewFromUnsigned(limits.maxInFlight));
+            entry->Set(String::NewSymbol("maxQueued"), Integer::NewFromUnsigned(limits.maxQueued));
+            admission->Set(String::NewSymbol(ADMIT_NAMES[cls]), entry);
+        }
+        result->Set(String::NewSymbol("admission"), admission);
+
+        report_external_memory();
+        Local<Object> memory = memory_to_object(metrics.totals());
+        memory->Set(String::NewSymbol("total"), Number::New((double)metrics.memoryBytes()));
+        memory->Set(String::NewSymbol("maxTotalBytes"), Number::New((double)lucene->admission_.maxMemory()));
+        memory->Set(String::NewSymbol("maxRequestBytes"), Number::New((double)lucene->maxRequestBytes_));
+        result->Set(String::NewSymbol("memory"), memory);
+
+        return scope.Close(result);
+    }
+
+    // A document handed to addJSON, still as text
+    struct json_doc_t {
+        json_doc_t(const std::string& id_) : id(id_) { }
+        std::string id;
+        std::string text;
+    };
+
+    struct index_baton_t {
+        Lucene* lucene;         
+        IndexMetrics* metrics;
+        phase_timings_t timings;
+        std::string index;
+        tenant_scope_t tenant;
+        DocsAndIds docsAndIds;
+        std::vector<json_doc_t> jsonDocs;
+        std::map<std::string, int> mapping;  // field flags for jsonDocs, see json_flags
+        memory_charge_t memory;     // the documents, until they are indexed
+        Persistent<Function> callback;
+        uint64_t indexTime;
+        int32_t docCount;
+        std::string error;
+    };
+    
+    void close_writer() {
+        uv_mutex_lock(&writerLock_);
+        IndexWriter* writer = writer_;
+        std::string index = writerIndex_;
+        writer_ = 0;
+        writerIndex_.clear();
+        uv_mutex_unlock(&writerLock_);
+        if (writer != 0) {
+            if (writer->numRamDocs() > 0) {
+                Metrics::instance().addCounter(Metrics::instance().forIndex(index), &IndexMetrics::flushes, 1);
+            }
+            writer->flush();
+            writer->close(true);
+            delete writer;
+            IndexMetrics* metrics = Metrics::instance().forIndex(index);
+            Metrics::instance().addCounter(metrics, &IndexMetrics::writerCloses, 1);
+            metrics_set(&Metrics::instance().ramBufferBytes, 0);
+            Metrics::instance().setMemory(metrics, MEM_WRITER, 0);
+        }
+    }
+
+    static Handle<Value> CloseWriter(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        
+        lucene->close_writer();
+        //printf("Deleted index writer\n");
+
+        return scope.Close(Undefined());
+    }
+
+    // Closes everything this object holds open for one index: the writer if
+    // it is on that index, the cached reader (once running jobs are done with
+    // it), the directory and term caches.  The next call on the index opens
+    // it again.
+    // args:
+    //   String* indexPath
+    static Handle<Value> Close(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        std::string index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+
+        std::string error;
+        try {
+            if (lucene->writer_index() == index) {
+                lucene->close_writer();
+            }
+        } catch (CLuceneError& E) {
+            error.assign(E.what());
+        }
+        uv_mutex_lock(&lucene->readersLock_);
+        try {
+            lucene->close_directory(index);
+        } catch (CLuceneError& E) {
+            error.assign(E.what());
+        }
+        uv_mutex_unlock(&lucene->readersLock_);
+        lucene->drop_term_caches(index);
+        lucene->drop_tenant_bits(index);
+
+        if (!error.empty()) {
+            return ThrowException(Exception::Error(String::New(error.c_str())));
+        }
+        return scope.Close(Undefined());
+    }
+
+    // args:
+    //   Object* {maxOpen: Integer, maxMemoryMB: Number}, 0 for no limit
+    static Handle<Value> SetPoolLimits(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_OBJ_ARG(0);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        Local<Object> options = args[0]->ToObject();
+
+        uv_mutex_lock(&lucene->readersLock_);
+        lucene->maxOpen_ = opt_uint(options, "maxOpen", lucene->maxOpen_);
+        Local<Value> maxMemoryMB = options->Get(String::NewSymbol("maxMemoryMB"));
+        if (maxMemoryMB->IsNumber()) {
+            lucene->maxMemory_ = maxMemoryMB->NumberValue() > 0 ? (int64_t)(maxMemoryMB->NumberValue() * 1024 * 1024) : 0;
+        }
+        std::string error;
+        try {
+            lucene->evict("");
+        } catch (CLuceneError& E) {
+            error.assign(E.what());
+        }
+        uv_mutex_unlock(&lucene->readersLock_);
+
+        if (!error.empty()) {
+            return ThrowException(Exception::Error(String::New(error.c_str())));
+        }
+        return scope.Close(Undefined());
+    }
+
+    // args:
+    //   Object* limits: {search|index|delete|maintenance: {maxInFlight: Integer, maxQueued: Integer,
+    //                    policy: 'reject' or 'shedOldest'} or null for no limits}
+    // Classes left out keep their limits.
+    static Handle<Value> SetAdmissionLimits(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_OBJ_ARG(0);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        Local<Object> options = args[0]->ToObject();
+
+        AdmissionControl::limits_t limits[ADMIT_CLASSES];
+        bool given[ADMIT_CLASSES];
+        for (int cls = 0; cls < ADMIT_CLASSES; ++cls) {
+            Local<Value> value = options->Get(String::NewSymbol(ADMIT_NAMES[cls]));
+            given[cls] = !value->IsUndefined();
+            if (!value->IsObject()) {
+                if (!value->IsUndefined() && !value->IsNull()) {
+                    return ThrowException(Exception::TypeError(String::New("Admission limits must be objects or null")));
+                }
+                continue;
+            }
+            Local<Object> spec = value->ToObject();
+            limits[cls].maxInFlight = opt_uint(spec, "maxInFlight", 0);
+            limits[cls].maxQueued = opt_uint(spec, "maxQueued", 0);
+            Local<Value> policy = spec->Get(String::NewSymbol("policy"));
+            if (!policy->IsUndefined()) {
+                std::string name(*String::Utf8Value(policy));
+                if (name != "reject" && name != "shedOldest") {
+                    return ThrowException(Exception::TypeError(String::New("policy must be 'reject' or 'shedOldest'")));
+                }
+                limits[cls].shedOldest = name == "shedOldest";
+            }
+        }
+        for (int cls = 0; cls < ADMIT_CLASSES; ++cls) {
+            if (given[cls]) {
+                lucene->admission_.setLimits(cls, limits[cls]);
+            }
+        }
+        return scope.Close(Undefined());
+    }
+
+    // args:
+    //   Object* limits: {maxTotalMB: Number, maxRequestMB: Number}, 0 for no limit
+    // Limits left out stay as they are.
+    static Handle<Value> SetMemoryLimits(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_OBJ_ARG(0);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        Local<Object> options = args[0]->ToObject();
+
+        Local<Value> maxTotalMB = options->Get(String::NewSymbol("maxTotalMB"));
+        if (maxTotalMB->IsNumber()) {
+            lucene->admission_.setMaxMemory(maxTotalMB->NumberValue() > 0 ? (int64_t)(maxTotalMB->NumberValue() * 1024 * 1024) : 0);
+        }
+        Local<Value> maxRequestMB = options->Get(String::NewSymbol("maxRequestMB"));
+        if (maxRequestMB->IsNumber()) {
+            lucene->maxRequestBytes_ = maxRequestMB->NumberValue() > 0 ? (int64_t)(maxRequestMB->NumberValue() * 1024 * 1024) : 0;
+        }
+        return scope.Close(Undefined());
+    }
+
+    // Stops a running search, searchMany or count at its next check; it then
+    // calls back with what it has so far.  clucene.js hands out abort()
+    // handles instead of job ids.
+    // args:
+    //   Integer job, as returned by search, searchMany and count
+    static Handle<Value> Abort(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_NUM_ARG(0);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+
+        std::map<uint32_t, volatile int32_t*>::iterator it = lucene->jobs_.find(args[0]->Uint32Value());
+        if (it == lucene->jobs_.end()) {
+            return scope.Close(False());
+        }
+        __sync_lock_test_and_set(it->second, 1);
+        return scope.Close(True());
+    }
+
+    // Puts an index in tenant mode: documents get field (indexed untokenized,
+    // like _type) set to the tenant of the call that added them, and every
+    // search, lookup and delete on the index must name its tenant and only
+    // sees that tenant's documents.
+    // args:
+    //   String* indexPath
+    //   String* field, or null to leave tenant mode
+    static Handle<Value> SetTenantField(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        std::string index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+
+        if (args.Length() > 1 && args[1]->IsString()) {
+            std::string field = *v8::String::Utf8Value(args[1]);
+            if (field.empty() || field == "_id" || field == "_uid" || field == "_type") {
+                return ThrowException(Exception::Error(String::New("The tenant field must be a field of its own")));
+            }
+            lucene->tenantFields_[index] = field;
+        } else if (args.Length() > 1 && args[1]->IsNull()) {
+            lucene->tenantFields_.erase(index);
+        } else {
+            return ThrowException(Exception::TypeError(String::New("Argument 1 must be a String or null")));
+        }
+        lucene->drop_tenant_bits(index);
+
+        return scope.Close(Undefined());
+    }
+
+    // args:
+    //   String* indexPath
+    //   Integer mode (DIRECTORY_FS, DIRECTORY_MMAP or DIRECTORY_RAM)
+    //   Integer refreshInterval (optional, ms, DIRECTORY_RAM only)
+    static Handle<Value> SetDirectoryMode(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+        REQ_NUM_ARG(1);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+
+        index_options_t options;
+        options.directoryMode = args[1]->Int32Value();
+        if (options.directoryMode < DIRECTORY_FS || options.directoryMode > DIRECTORY_RAM) {
+            return ThrowException(Exception::RangeError(String::New("Unknown directory mode")));
+        }
+        if (args.Length() > 2 && args[2]->IsNumber()) {
+            int64_t refreshInterval = args[2]->IntegerValue();
+            options.refreshInterval = refreshInterval > 0 ? (uint64_t)refreshInterval : 0;
+        }
+
+        std::string index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+
+        // The next reader for this index gets opened through the new directory.
+        // options_ is read by acquire_reader on the threadpool, so it is only
+        // ever changed under readersLock_, together with the cached directory.
+        std::string error;
+        uv_mutex_lock(&lucene->readersLock_);
+        try {
+            lucene->options_[index] = options;
+            lucene->close_directory(index);
+        } catch (CLuceneError& E) {
+            error.assign(E.what());
+        } catch (...) {
+            error = "Got an unknown exception";
+        }
+        uv_mutex_unlock(&lucene->readersLock_);
+
+        if (!error.empty()) {
+            return ThrowException(Exception::Error(String::New(error.c_str())));
+        }
+
+        return scope.Close(Undefined());
+    }
+
+    // Points an alias at an index path, or removes it when path is null.
+    // Jobs already running keep the reader they have; the old index's cached
+    // reader and directory are released (the reader once its last job is
+    // done) unless another alias still points at it.  Returns the previous
+    // path.  alias(name) just returns the current one.
+    // args:
+    //   String* name
+    //   String* path (optional)
+    static Handle<Value> Alias(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+
+        std::string name = *v8::String::Utf8Value(args[0]);
+        std::map<std::string, std::string>::iterator it = lucene->aliases_.find(name);
+        std::string previous = it != lucene->aliases_.end() ? it->second : "";
+        if (args.Length() < 2) {
+            return scope.Close(previous.empty() ? Handle<Value>(Undefined()) : String::New(previous.c_str()));
+        }
+
+        if (args[1]->IsString()) {
+            std::string path = *v8::String::Utf8Value(args[1]);
+            if (path == name || lucene->aliases_.find(path) != lucene->aliases_.end()) {
+                return ThrowException(Exception::Error(String::New("Aliases must point at an index path")));
+            }
+            lucene->aliases_[name] = path;
+        } else if (args[1]->IsNull() || args[1]->IsUndefined()) {
+            if (it != lucene->aliases_.end()) {
+                lucene->aliases_.erase(it);
+            }
+        } else {
+            return ThrowException(Exception::TypeError(String::New("Argument 1 must be a String or null")));
+        }
+
+        bool stillUsed = previous.empty() || lucene->writer_index() == previous;
+        for (it = lucene->aliases_.begin(); it != lucene->aliases_.end() && !stillUsed; ++it) {
+            stillUsed = it->second == previous;
+        }
+        if (!stillUsed) {
+            std::string error;
+            uv_mutex_lock(&lucene->readersLock_);
+            try {
+                lucene->close_directory(previous);
+            } catch (CLuceneError& E) {
+                error.assign(E.what());
+            }
+            uv_mutex_unlock(&lucene->readersLock_);
+            lucene->drop_term_caches(previous);
+            lucene->drop_tenant_bits(previous);
+
+            if (!error.empty()) {
+                return ThrowException(Exception::Error(String::New(error.c_str())));
+            }
+        }
+
+        return scope.Close(previous.empty() ? Handle<Value>(Undefined()) : String::New(previous.c_str()));
+    }
+
+    static analyzer_spec_t analyzer_spec(Handle<Value> kind, Handle<Value> options) {
+        analyzer_spec_t spec(*v8::String::Utf8Value(kind));
+        if (options->IsObject()) {
+            Local<Object> opts = options->ToObject();
+            spec.hasStopWords = opts->Get(String::NewSymbol("stopWords"))->IsArray();
+            opt_string_array(opts, "stopWords", spec.stopWords);
+            Local<Value> language = opts->Get(String::NewSymbol("language"));
+            if (language->IsString()) {
+                spec.language = *v8::String::Utf8Value(language);
+            }
+        }
+        return spec;
+    }
+
+    // Builds the analyzer set for the given configuration and, if that
+    // worked, makes it the one used by new writers and queries.
+    Handle<Value> apply_analyzers(const analyzer_spec_t& defaultSpec, const std::map<std::string, analyzer_spec_t>& fieldSpecs) {
+        if (!writer_index().empty()) {
+            return ThrowException(Exception::Error(String::New("Close the writer before changing analyzers")));
+        }
+        AnalyzerSet* analyzers = 0;
+        try {
+            analyzers = new AnalyzerSet(defaultSpec, fieldSpecs);
+        } catch (std::string& error) {
+            return ThrowException(Exception::TypeError(String::New(error.c_str())));
+        } catch (CLuceneError& E) {
+            return ThrowException(Exception::Error(String::New(E.what())));
+        }
+        retiredAnalyzers_.push_back(analyzers_);
+        analyzers_ = analyzers;
+        defaultAnalyzer_ = defaultSpec;
+        fieldAnalyzers_ = fieldSpecs;
+        return Undefined();
+    }
+
+    // Sets the analyzer used for every field without one of its own.
+    // args:
+    //   String* kind (standard, simple, whitespace, keyword, stop or snowball)
+    //   Object* options (optional): {stopWords: [String*], language: String*}
+    static Handle<Value> SetAnalyzer(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+
+        analyzer_spec_t spec = analyzer_spec(args[0], args.Length() > 1 ? args[1] : Handle<Value>(Undefined()));
+        return scope.Close(lucene->apply_analyzers(spec, lucene->fieldAnalyzers_));
+    }
+
+    // args:
+    //   String* field
+    //   String* kind
+    //   Object* options (optional): see SetAnalyzer
+    static Handle<Value> SetFieldAnalyzer(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+        REQ_STR_ARG(1);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+
+        std::map<std::string, analyzer_spec_t> fieldSpecs = lucene->fieldAnalyzers_;
+        fieldSpecs[*v8::String::Utf8Value(args[0])] = analyzer_spec(args[1], args.Length() > 2 ? args[2] : Handle<Value>(Undefined()));
+        return scope.Close(lucene->apply_analyzers(lucene->defaultAnalyzer_, fieldSpecs));
+    }
+
+    // args:
+    //   String* docID
+    //   Document* doc
+    //   String* indexPath
+    //   Object* options (optional): {tenant: String*}
+    //   Function* callback
+    static Handle<Value> AddDocumentAsync(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+        REQ_OBJ_ARG(1);
+        REQ_STR_ARG(2);
+        OPT_OBJ_REQ_FUN_ARGS(3, options, callback);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_NOT_REBUILDING(lucene, 2);
+        REQ_TENANT(lucene, 2, options, tenant);
+
+        LuceneDocument* doc = ObjectWrap::Unwrap<LuceneDocument>(args[1]->ToObject());
+        REQ_BATCH_WITHIN_LIMIT(lucene, doc->bytes());
+        
+        index_baton_t* baton = new index_baton_t;
+        baton->lucene = lucene;
+        baton->index.assign(lucene->resolve(*v8::String::Utf8Value(args[2])));
+        baton->tenant = tenant;
+        baton->callback = Persistent<Function>::New(callback);
+        baton->error.clear();
+
+        std::string docId = *v8::String::Utf8Value(args[0]);
+        baton->docsAndIds.push_back(std::pair<std::string, LuceneDocument*>(docId, doc));
+        
+        lucene->Ref();
+        doc->Ref();
+
+        uv_work_t *req = new uv_work_t;
+        req->data = baton;
+
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->memory.init(baton->metrics, MEM_BATCHES);
+        baton->memory.add(doc->bytes());
+        baton->timings.queued();
+        baton->lucene->admission_.admit<index_baton_t>(ADMIT_INDEX, req, Index, AfterIndex);
+
+        return scope.Close(Undefined());
+    }
+        
+    // args:
+    //   Object* {String* docId: Document* doc}
+    //   String* indexPath
+    //   Object* options (optional): {tenant: String*}
+    //   Function* callback
+    static Handle<Value> AddDocumentsAsync(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_OBJ_ARG(0);
+        REQ_STR_ARG(1);
+        OPT_OBJ_REQ_FUN_ARGS(2, options, callback);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_NOT_REBUILDING(lucene, 1);
+        REQ_TENANT(lucene, 1, options, tenant);
+
+        v8::Local<v8::Object> docsById = args[0]->ToObject();
+
+        DocsAndIds docsAndIds;
+        int64_t bytes = 0;
+        v8::Local<v8::Array> docIds = docsById->GetOwnPropertyNames();
+        for (uint32_t i = 0; i<docIds->Length(); ++i ) {
+            v8::Local<v8::String> v8DocId = docIds->Get(i)->ToString();
+            std::string docId = *v8::String::Utf8Value(v8DocId);
+            v8::Local<v8::Value> v8Doc = docsById->Get(v8DocId);
+            if ( !v8Doc->IsObject() ) {
+                return scope.Close(ThrowException(Exception::TypeError(String::New("Expected an object with Lucene Documents as keys"))));
+            }
+
+            LuceneDocument* doc = ObjectWrap::Unwrap<LuceneDocument>(v8Doc->ToObject());
+            docsAndIds.push_back(std::pair<std::string, LuceneDocument*>(docId, doc));
+            bytes += doc->bytes();
+        }
+        REQ_BATCH_WITHIN_LIMIT(lucene, bytes);
+
+        index_baton_t* baton = new index_baton_t;
+        baton->lucene = lucene;
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[1]));
+        baton->tenant = tenant;
+        baton->callback = Persistent<Function>::New(callback);
+        baton->error.clear();
+        baton->docsAndIds.swap(docsAndIds);
+        for (DocsAndIds::const_iterator iter = baton->docsAndIds.begin(); iter != baton->docsAndIds.end(); ++iter) {
+            iter->second->Ref();
+        }
+
+        lucene->Ref();
+
+        uv_work_t *req = new uv_work_t;
+        req->data = baton;
+
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->memory.init(baton->metrics, MEM_BATCHES);
+        baton->memory.add(bytes);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<index_baton_t>(ADMIT_INDEX, req, Index, AfterIndex);
+
+        return scope.Close(Undefined());
+    }
+    
+    // Indexes one JSON document.  Parsing and flattening (see JSONFlattener)
+    // happen on the threadpool: nested keys become dotted field names, arrays
+    // multi-valued fields.
+    // args:
+    //   String* indexPath
+    //   String* docID
+    //   String* or Buffer* json
+    //   Object* mapping {String* path: Integer flags}; a path covers its own
+    //           leaves and everything below it, "*" whatever no path covers
+    //   Object* options (optional): {tenant: String*}
+    //   Function* callback
+    static Handle<Value> AddJSONAsync(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+        REQ_STR_ARG(1);
+        if (!args[2]->IsString() && !Buffer::HasInstance(args[2])) {
+            return ThrowException(Exception::TypeError(String::New("Argument 2 must be a String or a Buffer")));
+        }
+        REQ_OBJ_ARG(3);
+        OPT_OBJ_REQ_FUN_ARGS(4, options, callback);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_NOT_REBUILDING(lucene, 0);
+        REQ_TENANT(lucene, 0, options, tenant);
+
+        std::map<std::string, int> mapping;
+        Local<Object> mappingObject = args[3]->ToObject();
+        Local<v8::Array> paths = mappingObject->GetOwnPropertyNames();
+        for (uint32_t i = 0; i < paths->Length(); ++i) {
+            Local<Value> flags = mappingObject->Get(paths->Get(i));
+            if (!flags->IsNumber()) {
+                return ThrowException(Exception::TypeError(String::New("The mapping must map paths to field flags")));
+            }
+            mapping[*String::Utf8Value(paths->Get(i))] = flags->Int32Value();
+        }
+
+        json_doc_t doc(*String::Utf8Value(args[1]));
+        if (Buffer::HasInstance(args[2])) {
+            Local<Object> buffer = args[2]->ToObject();
+            doc.text.assign(Buffer::Data(buffer), Buffer::Length(buffer));
+        } else {
+            String::Utf8Value text(args[2]);
+            doc.text.assign(*text, text.length());
+        }
+        REQ_BATCH_WITHIN_LIMIT(lucene, (int64_t)doc.text.size());
+
+        index_baton_t* baton = new index_baton_t;
+        baton->lucene = lucene;
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+        baton->tenant = tenant;
+        baton->callback = Persistent<Function>::New(callback);
+        baton->error.clear();
+        baton->jsonDocs.push_back(json_doc_t(doc.id));
+        baton->jsonDocs.back().text.swap(doc.text);
+        baton->mapping.swap(mapping);
+
+        lucene->Ref();
+
+        uv_work_t *req = new uv_work_t;
+        req->data = baton;
+
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->memory.init(baton->metrics, MEM_BATCHES);
+        baton->memory.add(baton->jsonDocs.back().text.size());
+        baton->timings.queued();
+        baton->lucene->admission_.admit<index_baton_t>(ADMIT_INDEX, req, Index, AfterIndex);
+
+        return scope.Close(Undefined());
+    }
+
+    // The flags of the most specific mapping entry for path: path itself,
+    // else its closest parent, else "*".  False when nothing maps it.
+    static bool json_flags(const std::map<std::string, int>& mapping, std::string path, int& flags) {
+        for (;;) {
+            std::map<std::string, int>::const_iterator it = mapping.find(path);
+            if (it != mapping.end()) {
+                flags = it->second;
+                return true;
+            }
+            size_t dot = path.rfind('.');
+            if (dot == std::string::npos) {
+                break;
+            }
+            path.resize(dot);
+        }
+        std::map<std::string, int>::const_iterator it = mapping.find("*");
+        if (it == mapping.end()) {
+            return false;
+        }
+        flags = it->second;
+        return true;
+    }
+
+    // Adds the mapped leaves of a JSON document to doc; throws a std::string
+    // if it does not parse
+    static void add_json_fields(const std::string& json, const std::map<std::string, int>& mapping, Document& doc) {
+        std::vector<json_field_t> fields;
+        JSONFlattener::flatten(json.data(), json.size(), fields);
+        for (size_t i = 0; i < fields.size(); ++i) {
+            int flags;
+            if (!json_flags(mapping, fields[i].path, flags)) {
+                continue;
+            }
+            TCHAR* key = STRDUP_AtoT(fields[i].path.c_str());
+            TCHAR* text = STRDUP_AtoT(fields[i].value.c_str());
+            doc.add(*_CLNEW Field(key, text, flags));
+            free(key);
+            free(text);
+        }
+    }
+
+    static void replace_field(Document* doc, const std::string& name, const std::string& value, int flags) {
+        TCHAR* key = STRDUP_AtoT(name.c_str());
+        TCHAR* text = STRDUP_AtoT(value.c_str());
+        doc->removeFields(key);
+        doc->add(*_CLNEW Field(key, text, flags));
+        free(key);
+        free(text);
+    }
+
+    // Adds or replaces doc under docId with the writer
+    static void index_document(index_baton_t* baton, IndexWriter* writer, const std::string& docId, Document* doc) {
+        TCHAR key[CL_MAX_DIR];
+        STRCPY_AtoT(key, "_id", CL_MAX_DIR);
+
+        // replace document._id if it's also set in the document itself
+        TCHAR* value = STRDUP_AtoT(docId.c_str());
+        doc->removeFields(key);
+        Field* field = _CLNEW Field(key, value, Field::STORE_YES|Field::INDEX_UNTOKENIZED);
+        doc->add(*field);
+        Term* term = 0;
+        if (baton->tenant.enabled()) {
+            // Another tenant may use the same id, so replace by _uid instead
+            std::string uid = tenant_uid(baton->tenant, docId);
+            replace_field(doc, baton->tenant.field, baton->tenant.tenant, Field::STORE_YES|Field::INDEX_UNTOKENIZED);
+            replace_field(doc, "_uid", uid, Field::STORE_NO|Field::INDEX_UNTOKENIZED);
+            term = make_term("_uid", uid);
+        } else {
+            term = new Term(key, value);
+        }
+        int32_t buffered = writer->numRamDocs();
+        writer->updateDocument(term, doc);
+        // The buffer only ever shrinks when the writer flushes it
+        if (writer->numRamDocs() <= buffered) {
+            Metrics::instance().addCounter(baton->metrics, &IndexMetrics::flushes, 1);
+        }
+        _CLDECDELETE(term);
+
+        delete value;
+    }
+
+    static void Index(uv_work_t* req) {
+        index_baton_t* baton = static_cast<index_baton_t*>(req->data);
+        baton->timings.started();
+
+      try {
+          bool needsCreation = true;
+          std::string error;
+          if (IndexReader::indexExists(baton->index.c_str())) {
+              if (IndexReader::isLocked(baton->index.c_str())) {
+                  IndexReader::unlock(baton->index.c_str());
+              }
+              needsCreation = false;
+          }
+          
+          // We keep shared instances of the index modifiers because you can only have one per index
+          IndexWriter* writer = 0;
+          uv_mutex_lock(&baton->lucene->writerLock_);
+          try {
+            if (baton->lucene->writer_ == 0) {
+              writer = baton->lucene->open_writer(baton->index, needsCreation);
+              //printf("New index writer\n");
+              writer->setRAMBufferSizeMB(5);
+
+              // To bypass a possible exception (we have no idea what we will be indexing...)
+              writer->setMaxFieldLength(0x7FFFFFFFL); // LUCENE_INT32_MAX_SHOULDBE
+              // Turn this off to make indexing faster; we'll turn it on later before optimizing
+              writer->setUseCompoundFile(false);
+              baton->lucene->writer_ = writer;
+              baton->lucene->writerIndex_ = baton->index;
+            }
+            writer = baton->lucene->writer_;
+          } catch (...) {
+            uv_mutex_unlock(&baton->lucene->writerLock_);
+            if (writer != 0) {
+              writer->close(true);
+              _CLLDELETE(writer);
+            }
+            throw;
+          }
+          uv_mutex_unlock(&baton->lucene->writerLock_);
+            
+          uint64_t start = Misc::currentTimeMillis();
+          for ( DocsAndIds::const_iterator iter = baton->docsAndIds.begin(); iter != baton->docsAndIds.end(); ++iter ) {
+              index_document(baton, writer, iter->first, iter->second->document());
+          }
+          for (size_t i = 0; i < baton->jsonDocs.size(); ++i) {
+              Document doc;
+              add_json_fields(baton->jsonDocs[i].text, baton->mapping, doc);
+              index_document(baton, writer, baton->jsonDocs[i].id, &doc);
+          }
+          Metrics::instance().addCounter(baton->metrics, &IndexMetrics::docsIndexed,
+              baton->docsAndIds.size() + baton->jsonDocs.size());
+          metrics_set(&Metrics::instance().ramBufferBytes, writer->ramSizeInBytes());
+          Metrics::instance().setMemory(baton->metrics, MEM_WRITER, writer->ramSizeInBytes());
+          
+          // Make the index use as little files as possible, and optimize it
+          
+          //writer->optimize();
+
+          baton->lucene->close_reader(baton->index);
+          /*
+          baton->lucene->writer_->flush();
+            baton->lucene->writer_->close(true);
+            delete baton->lucene->writer_;
+            baton->lucene->writer_ = 0;
+        */
+
+          //writer->close();
+          //delete writer;
+          //writer = 0;
+
+          baton->indexTime = (Misc::currentTimeMillis() - start);
+        } catch (std::string& E) {
+          baton->error = "Invalid JSON: " + E;
+        } catch (CLuceneError& E) {
+          baton->error.assign(E.what());
+        } catch(...) {
+          baton->error = "Got an unknown exception";
+        }
+        
+        //(*(*baton->index), &an, false);
+        return;
+    }
+
+    static void AfterIndex(uv_work_t* req, int status)
+    {
+        HandleScope scope;
+        index_baton_t* baton = static_cast<index_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_INDEX, baton->timings.elapsed(), !baton->error.empty());
+        baton->lucene->Unref();
+
+        for ( DocsAndIds::const_iterator iter = baton->docsAndIds.begin(); iter != baton->docsAndIds.end(); ++iter ) {
+            iter->second->Unref();
+        }
+
+        Handle<Value> argv[2];
+
+        if (!baton->error.empty()) {
+            argv[0] = v8::String::New(baton->error.c_str());
+            argv[1] = Undefined();
+        }
+        else {
+            argv[0] = Undefined();
+            argv[1] = v8::Integer::NewFromUnsigned((uint32_t)baton->indexTime);
+        }
+
+        TryCatch tryCatch;
+
+        baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+
+        if (tryCatch.HasCaught()) {
+            FatalException(tryCatch);
+        }
+
+        baton->callback.Dispose();
+        delete baton;
+        delete req;
+    }
+    
+    
+    struct indexdelete_baton_t {
+        Lucene* lucene;         
+        IndexMetrics* metrics;
+        phase_timings_t timings;
+        v8::String::Utf8Value* docID;
+        std::string index;
+        tenant_scope_t tenant;
+        Persistent<Function> callback;
+        uint64_t indexTime;
+        uint64_t docsDeleted;
+        std::string error;
+    };
+    
+    // args:
+    //   String* docID
+    //   String* indexPath
+    //   Object* options (optional): {tenant: String*}
+    //   Function* callback
+    static Handle<Value> DeleteDocumentAsync(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+        REQ_STR_ARG(1);
+        OPT_OBJ_REQ_FUN_ARGS(2, options, callback);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_NOT_REBUILDING(lucene, 1);
+        REQ_TENANT(lucene, 1, options, tenant);
+
+        indexdelete_baton_t* baton = new indexdelete_baton_t;
+        baton->lucene = lucene;
+        baton->docID = new v8::String::Utf8Value(args[0]);
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[1]));
+        baton->tenant = tenant;
+        baton->callback = Persistent<Function>::New(callback);
+        baton->error.clear();
+        
+        lucene->Ref();
+
+        uv_work_t *req = new uv_work_t;
+        req->data = baton;
+
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<indexdelete_baton_t>(ADMIT_DELETE, req, DeleteDocument, AfterDeleteDocument);
+
+        return scope.Close(Undefined());
+    }
+        
+    
+    static void DeleteDocument(uv_work_t* req) {
+        indexdelete_baton_t* baton = static_cast<indexdelete_baton_t*>(req->data);
+        baton->timings.started();
+
+        uint64_t start = Misc::currentTimeMillis();
+
+        // A tenant can only delete its own document with that id
+        Term* term = baton->tenant.enabled() ?
+            make_term("_uid", tenant_uid(baton->tenant, *(*baton->docID))) :
+            make_term("_id", *(*baton->docID));
+
+        Directory* directory = 0;
+        IndexReader* reader = 0;
+        try {
+            reader = baton->lucene->open_delete_reader(baton->index, directory);
+            int32_t deleted = reader->deleteDocuments(term);
+            IndexReader* done = reader;
+            reader = 0;
+            baton->lucene->commit_deletes(baton->index, done, directory);
+            directory = 0;
+            Metrics::instance().addCounter(baton->metrics, &IndexMetrics::docsDeleted, deleted);
+
+            baton->indexTime = (Misc::currentTimeMillis() - start);
+        } catch (CLuceneError& E) {
+            baton->error.assign(E.what());
+        } catch(...) {
+            baton->error = "Got an unknown exception";
+        }
+        abandon_deletes(reader, directory);
+        _CLDECDELETE(term);
+
+        return;
+    }
+
+    static void AfterDeleteDocument(uv_work_t* req, int status)
+    {
+        HandleScope scope;
+        indexdelete_baton_t* baton = static_cast<indexdelete_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_DELETE, baton->timings.elapsed(), !baton->error.empty());
+        baton->lucene->Unref();
+
+        Handle<Value> argv[2];
+
+        if (!baton->error.empty()) {
+            argv[0] = v8::String::New(baton->error.c_str());
+            argv[1] = Undefined();
+        }
+        else {
+            argv[0] = Undefined();
+            argv[1] = v8::Integer::NewFromUnsigned((uint32_t)baton->indexTime);
+        }
+
+        TryCatch tryCatch;
+
+        baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+
+        if (tryCatch.HasCaught()) {
+            FatalException(tryCatch);
+        }
+
+        baton->callback.Dispose();
+        delete baton;
+        delete req;
+    }
+    
+    struct indexdeletebytype_baton_t {
+        Lucene* lucene;         
+        IndexMetrics* metrics;
+        phase_timings_t timings;
+        std::string type;
+        std::string index;
+        tenant_scope_t tenant;
+        Persistent<Function> callback;
+        uint64_t indexTime;
+        std::string error;
+    };
+    
+    // args:
+    //   String* docID
+    //   String* indexPath
+    //   Object* options (optional): {tenant: String*}
+    //   Function* callback
+    static Handle<Value> DeleteDocumentsByTypeAsync(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+        REQ_STR_ARG(1);
+        OPT_OBJ_REQ_FUN_ARGS(2, options, callback);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_NOT_REBUILDING(lucene, 1);
+        REQ_TENANT(lucene, 1, options, tenant);
+
+        indexdeletebytype_baton_t* baton = new indexdeletebytype_baton_t;
+        baton->lucene = lucene;
+        baton->type = *v8::String::Utf8Value(args[0]);
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[1]));
+        baton->tenant = tenant;
+        baton->callback = Persistent<Function>::New(callback);
+        baton->error.clear();
+        lucene->Ref();
+
+        uv_work_t *req = new uv_work_t;
+        req->data = baton;
+
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<indexdeletebytype_baton_t>(ADMIT_DELETE, req, DeleteDocumentsByType, AfterDeleteDocumentsByType);
+
+        return scope.Close(Undefined());
+    }
+        
+    
+    static void DeleteDocumentsByType(uv_work_t* req) {
+        indexdeletebytype_baton_t* baton = static_cast<indexdeletebytype_baton_t*>(req->data);
+        baton->timings.started();
+
+        Directory* directory = 0;
+        IndexReader* reader = 0;
+        tenant_bits_t* tenantBits = 0;
+        TermDocs* termDocs = 0;
+        try {
+          uint64_t start = Misc::currentTimeMillis();
+          reader = baton->lucene->open_delete_reader(baton->index, directory);
+
+          int32_t deleted = 0;
+          if (baton->tenant.enabled()) {
+              // Only the documents of that type that belong to the tenant
+              tenantBits = baton->lucene->acquire_tenant_bits(baton->index, reader, baton->tenant);
+              Term* term = make_term("_type", baton->type);
+              termDocs = reader->termDocs(term);
+              _CLDECDELETE(term);
+              while (termDocs->next()) {
+                  if (tenantBits->bits->get(termDocs->doc())) {
+                      reader->deleteDocument(termDocs->doc());
+                      ++deleted;
+                  }
+              }
+          } else {
+              TCHAR key[CL_MAX_DIR];
+              STRCPY_AtoT(key, "_type", CL_MAX_DIR);
+              TCHAR value[CL_MAX_DIR];
+              STRCPY_AtoT(value, baton->type.c_str(), CL_MAX_DIR);
+              deleted = reader->deleteDocuments(new Term(key, value));
+          }
+          if (termDocs != 0) {
+              termDocs->close();
+              _CLDELETE(termDocs);
+          }
+          IndexReader* done = reader;
+          reader = 0;
+          baton->lucene->commit_deletes(baton->index, done, directory);
+          directory = 0;
+          Metrics::instance().addCounter(baton->metrics, &IndexMetrics::docsDeleted, deleted);
+
+          baton->indexTime = (Misc::currentTimeMillis() - start);
+        } catch (CLuceneError& E) {
+          baton->error.assign(E.what());
+        } catch(...) {
+          baton->error = "Got an unknown exception";
+        }
+        if (termDocs != 0) {
+            termDocs->close();
+            _CLDELETE(termDocs);
+        }
+        baton->lucene->release_tenant_bits(tenantBits);
+        abandon_deletes(reader, directory);
+
+        return;
+    }
+
+    static void AfterDeleteDocumentsByType(uv_work_t* req, int status)
+    {
+        HandleScope scope;
+        indexdeletebytype_baton_t* baton = static_cast<indexdeletebytype_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_DELETE, baton->timings.elapsed(), !baton->error.empty());
+        baton->lucene->Unref();
+
+        Handle<Value> argv[2];
+
+        if (!baton->error.empty()) {
+            argv[0] = v8::String::New(baton->error.c_str());
+            argv[1] = Undefined();
+        }
+        else {
+            argv[0] = Undefined();
+            argv[1] = v8::Integer::NewFromUnsigned((uint32_t)baton->indexTime);
+        }
+
+        TryCatch tryCatch;
+
+        baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+
+        if (tryCatch.HasCaught()) {
+            FatalException(tryCatch);
+        }
+
+        baton->callback.Dispose();
+        delete baton;
+        delete req;
+    }
+    
+
+    struct search_field
+    {
+        search_field(const std::string& key_, const std::string& value_, bool binary_ = false)
+            : key(key_), value(value_), binary(binary_)
+        { }
+        std::string key;
+        std::string value;  // raw bytes when binary
+        bool binary;
+    };
+
+    struct search_doc
+    {
+        search_doc() : score(0), highlighted(false) { }
+        float score;
+        std::vector<search_field> fields;
+        bool highlighted;
+        std::vector<std::string> highlights;
+    };
+
+    // Turns ids into the keys lookup_documents should seek and returns the
+    // field they live in: _uid values in tenant mode, else the ids themselves
+    static const char* tenant_keys(const tenant_scope_t& scope, std::vector<std::string>& ids)
+    {
+        if (!scope.enabled()) {
+            return "_id";
+        }
+        for (size_t i = 0; i < ids.size(); ++i) {
+            ids[i] = tenant_uid(scope, ids[i]);
+        }
+        return "_uid";
+    }
+
+    // Sorts positions into ids by the id they point at
+    struct id_order
+    {
+        id_order(const std::vector<std::string>& ids_) : ids(ids_) { }
+        bool operator()(size_t a, size_t b) const { return ids[a] < ids[b]; }
+        const std::vector<std::string>& ids;
+    };
+
+    // Copies the stored fields of doc into out
+    static void load_fields(Document& doc, search_doc& out)
+    {
+        Document::FieldsType* fields = const_cast<Document::FieldsType*>(doc.getFields());
+        DocumentFieldEnumeration fieldEnum(fields->begin(), fields->end());
+        while (fieldEnum.hasMoreElements()) {
+            Field* curField = fieldEnum.nextElement();
+
+            char* fieldName = STRDUP_TtoA(curField->name());
+            if (curField->isBinary()) {
+                const ValueArray<uint8_t>* bytes = curField->binaryValue();
+                out.fields.push_back(search_field(fieldName,
+                    std::string(reinterpret_cast<const char*>(bytes->values), bytes->length), true));
+                free(fieldName);
+                continue;
+            }
+            char* fieldValue = STRDUP_TtoA(curField->stringValue());
+
+            out.fields.push_back(search_field(fieldName, fieldValue));
+
+            free(fieldName);
+            free(fieldValue);
+        }
+    }
+
+    static Query* parse_query(const std::string& search, Analyzer* analyzer)
+    {
+        TCHAR* searchString = STRDUP_AtoT(search.c_str());
+        Query* q = 0;
+        try {
+            q = QueryParser::parse(searchString, _T("_id"), analyzer);
+        } catch (...) {
+            free(searchString);
+            throw;
+        }
+        free(searchString);
+        return q;
+    }
+
+    // Reads a string (or number) property of a query tree node
+    static std::string tree_value(Handle<Object> node, const char* name)
+    {
+        Local<Value> value = node->Get(String::NewSymbol(name));
+        if (!value->IsString() && !value->IsNumber()) {
+            throw std::string("Query tree node is missing its ") + name;
+        }
+        return *v8::String::Utf8Value(value);
+    }
+
+    static void add_clauses(BooleanQuery* boolean, Handle<Object> node, const char* name,
+        BooleanClause::Occur occur, uint32_t depth)
+    {
+        Local<Value> clauses = node->Get(String::NewSymbol(name));
+        if (clauses->IsUndefined()) {
+            return;
+        }
+        if (!clauses->IsArray()) {
+            throw std::string("bool.") + name + " must be an array";
+        }
+        Local<v8::Array> array = Local<v8::Array>::Cast(clauses);
+        for (uint32_t i = 0; i < array->Length(); ++i) {
+            Query* clause = build_query(array->Get(i), depth + 1);
+            try {
+                boolean->add(clause, true, occur);
+            } catch (CLuceneError& E) {
+                _CLLDELETE(clause);
+                throw std::string(E.what());
+            }
+        }
+    }
+
+    // Turns a query tree into a Query without going through the query
+    // parser.  Nodes are {type: 'term'|'prefix', field, value},
+    // {type: 'phrase', field, terms: [], slop}, {type: 'range', field, from,
+    // to, inclusive} and {type: 'bool', must: [], should: [], mustNot: []},
+    // each with an optional boost.  Values are matched verbatim, nothing is
+    // analyzed or escaped.  Throws std::string when the tree is malformed.
+    static Query* build_query(Handle<Value> value, uint32_t depth = 0)
+    {
+        if (depth > MAX_QUERY_TREE_DEPTH) {
+            throw std::string("The query tree is nested too deeply");
+        }
+        if (!value->IsObject() || value->IsArray()) {
+            throw std::string("Query tree nodes must be objects");
+        }
+        Local<Object> node = value->ToObject();
+        std::string type = tree_value(node, "type");
+
+        Query* q = 0;
+        if (type == "term" || type == "prefix") {
+            Term* term = make_term(tree_value(node, "field"), tree_value(node, "value"));
+            if (type == "term") {
+                q = _CLNEW TermQuery(term);
+            } else {
+                q = _CLNEW PrefixQuery(term);
+            }
+            _CLDECDELETE(term);
+        } else if (type == "phrase") {
+            std::string field = tree_value(node, "field");
+            Local<Value> terms = node->Get(String::NewSymbol("terms"));
+            if (!terms->IsArray() || Local<v8::Array>::Cast(terms)->Length() == 0) {
+                throw std::string("A phrase node needs a non-empty terms array");
+            }
+            Local<v8::Array> array = Local<v8::Array>::Cast(terms);
+            PhraseQuery* phrase = _CLNEW PhraseQuery();
+            for (uint32_t i = 0; i < array->Length(); ++i) {
+                Term* term = make_term(field, *v8::String::Utf8Value(array->Get(i)));
+                phrase->add(term);
+                _CLDECDELETE(term);
+            }
+            phrase->setSlop(opt_uint(node, "slop", 0));
+            q = phrase;
+        } else if (type == "range") {
+            std::string field = tree_value(node, "field");
+            Local<Value> from = node->Get(String::NewSymbol("from"));
+            Local<Value> to = node->Get(String::NewSymbol("to"));
+            bool hasFrom = from->IsString() || from->IsNumber();
+            bool hasTo = to->IsString() || to->IsNumber();
+            if (!hasFrom && !hasTo) {
+                throw std::string("A range node needs from, to or both");
+            }
+            Term* lower = hasFrom ? make_term(field, *v8::String::Utf8Value(from)) : 0;
+            Term* upper = hasTo ? make_term(field, *v8::String::Utf8Value(to)) : 0;
+            q = _CLNEW RangeQuery(lower, upper, opt_bool(node, "inclusive", true));
+            if (lower != 0) {
+                _CLDECDELETE(lower);
+            }
+            if (upper != 0) {
+                _CLDECDELETE(upper);
+            }
+        } else if (type == "bool") {
+            BooleanQuery* boolean = _CLNEW BooleanQuery();
+            try {
+                add_clauses(boolean, node, "must", BooleanClause::MUST, depth);
+                add_clauses(boolean, node, "should", BooleanClause::SHOULD, depth);
+                add_clauses(boolean, node, "mustNot", BooleanClause::MUST_NOT, depth);
+                if (boolean->getClauseCount() == 0) {
+                    throw std::string("A bool node needs at least one clause");
+                }
+            } catch (...) {
+                _CLLDELETE(boolean);
+                throw;
+            }
+            q = boolean;
+        } else {
+            throw std::string("Unknown query tree node type ") + type;
+        }
+
+        Local<Value> boost = node->Get(String::NewSymbol("boost"));
+        if (boost->IsNumber()) {
+            q->setBoost((float_t)boost->NumberValue());
+        }
+        return q;
+    }
+
+    // The terms of q when q matches exactly the documents holding any of
+    // them: a TermQuery, or a BooleanQuery of optional clauses that are such
+    // queries themselves (prefix and wildcard queries rewrite to one).  The
+    // terms are q's own, not referenced.  False (with terms left partly
+    // filled) for anything else.
+    static bool disjunction_terms(Query* q, std::vector<Term*>& terms) {
+        if (q->instanceOf(TermQuery::getClassName())) {
+            terms.push_back(static_cast<TermQuery*>(q)->getTerm(false));
+            return true;
+        }
+        if (!q->instanceOf(BooleanQuery::getClassName())) {
+            return false;
+        }
+        BooleanQuery* boolean = static_cast<BooleanQuery*>(q);
+        size_t count = boolean->getClauseCount();
+        std::vector<BooleanClause*> clauses(count + 1);
+        boolean->getClauses(&clauses[0]);
+        for (size_t i = 0; i < count; ++i) {
+            BooleanClause* clause = clauses[i];
+            if (clause->isRequired() || clause->isProhibited() || !disjunction_terms(clause->getQuery(), terms)) {
+                return false;
+            }
+        }
+        return count > 0;
+    }
+
+    // Unscored matching for term disjunctions straight off the postings:
+    // no Weight, no scorers and no norms.  A single term is walked in index
+    // order as it is; several are merged into a bit set first.
+    template <typename Collector>
+    static void collect_postings(IndexReader* reader, const std::vector<Term*>& terms, Collector& collector,
+        const tenant_bits_t* tenantBits)
+    {
+        TermDocs* termDocs = 0;
+        BitSet* matches = 0;
+        try {
+            termDocs = reader->termDocs();
+            if (terms.size() > 1) {
+                matches = _CLNEW BitSet(reader->maxDoc());
+            }
+            for (size_t i = 0; i < terms.size(); ++i) {
+                termDocs->seek(terms[i]);
+                while (termDocs->next()) {
+                    collector.deadline.tick();
+                    int32_t doc = termDocs->doc();
+                    if (matches != 0) {
+                        matches->set(doc);
+                    } else if (tenantBits == 0 || tenantBits->bits->get(doc)) {
+                        collector.collect(doc, 1.0f);
+                    }
+                }
+            }
+            if (matches != 0) {
+                int32_t maxDoc = reader->maxDoc();
+                for (int32_t doc = 0; doc < maxDoc; ++doc) {
+                    if (matches->get(doc) && (tenantBits == 0 || tenantBits->bits->get(doc))) {
+                        collector.deadline.tick();
+                        collector.collect(doc, 1.0f);
+                    }
+                }
+            }
+        } catch (...) {
+            if (termDocs != 0) {
+                termDocs->close();
+                _CLDELETE(termDocs);
+            }
+            _CLDELETE(matches);
+            throw;
+        }
+        termDocs->close();
+        _CLDELETE(termDocs);
+        _CLDELETE(matches);
+    }
+
+    // Feeds every match of q to collector in index order.  With scoring each
+    // match gets its score.  Without it every match gets a constant 1, and
+    // term, prefix and wildcard queries (and optional-only disjunctions of
+    // terms) are read straight off the postings by collect_postings, so no
+    // Weight, scorer or norms are built for them; any other query still runs
+    // through its scorer, which is then only advanced, never asked for a
+    // score.  With tenantBits only that tenant's documents are collected.
+    // The scorer is driven here rather than through IndexSearcher::search so
+    // that a collector giving up early (collect_limit_exceeded) does not leak
+    // the weight and scorer, and so that the collector's deadline is checked
+    // after the rewrite (which expands wildcards and prefixes and cannot be
+    // interrupted itself) and for every document the scorer lands on, tenant
+    // filtered or not.  Collector is LimitedCollector or CountingCollector.
+    template <typename Collector>
+    static void collect_matches(IndexReader* reader, Query* q, Collector& collector,
+        const tenant_bits_t* tenantBits, bool scoring = false)
+    {
+        IndexSearcher s(reader);
+        Query* rewritten = 0;
+        Weight* weight = 0;
+        Scorer* scorer = 0;
+        std::vector<Term*> terms;
+        try {
+            rewritten = s.rewrite(q);
+            collector.deadline.check();
+            if (!scoring && disjunction_terms(rewritten, terms)) {
+                collect_postings(reader, terms, collector, tenantBits);
+            } else {
+                weight = rewritten->weight(&s);
+                scorer = weight->scorer(reader);
+                while (scorer != 0 && scorer->next()) {
+                    collector.deadline.tick();
+                    int32_t doc = scorer->doc();
+                    if (tenantBits == 0 || tenantBits->bits->get(doc)) {
+                        collector.collect(doc, scoring ? scorer->score() : 1.0f);
+                    }
+                }
+            }
+        } catch (...) {
+            _CLDELETE(scorer);
+            _CLLDELETE(weight);
+            if (rewritten != q) {
+                _CLLDELETE(rewritten);
+            }
+            s.close();
+            throw;
+        }
+        _CLDELETE(scorer);
+        _CLLDELETE(weight);
+        if (rewritten != q) {
+            _CLLDELETE(rewritten);
+        }
+        s.close();
+    }
+
+    // Best first, and scaled the way Hits does it: when the best score is
+    // above 1 every score is divided by it, so scores stay within 0..1
+    static void sort_hits(std::vector<scored_doc>& hits)
+    {
+        std::sort(hits.begin(), hits.end());
+        if (!hits.empty() && hits[0].score > 1.0f) {
+            float_t norm = 1.0f / hits[0].score;
+            for (size_t i = 0; i < hits.size(); ++i) {
+                hits[i].score *= norm;
+            }
+        }
+    }
+
+    // Runs q and returns its hits best first, or in index order without
+    // scoring; see LimitedCollector for the limits.  With tenantBits only
+    // that tenant's documents can match.
+    static void collect_hits(IndexReader* reader, Query* q, LimitedCollector& collector,
+        const tenant_bits_t* tenantBits = 0, bool scoring = true)
+    {
+        try {
+            collect_matches(reader, q, collector, tenantBits, scoring);
+        } catch (collect_limit_exceeded&) {
+            // Callers may hand out the hits found so far, so they still get sorted
+            if (scoring) {
+                sort_hits(collector.hits);
+            }
+            throw;
+        }
+        if (scoring) {
+            sort_hits(collector.hits);
+        }
+    }
+
+    // Rough native size of a loaded document
+    static int64_t search_doc_bytes(const search_doc& doc)
+    {
+        int64_t bytes = sizeof(search_doc);
+        for (size_t i = 0; i < doc.fields.size(); ++i) {
+            bytes += sizeof(search_field) + doc.fields[i].key.size() + doc.fields[i].value.size();
+        }
+        for (size_t i = 0; i < doc.highlights.size(); ++i) {
+            bytes += sizeof(std::string) + doc.highlights[i].size();
+        }
+        return bytes;
+    }
+
+    // Charges every loaded document to memory, if given, which stops the
+    // loading by throwing memory_limit_exceeded
+    static void load_hits(IndexReader* reader, const std::vector<scored_doc>& hits, std::vector<search_doc>& docs,
+        memory_charge_t* memory = 0, const Highlighter* highlighter = 0)
+    {
+        docs.reserve(docs.size() + hits.size());
+        for (size_t i = 0; i < hits.size(); ++i) {
+            Document doc;
+            reader->document(hits[i].doc, doc);
+            // {"id":"ab34", "score":1.0}
+            docs.push_back(search_doc());
+            docs.back().score = hits[i].score;
+            load_fields(doc, docs.back());
+            if (highlighter != 0) {
+                docs.back().highlighted = true;
+                highlighter->highlight(hits[i].doc, doc, docs.back().highlights);
+            }
+            if (memory != 0) {
+                memory->add(search_doc_bytes(docs.back()));
+            }
+        }
+    }
+
+    // Looks every id up in the keyField (_id, or _uid in tenant mode) term
+    // dictionary; docs and found end up parallel to ids.  fields limits which
+    // stored fields get loaded.
+    static void lookup_documents(IndexReader* reader, const std::vector<std::string>& ids,
+        const std::vector<std::string>& fields, std::vector<search_doc>& docs, std::vector<bool>& found,
+        const char* keyField = "_id")
+    {
+        docs.resize(ids.size());
+        found.resize(ids.size(), false);
+
+        // Seek the ids in term order so the term dictionary is only ever scanned forward
+        std::vector<size_t> order(ids.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), id_order(ids));
+
+        TCHAR key[CL_MAX_DIR];
+        STRCPY_AtoT(key, "_id", CL_MAX_DIR);
+        TCHAR lookupKey[CL_MAX_DIR];
+        STRCPY_AtoT(lookupKey, keyField, CL_MAX_DIR);
+
+        MapFieldSelector* selector = 0;
+        std::vector<TCHAR*> selectedFields;
+        TermDocs* termDocs = 0;
+        std::string error;
+        try {
+            if (!fields.empty()) {
+                selector = _CLNEW MapFieldSelector();
+                selector->add(key);
+                for (size_t i = 0; i < fields.size(); ++i) {
+                    selectedFields.push_back(STRDUP_AtoT(fields[i].c_str()));
+                    selector->add(selectedFields.back());
+                }
+            }
+
+            termDocs = reader->termDocs();
+            for (size_t k = 0; k < order.size(); ++k) {
+                size_t i = order[k];
+                TCHAR* value = STRDUP_AtoT(ids[i].c_str());
+                Term* term = _CLNEW Term(lookupKey, value);
+                termDocs->seek(term);
+                _CLDECDELETE(term);
+                free(value);
+
+                if (termDocs->next()) {
+                    Document doc;
+                    reader->document(termDocs->doc(), doc, selector);
+                    load_fields(doc, docs[i]);
+                    found[i] = true;
+                }
+            }
+        } catch (CLuceneError& E) {
+          error.assign(E.what());
+        } catch(...) {
+          error = "Got an unknown exception";
+        }
+
+        if (termDocs != 0) {
+            termDocs->close();
+            _CLDELETE(termDocs);
+        }
+        _CLDELETE(selector);
+        for (size_t i = 0; i < selectedFields.size(); ++i) {
+            free(selectedFields[i]);
+        }
+        if (!error.empty()) {
+            throw CLuceneError(CL_ERR_Runtime, error.c_str(), false);
+        }
+    }
+
+    static Local<Object> search_doc_to_object(const search_doc& doc)
+    {
+        Local<Object> resultObject = Object::New();
+        for (uint32_t j = 0; j < doc.fields.size(); ++j) {
+            const search_field& field(doc.fields[j]);
+            if (field.binary) {
+                Buffer* buffer = Buffer::New(field.value.data(), field.value.size());
+                resultObject->Set(String::New(field.key.c_str()), buffer->handle_);
+                continue;
+            }
+            resultObject->Set(String::New(field.key.c_str()), String::New(field.value.c_str()));
+        }
+        if (doc.highlighted) {
+            Local<v8::Array> highlights = v8::Array::New(doc.highlights.size());
+            for (uint32_t j = 0; j < doc.highlights.size(); ++j) {
+                highlights->Set(j, String::New(doc.highlights[j].c_str()));
+            }
+            resultObject->Set(String::NewSymbol("_highlight"), highlights);
+        }
+        return resultObject;
+    }
+
+    struct search_baton_t
+    {
+        Lucene* lucene;
+        IndexMetrics* metrics;
+        std::string index;
+        std::string search;
+        Query* query;               // built from a query tree, else search gets parsed
+        tenant_scope_t tenant;
+        bool scoring;               // false: constant scores, hits in index order
+        highlight_spec_t highlight;
+        uint32_t job;
+        uint64_t deadline;          // see CollectDeadline
+        volatile int32_t aborted;
+        bool truncated;             // stopped early; docs holds the hits found until then
+        uint64_t searchTime;
+        phase_timings_t timings;
+        std::vector<search_doc> docs;
+        memory_charge_t memory;     // docs, until they are converted
+        Persistent<Function> callback;
+        std::string error;
+    };
+
+    // args:
+    //   String* indexPath
+    //   String* query or Object* query tree (see build_query)
+    //   Object* options (optional): {timings: Boolean, tenant: String*, scoring: true, timeoutMs: Integer,
+    //                                highlight: String* field or {field, fragments, size, pre, post}}
+    //   Function* callback
+    // Returns the job id for abort()
+    static Handle<Value> SearchAsync(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+        OPT_OBJ_REQ_FUN_ARGS(2, options, callback);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_TENANT(lucene, 0, options, tenant);
+        REQ_QUERY_ARG(1, query);
+
+        search_baton_t* baton = new search_baton_t;
+        baton->lucene = lucene;
+        baton->index.assign(lucene->resolve(*v8::String::Utf8Value(args[0])));
+        baton->tenant = tenant;
+        baton->query = query;
+        if (query == 0) {
+            baton->search.assign(*v8::String::Utf8Value(args[1]));
+        }
+        baton->callback = Persistent<Function>::New(callback);
+        baton->error.clear();
+        baton->timings.enabled = opt_bool(options, "timings", false);
+        baton->scoring = opt_bool(options, "scoring", true);
+        opt_highlight(options, baton->highlight);
+        baton->deadline = opt_deadline(options);
+        baton->aborted = 0;
+        baton->truncated = false;
+        baton->job = lucene->register_job(&baton->aborted);
+        uint32_t job = baton->job;
+
+        lucene->Ref();
+
+        uv_work_t *req = new uv_work_t;
+        req->data = baton;
+
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->memory.init(baton->metrics, MEM_RESULTS, baton->lucene->maxRequestBytes_);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<search_baton_t>(ADMIT_SEARCH, req, Search, AfterSearch);
+
+        return scope.Close(Integer::NewFromUnsigned(job));
+    }
+
+    static void Search(uv_work_t* req)
+    {
+        search_baton_t* baton = static_cast<search_baton_t*>(req->data);
+        uint64_t start = Misc::currentTimeMillis();
+        uint64_t phase = baton->timings.started();
+
+        // Timed out or aborted while still queued
+        if (CollectDeadline(baton->deadline, &baton->aborted).expired()) {
+            baton->truncated = true;
+            baton->searchTime = 0;
+            return;
+        }
+        
+        IndexReader* reader = baton->lucene->acquire_reader(baton->index, baton->error);
+        baton->timings.reader = phase_timings_t::lap(phase);
+        
+        if (!baton->error.empty()) {
+            return;
+        }
+        
+        Query* q = 0;
+        Highlighter* highlighter = 0;
+        tenant_bits_t* tenantBits = 0;
+        try {
+            q = baton->query != 0 ? baton->query : parse_query(baton->search, baton->lucene->analyzer());
+            baton->query = 0;
+            baton->timings.parse = phase_timings_t::lap(phase);
+            tenantBits = baton->lucene->acquire_tenant_bits(baton->index, reader, baton->tenant);
+            LimitedCollector collector((size_t)-1, baton->deadline, &baton->aborted);
+            try {
+                collect_hits(reader, q, collector, tenantBits, baton->scoring);
+            } catch (collect_limit_exceeded&) {
+                baton->truncated = true;
+            }
+            baton->timings.search = phase_timings_t::lap(phase);
+            if (baton->highlight.enabled()) {
+                highlighter = new Highlighter(baton->highlight, q, reader, baton->lucene->analyzer());
+            }
+            // Build the result array
+            load_hits(reader, collector.hits, baton->docs, &baton->memory, highlighter);
+            baton->timings.load = phase_timings_t::lap(phase);
+            baton->searchTime = (Misc::currentTimeMillis() - start);
+        } catch (memory_limit_exceeded&) {
+          baton->error = "ENOMEM: the results are above maxRequestMB";
+        } catch (CLuceneError& E) {
+          baton->error.assign(E.what());
+        } catch(...) {
+          baton->error = "Got an unknown exception";
+        }
+        delete highlighter;
+        _CLLDELETE(q);
+        baton->lucene->release_tenant_bits(tenantBits);
+
+        // The reader stays cached; the next job reopens it if the index changed
+        baton->lucene->release_reader(reader);
+        
+        return;
+    }
+
+    static void AfterSearch(uv_work_t* req, int status)
+    {
+        HandleScope scope;
+        search_baton_t* baton = static_cast<search_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_SEARCH, baton->timings.elapsed(), !baton->error.empty());
+        baton->lucene->unregister_job(baton->job);
+        baton->lucene->Unref();
+        // Only left over when the job failed before it got to the query
+        _CLLDELETE(baton->query);
+
+        Handle<Value> argv[4];
+
+        if (baton->error.empty()) {
+            argv[0] = Null(); // Error arg, defaulting to no error
+
+            uint64_t phase = uv_hrtime();
+            Local<v8::Array> resultArray = v8::Array::New();
+            for (uint32_t i = 0; i < baton->docs.size(); ++i) {
+                search_doc& doc(baton->docs[i]);
+                Local<Object> resultObject = search_doc_to_object(doc);
+                resultObject->Set(String::New("score"), Number::New(doc.score));
+                resultArray->Set(i, resultObject);
+            }
+            if (baton->truncated) {
+                resultArray->Set(String::NewSymbol("truncated"), True());
+            }
+            baton->timings.convert = phase_timings_t::lap(phase);
+
+            argv[1] = resultArray;
+            argv[2] = v8::Integer::NewFromUnsigned((uint32_t)baton->searchTime);
+        } else {
+            argv[0] = String::New(baton->error.c_str());
+            argv[1] = Null();
+            argv[2] = Null();
+        }
+        argv[3] = baton->timings.ToObject();
+
+        TryCatch tryCatch;
+
+        baton->callback->Call(Context::GetCurrent()->Global(), baton->timings.enabled ? 4 : 3, argv);
+
+        if (tryCatch.HasCaught()) {
+            FatalException(tryCatch);
+        }
+        
+        baton->callback.Dispose();  
+        delete baton;
+        delete req;
+
+    }
+
+    struct search_many_baton_t
+    {
+        Lucene* lucene;
+        IndexMetrics* metrics;
+        std::string index;
+        std::vector<std::string> queries;
+        std::vector<Query*> trees;               // parallel to queries; 0 where the query is a string
+        tenant_scope_t tenant;
+        bool scoring;
+        uint32_t limit;                          // documents loaded per query
+        uint32_t job;
+        uint64_t deadline;                       // see CollectDeadline
+        volatile int32_t aborted;
+        bool truncated;                          // stopped early; later queries got no hits
+        uint64_t searchTime;
+        phase_timings_t timings;
+        std::vector<std::vector<search_doc> > results;  // parallel to queries
+        memory_charge_t memory;                  // results, until they are converted
+        Persistent<Function> callback;
+        std::string error;
+    };
+
+    // Runs several queries in one threadpool job against one reader, so they
+    // share the dispatch cost and all see the same version of the index.
+    // clucene.js wraps this to return a Promise when no callback is given.
+    // args:
+    //   String* indexPath
+    //   Array* queries: query strings and/or query trees
+    //   Object* options (optional): {limit: Integer, timings: Boolean, tenant: String*, scoring: true,
+    //                                timeoutMs: Integer}
+    //   Function* callback
+    // Returns the job id for abort()
+    static Handle<Value> SearchManyAsync(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+        REQ_ARG_COUNT_AND_TYPE(1, Array);
+        OPT_OBJ_REQ_FUN_ARGS(2, options, callback);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_TENANT(lucene, 0, options, tenant);
+
+        Local<v8::Array> queries = Local<v8::Array>::Cast(args[1]);
+        std::vector<Query*> trees(queries->Length(), (Query*)0);
+        for (uint32_t i = 0; i < queries->Length(); ++i) {
+            Local<Value> query = queries->Get(i);
+            if (!query->IsObject()) {
+                continue;
+            }
+            std::ostringstream error;
+            try {
+                trees[i] = build_query(query);
+            } catch (std::string& E) {
+                error << "Query " << i << ": " << E;
+            } catch (CLuceneError& E) {
+                error << "Query " << i << ": " << E.what();
+            }
+            if (!error.str().empty()) {
+                for (uint32_t j = 0; j < i; ++j) {
+                    _CLLDELETE(trees[j]);
+                }
+                return ThrowException(Exception::TypeError(String::New(error.str().c_str())));
+            }
+        }
+
+        search_many_baton_t* baton = new search_many_baton_t;
+        baton->lucene = lucene;
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+        baton->tenant = tenant;
+        baton->callback = Persistent<Function>::New(callback);
+        baton->error.clear();
+
+        baton->trees.swap(trees);
+        baton->queries.resize(queries->Length());
+        for (uint32_t i = 0; i < queries->Length(); ++i) {
+            if (baton->trees[i] == 0) {
+                baton->queries[i] = *v8::String::Utf8Value(queries->Get(i));
+            }
+        }
+        baton->limit = opt_uint(options, "limit", (uint32_t)-1);
+        baton->timings.enabled = opt_bool(options, "timings", false);
+        baton->scoring = opt_bool(options, "scoring", true);
+        baton->deadline = opt_deadline(options);
+        baton->aborted = 0;
+        baton->truncated = false;
+        baton->job = lucene->register_job(&baton->aborted);
+        uint32_t job = baton->job;
+
+        lucene->Ref();
+
+        uv_work_t *req = new uv_work_t;
+        req->data = baton;
+
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->memory.init(baton->metrics, MEM_RESULTS, baton->lucene->maxRequestBytes_);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<search_many_baton_t>(ADMIT_SEARCH, req, SearchMany, AfterSearchMany);
+
+        return scope.Close(Integer::NewFromUnsigned(job));
+    }
+
+    static void SearchMany(uv_work_t* req)
+    {
+        search_many_baton_t* baton = static_cast<search_many_baton_t*>(req->data);
+        uint64_t start = Misc::currentTimeMillis();
+        uint64_t phase = baton->timings.started();
+
+        baton->results.resize(baton->queries.size());
+        if (CollectDeadline(baton->deadline, &baton->aborted).expired()) {
+            baton->truncated = true;
+            baton->searchTime = 0;
+            return;
+        }
+
+        IndexReader* reader = baton->lucene->acquire_reader(baton->index, baton->error);
+        baton->timings.reader = phase_timings_t::lap(phase);
+
+        if (!baton->error.empty()) {
+            return;
+        }
+
+        size_t current = 0;
+        Query* q = 0;
+        tenant_bits_t* tenantBits = 0;
+        try {
+            tenantBits = baton->lucene->acquire_tenant_bits(baton->index, reader, baton->tenant);
+            for (; current < baton->queries.size() && !baton->truncated; ++current) {
+                q = baton->trees[current] != 0 ? baton->trees[current] :
+                    parse_query(baton->queries[current], baton->lucene->analyzer());
+                baton->trees[current] = 0;
+                baton->timings.parse += phase_timings_t::lap(phase);
+
+                // Unscored hits arrive in index order, so collection can stop at limit
+                LimitedCollector collector(baton->scoring ? (size_t)-1 : baton->limit,
+                    baton->deadline, &baton->aborted);
+                try {
+                    collect_hits(reader, q, collector, tenantBits, baton->scoring);
+                } catch (collect_limit_exceeded& E) {
+                    // Out of time: keep this query's hits so far and skip the rest
+                    baton->truncated = E.reason != collect_limit_exceeded::MAX_HITS;
+                }
+                _CLLDELETE(q);
+                if (collector.hits.size() > baton->limit) {
+                    collector.hits.resize(baton->limit, scored_doc(0, 0));
+                }
+                baton->timings.search += phase_timings_t::lap(phase);
+
+                load_hits(reader, collector.hits, baton->results[current], &baton->memory);
+                baton->timings.load += phase_timings_t::lap(phase);
+            }
+            baton->searchTime = (Misc::currentTimeMillis() - start);
+        } catch (memory_limit_exceeded&) {
+          baton->error = "ENOMEM: the results are above maxRequestMB";
+        } catch (CLuceneError& E) {
+          std::ostringstream error;
+          error << "Query " << current << ": " << E.what();
+          baton->error = error.str();
+        } catch(...) {
+          baton->error = "Got an unknown exception";
+        }
+        _CLLDELETE(q);
+        baton->lucene->release_tenant_bits(tenantBits);
+
+        baton->lucene->release_reader(reader);
+    }
+
+    static void AfterSearchMany(uv_work_t* req, int status)
+    {
         HandleScope scope;
+        search_many_baton_t* baton = static_cast<search_many_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_SEARCH_MANY, baton->timings.elapsed(), !baton->error.empty());
+        baton->lucene->unregister_job(baton->job);
+        baton->lucene->Unref();
+        // Trees of the queries a failed or truncated job never got to
+        for (size_t i = 0; i < baton->trees.size(); ++i) {
+            _CLLDELETE(baton->trees[i]);
+        }
 
-        Local<FunctionTemplate> t = FunctionTemplate::New(New);
+        Handle<Value> argv[4];
 
-        t->InstanceTemplate()->SetInternalFieldCount(1);
+        if (baton->error.empty()) {
+            argv[0] = Null(); // Error arg, defaulting to no error
 
-        NODE_SET_PROTOTYPE_METHOD(t, "addField", AddField);
-        NODE_SET_PROTOTYPE_METHOD(t, "clear", Clear);
+            // One array of hits per query, in the order the queries were given
+            uint64_t phase = uv_hrtime();
+            Local<v8::Array> resultArray = v8::Array::New(baton->results.size());
+            for (uint32_t i = 0; i < baton->results.size(); ++i) {
+                std::vector<search_doc>& docs(baton->results[i]);
+                Local<v8::Array> hits = v8::Array::New(docs.size());
+                for (uint32_t j = 0; j < docs.size(); ++j) {
+                    Local<Object> resultObject = search_doc_to_object(docs[j]);
+                    resultObject->Set(String::New("score"), Number::New(docs[j].score));
+                    hits->Set(j, resultObject);
+                }
+                resultArray->Set(i, hits);
+            }
+            if (baton->truncated) {
+                resultArray->Set(String::NewSymbol("truncated"), True());
+            }
+            baton->timings.convert = phase_timings_t::lap(phase);
 
-        target->Set(String::NewSymbol("Document"), t->GetFunction());
+            argv[1] = resultArray;
+            argv[2] = v8::Integer::NewFromUnsigned((uint32_t)baton->searchTime);
+        } else {
+            argv[0] = String::New(baton->error.c_str());
+            argv[1] = Null();
+            argv[2] = Null();
+        }
+        argv[3] = baton->timings.ToObject();
+
+        TryCatch tryCatch;
+
+        baton->callback->Call(Context::GetCurrent()->Global(), baton->timings.enabled ? 4 : 3, argv);
+
+        if (tryCatch.HasCaught()) {
+            FatalException(tryCatch);
+        }
+
+        baton->callback.Dispose();
+        delete baton;
+        delete req;
     }
 
-    Document* document() { return &doc_; }
+    struct count_baton_t
+    {
+        Lucene* lucene;
+        IndexMetrics* metrics;
+        std::string index;
+        std::string search;
+        Query* query;               // built from a query tree, else search gets parsed
+        tenant_scope_t tenant;
+        uint32_t limit;
+        uint32_t job;
+        uint64_t deadline;          // see CollectDeadline
+        volatile int32_t aborted;
+        uint32_t count;
+        uint64_t countTime;
+        phase_timings_t timings;
+        Persistent<Function> callback;
+        std::string error;
+    };
 
-    void Ref() { ObjectWrap::Ref(); }
-    void Unref() { ObjectWrap::Unref(); }
+    // Counts the documents matching a query without scoring them or loading
+    // anything.  With a limit, counting stops there, so {limit: 1} is an
+    // exists check.  A partial count is no answer, so running out of time or
+    // being aborted is an error.
+    // args:
+    //   String* indexPath
+    //   String* query or Object* query tree (see build_query)
+    //   Object* options (optional): {limit: Integer, tenant: String*, timings: Boolean, timeoutMs: Integer}
+    //   Function* callback
+    // Returns the job id for abort()
+    static Handle<Value> CountAsync(const Arguments& args) {
+        HandleScope scope;
 
-protected:
-    static Handle<Value> New(const Arguments& args) {
+        REQ_STR_ARG(0);
+        OPT_OBJ_REQ_FUN_ARGS(2, options, callback);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_TENANT(lucene, 0, options, tenant);
+        REQ_QUERY_ARG(1, query);
+
+        count_baton_t* baton = new count_baton_t;
+        baton->lucene = lucene;
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+        baton->tenant = tenant;
+        baton->query = query;
+        if (query == 0) {
+            baton->search.assign(*v8::String::Utf8Value(args[1]));
+        }
+        baton->limit = opt_uint(options, "limit", (uint32_t)-1);
+        baton->count = 0;
+        baton->callback = Persistent<Function>::New(callback);
+        baton->error.clear();
+        baton->timings.enabled = opt_bool(options, "timings", false);
+        baton->deadline = opt_deadline(options);
+        baton->aborted = 0;
+        baton->job = lucene->register_job(&baton->aborted);
+        uint32_t job = baton->job;
+
+        lucene->Ref();
+
+        uv_work_t *req = new uv_work_t;
+        req->data = baton;
+
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<count_baton_t>(ADMIT_SEARCH, req, Count, AfterCount);
+
+        return scope.Close(Integer::NewFromUnsigned(job));
+    }
+
+    static void Count(uv_work_t* req)
+    {
+        count_baton_t* baton = static_cast<count_baton_t*>(req->data);
+        uint64_t start = Misc::currentTimeMillis();
+        uint64_t phase = baton->timings.started();
+
+        IndexReader* reader = baton->lucene->acquire_reader(baton->index, baton->error);
+        baton->timings.reader = phase_timings_t::lap(phase);
+
+        if (!baton->error.empty()) {
+            return;
+        }
+
+        Query* q = 0;
+        tenant_bits_t* tenantBits = 0;
+        try {
+            q = baton->query != 0 ? baton->query : parse_query(baton->search, baton->lucene->analyzer());
+            baton->query = 0;
+            baton->timings.parse = phase_timings_t::lap(phase);
+            tenantBits = baton->lucene->acquire_tenant_bits(baton->index, reader, baton->tenant);
+            CountingCollector collector(baton->limit, baton->deadline, &baton->aborted);
+            try {
+                collect_matches(reader, q, collector, tenantBits);
+            } catch (collect_limit_exceeded& E) {
+                if (E.reason == collect_limit_exceeded::DEADLINE) {
+                    baton->error = "count ran longer than timeoutMs";
+                } else if (E.reason == collect_limit_exceeded::ABORTED) {
+                    baton->error = "count was aborted";
+                }
+            }
+            baton->count = (uint32_t)collector.count;
+            baton->timings.search = phase_timings_t::lap(phase);
+            baton->countTime = (Misc::currentTimeMillis() - start);
+        } catch (CLuceneError& E) {
+          baton->error.assign(E.what());
+        } catch(...) {
+          baton->error = "Got an unknown exception";
+        }
+        _CLLDELETE(q);
+        baton->lucene->release_tenant_bits(tenantBits);
+
+        baton->lucene->release_reader(reader);
+    }
+
+    static void AfterCount(uv_work_t* req, int status)
+    {
+        HandleScope scope;
+        count_baton_t* baton = static_cast<count_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_COUNT_MATCHES, baton->timings.elapsed(), !baton->error.empty());
+        baton->lucene->unregister_job(baton->job);
+        baton->lucene->Unref();
+        _CLLDELETE(baton->query);
+
+        Handle<Value> argv[4];
+
+        if (baton->error.empty()) {
+            argv[0] = Null(); // Error arg, defaulting to no error
+            argv[1] = v8::Integer::NewFromUnsigned(baton->count);
+            argv[2] = v8::Integer::NewFromUnsigned((uint32_t)baton->countTime);
+        } else {
+            argv[0] = String::New(baton->error.c_str());
+            argv[1] = Null();
+            argv[2] = Null();
+        }
+        argv[3] = baton->timings.ToObject();
+
+        TryCatch tryCatch;
+
+        baton->callback->Call(Context::GetCurrent()->Global(), baton->timings.enabled ? 4 : 3, argv);
+
+        if (tryCatch.HasCaught()) {
+            FatalException(tryCatch);
+        }
+
+        baton->callback.Dispose();
+        delete baton;
+        delete req;
+    }
+
+    struct lookup_baton_t
+    {
+        Lucene* lucene;
+        IndexMetrics* metrics;
+        std::string index;
+        std::vector<std::string> ids;
+        const char* keyField;              // what ids are looked up by, see tenant_keys
+        std::vector<std::string> fields;   // stored fields to load, all of them when empty
+        std::vector<search_doc> docs;      // parallel to ids
+        std::vector<bool> found;
+        memory_charge_t memory;            // docs, until they are converted
+        uint64_t lookupTime;
+        phase_timings_t timings;
+        Persistent<Function> callback;
+        std::string error;
+    };
+
+    // args:
+    //   String* indexPath
+    //   Array* docIds
+    //   Object* options (optional): {fields: [String*], timings: Boolean, tenant: String*}
+    //   Function* callback
+    static Handle<Value> GetDocumentsAsync(const Arguments& args) {
+        HandleScope scope;
+
+        REQ_STR_ARG(0);
+        REQ_ARG_COUNT_AND_TYPE(1, Array);
+        OPT_OBJ_REQ_FUN_ARGS(2, options, callback);
+
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_TENANT(lucene, 0, options, tenant);
+
+        lookup_baton_t* baton = new lookup_baton_t;
+        baton->lucene = lucene;
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+        baton->callback = Persistent<Function>::New(callback);
+        baton->error.clear();
+
+        Local<v8::Array> ids = Local<v8::Array>::Cast(args[1]);
+        baton->ids.reserve(ids->Length());
+        for (uint32_t i = 0; i < ids->Length(); ++i) {
+            baton->ids.push_back(*v8::String::Utf8Value(ids->Get(i)));
+        }
+        baton->keyField = tenant_keys(tenant, baton->ids);
+        opt_string_array(options, "fields", baton->fields);
+        baton->timings.enabled = opt_bool(options, "timings", false);
+
+        lucene->Ref();
+
+        uv_work_t *req = new uv_work_t;
+        req->data = baton;
+
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->memory.init(baton->metrics, MEM_RESULTS, baton->lucene->maxRequestBytes_);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<lookup_baton_t>(ADMIT_SEARCH, req, GetDocuments, AfterGetDocuments);
+
+        return scope.Close(Undefined());
+    }
+
+    static void GetDocuments(uv_work_t* req)
+    {
+        lookup_baton_t* baton = static_cast<lookup_baton_t*>(req->data);
+        uint64_t start = Misc::currentTimeMillis();
+        uint64_t phase = baton->timings.started();
+
+        IndexReader* reader = baton->lucene->acquire_reader(baton->index, baton->error);
+        baton->timings.reader = phase_timings_t::lap(phase);
+
+        if (!baton->error.empty()) {
+            return;
+        }
+
+        try {
+            lookup_documents(reader, baton->ids, baton->fields, baton->docs, baton->found, baton->keyField);
+            for (size_t i = 0; i < baton->docs.size(); ++i) {
+                baton->memory.add(search_doc_bytes(baton->docs[i]));
+            }
+            baton->timings.load = phase_timings_t::lap(phase);
+            baton->lookupTime = (Misc::currentTimeMillis() - start);
+        } catch (memory_limit_exceeded&) {
+          baton->error = "ENOMEM: the results are above maxRequestMB";
+        } catch (CLuceneError& E) {
+          baton->error.assign(E.what());
+        } catch(...) {
+          baton->error = "Got an unknown exception";
+        }
+
+        baton->lucene->release_reader(reader);
+    }
+
+    static void AfterGetDocuments(uv_work_t* req, int status)
+    {
         HandleScope scope;
+        lookup_baton_t* baton = static_cast<lookup_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_GET_DOCUMENTS, baton->timings.elapsed(), !baton->error.empty());
+        baton->lucene->Unref();
+
+        Handle<Value> argv[4];
+
+        if (baton->error.empty()) {
+            argv[0] = Null(); // Error arg, defaulting to no error
+
+            // One entry per requested id, null where the id is not in the index
+            uint64_t phase = uv_hrtime();
+            Local<v8::Array> resultArray = v8::Array::New(baton->docs.size());
+            for (uint32_t i = 0; i < baton->docs.size(); ++i) {
+                if (baton->found[i]) {
+                    resultArray->Set(i, search_doc_to_object(baton->docs[i]));
+                } else {
+                    resultArray->Set(i, Null());
+                }
+            }
+            baton->timings.convert = phase_timings_t::lap(phase);
+
+            argv[1] = resultArray;
+            argv[2] = v8::Integer::NewFromUnsigned((uint32_t)baton->lookupTime);
+        } else {
+            argv[0] = String::New(baton->error.c_str());
+            argv[1] = Null();
+            argv[2] = Null();
+        }
+        argv[3] = baton->timings.ToObject();
+
+        TryCatch tryCatch;
+
+        baton->callback->Call(Context::GetCurrent()->Global(), baton->timings.enabled ? 4 : 3, argv);
+
+        if (tryCatch.HasCaught()) {
+            FatalException(tryCatch);
+        }
+
+        baton->callback.Dispose();
+        delete baton;
+        delete req;
+    }
+
+    struct terms_baton_t
+    {
+        Lucene* lucene;
+        IndexMetrics* metrics;
+        std::string index;
+        std::string field;
+        std::string prefix;
+        uint32_t limit;
+        int32_t minDocFreq;
+        bool cache;
+        std::vector<term_entry_t> terms;
+        memory_charge_t memory;         // terms, counted against maxRequestMB
+        uint64_t termsTime;
+        phase_timings_t timings;
+        Persistent<Function> callback;
+        std::string error;
+    };
+
+    // Rough native size of a term in a result
+    static int64_t term_entry_bytes(const term_entry_t& term)
+    {
+        return sizeof(term_entry_t) + term.text.size();
+    }
+
+    // Appends the terms of field starting with prefix to out, in term order,
+    // straight from the reader's TermEnum.  Charges every term to memory, if
+    // given, which stops the enumeration by throwing memory_limit_exceeded.
+    static void enumerate_terms(IndexReader* reader, const std::string& field, const std::string& prefix,
+        int32_t minDocFreq, size_t limit, std::vector<term_entry_t>& out, memory_charge_t* memory = 0)
+    {
+        TCHAR* fieldName = STRDUP_AtoT(field.c_str());
+        TCHAR* prefixText = STRDUP_AtoT(prefix.c_str());
+        size_t prefixLength = _tcslen(prefixText);
+        Term* start = _CLNEW Term(fieldName, prefixText);
+        TermEnum* termEnum = 0;
+        std::string error;
+        bool overLimit = false;
+        try {
+            // terms(t) is already positioned on the first term >= t
+            termEnum = reader->terms(start);
+            for (Term* term = termEnum->term(false); term != 0 && out.size() < limit; term = termEnum->term(false)) {
+                if (_tcscmp(term->field(), fieldName) != 0 || _tcsncmp(term->text(), prefixText, prefixLength) != 0) {
+                    break;
+                }
+                if (termEnum->docFreq() >= minDocFreq) {
+                    char* text = STRDUP_TtoA(term->text());
+                    out.push_back(term_entry_t(text, termEnum->docFreq()));
+                    free(text);
+                    if (memory != 0) {
+                        memory->add(term_entry_bytes(out.back()));
+                    }
+                }
+                if (!termEnum->next()) {
+                    break;
+                }
+            }
+        } catch (memory_limit_exceeded&) {
+          overLimit = true;
+        } catch (CLuceneError& E) {
+          error.assign(E.what());
+        } catch(...) {
+          error = "Got an unknown exception";
+        }
+
+        if (termEnum != 0) {
+            termEnum->close();
+            _CLDELETE(termEnum);
+        }
+        _CLDECDELETE(start);
+        free(fieldName);
+        free(prefixText);
+        if (overLimit) {
+            throw memory_limit_exceeded();
+        }
+        if (!error.empty()) {
+            throw CLuceneError(CL_ERR_Runtime, error.c_str(), false);
+        }
+    }
+
+    // Answers from the cached snapshot of field, building it first if there
+    // is none for this version of the index.  Only the terms copied to out
+    // are charged to memory; the snapshot is accounted as a cache.
+    void cached_terms(IndexReader* reader, const std::string& index, const std::string& field,
+        const std::string& prefix, int32_t minDocFreq, size_t limit, std::vector<term_entry_t>& out,
+        memory_charge_t* memory = 0)
+    {
+        std::pair<std::string, std::string> key(index, field);
+        int64_t version = reader->getVersion();
+
+        uv_mutex_lock(&termCachesLock_);
+        TermCacheMap::iterator it = termCaches_.find(key);
+        term_cache_t* cache = 0;
+        if (it != termCaches_.end() && it->second->version == version) {
+            cache = it->second;
+            ++cache->refs;
+        }
+        uv_mutex_unlock(&termCachesLock_);
+
+        if (cache == 0) {
+            // Built outside the lock; two jobs racing here both build, one wins
+            cache = new term_cache_t;
+            cache->version = version;
+            try {
+                enumerate_terms(reader, field, "", 1, (size_t)-1, cache->terms);
+            } catch (...) {
+                delete cache;
+                throw;
+            }
+            int64_t bytes = sizeof(term_cache_t) + cache->terms.capacity() * sizeof(term_entry_t);
+            for (size_t i = 0; i < cache->terms.size(); ++i) {
+                bytes += cache->terms[i].text.size();
+            }
+            cache->memory.init(Metrics::instance().forIndex(index), MEM_CACHES);
+            cache->memory.add(bytes);
+            uv_mutex_lock(&termCachesLock_);
+            term_cache_t*& slot = termCaches_[key];
+            // A job on an older reader answers from its own snapshot but
+            // leaves a newer cached one in place
+            if (slot == 0 || slot->version < version) {
+                if (slot != 0 && --slot->refs == 0) {
+                    delete slot;
+                }
+                slot = cache;
+                ++cache->refs;
+            }
+            uv_mutex_unlock(&termCachesLock_);
+        }
 
-        LuceneDocument* newDoc = new LuceneDocument();
-        newDoc->Wrap(args.This());
+        // The lookup holds its own reference, so the snapshot survives a
+        // drop_term_caches or a newer install while it is walked
+        try {
+            const std::vector<term_entry_t>& terms = cache->terms;
+            std::vector<term_entry_t>::const_iterator term =
+                std::lower_bound(terms.begin(), terms.end(), term_entry_t(prefix, 0));
+            for (; term != terms.end() && out.size() < limit && term->text.compare(0, prefix.size(), prefix) == 0; ++term) {
+                if (term->docFreq >= minDocFreq) {
+                    out.push_back(*term);
+                    if (memory != 0) {
+                        memory->add(term_entry_bytes(*term));
+                    }
+                }
+            }
+        } catch (...) {
+            release_term_cache(cache);
+            throw;
+        }
+        release_term_cache(cache);
+    }
 
-        return scope.Close(args.This());
+    void release_term_cache(term_cache_t* cache) {
+        uv_mutex_lock(&termCachesLock_);
+        bool last = --cache->refs == 0;
+        uv_mutex_unlock(&termCachesLock_);
+        if (last) {
+            delete cache;
+        }
+    }
+
+    void drop_term_caches(const std::string& index) {
+        uv_mutex_lock(&termCachesLock_);
+        for (TermCacheMap::iterator it = termCaches_.begin(); it != termCaches_.end(); ) {
+            if (it->first.first == index) {
+                if (--it->second->refs == 0) {
+                    delete it->second;
+                }
+                termCaches_.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        uv_mutex_unlock(&termCachesLock_);
     }
 
     // args:
-    //   String* key
-    //   String* value
-    //   Integer flags
-    static Handle<Value> AddField(const Arguments& args) {
+    //   String* indexPath
+    //   String* field
+    //   Object* options (optional): {prefix: String*, limit: Integer, minDocFreq: Integer,
+    //                                cache: Boolean, timings: Boolean}
+    //   Function* callback
+    static Handle<Value> TermsAsync(const Arguments& args) {
         HandleScope scope;
 
         REQ_STR_ARG(0);
         REQ_STR_ARG(1);
-        REQ_NUM_ARG(2);
-        
-        LuceneDocument* docWrapper = ObjectWrap::Unwrap<LuceneDocument>(args.This());
+        OPT_OBJ_REQ_FUN_ARGS(2, options, callback);
 
-        TCHAR* key = STRDUP_AtoT(*String::Utf8Value(args[0]));
-        TCHAR* value = STRDUP_AtoT(*String::Utf8Value(args[1]));
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_NO_TENANT(lucene, 0, "terms() would list every tenant's terms");
 
-        try {
-            Field* field = _CLNEW Field(key, value, args[2]->Int32Value());
-            delete key;
-            delete value;
-            docWrapper->document()->add(*field);
-        } catch (CLuceneError& E) {
-            delete key;
-            delete value;
-            return scope.Close(ThrowException(Exception::TypeError(String::New(E.what()))));
-        } catch(...) {
-            delete key;
-            delete value;
-            return scope.Close(ThrowException(Exception::Error(String::New("Unknown internal error while adding field"))));
+        terms_baton_t* baton = new terms_baton_t;
+        baton->lucene = lucene;
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+        baton->field = *v8::String::Utf8Value(args[1]);
+        baton->callback = Persistent<Function>::New(callback);
+        baton->error.clear();
+
+        Local<Value> prefix = options->Get(String::NewSymbol("prefix"));
+        if (prefix->IsString()) {
+            baton->prefix = *v8::String::Utf8Value(prefix);
         }
-        
-        return scope.Close(Undefined());
-    }
+        baton->limit = opt_uint(options, "limit", 10);
+        baton->minDocFreq = (int32_t)opt_uint(options, "minDocFreq", 1);
+        baton->cache = opt_bool(options, "cache", false);
+        baton->timings.enabled = opt_bool(options, "timings", false);
 
-    static Handle<Value> Clear(const Arguments& args) {
-        HandleScope scope;
+        lucene->Ref();
 
-        LuceneDocument* docWrapper = ObjectWrap::Unwrap<LuceneDocument>(args.This());
-        docWrapper->document()->clear();
+        uv_work_t *req = new uv_work_t;
+        req->data = baton;
+
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->memory.init(baton->metrics, MEM_RESULTS, baton->lucene->maxRequestBytes_);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<terms_baton_t>(ADMIT_SEARCH, req, Terms, AfterTerms);
 
         return scope.Close(Undefined());
     }
 
-    LuceneDocument() : ObjectWrap() {
-    }
+    static void Terms(uv_work_t* req)
+    {
+        terms_baton_t* baton = static_cast<terms_baton_t*>(req->data);
+        uint64_t start = Misc::currentTimeMillis();
+        uint64_t phase = baton->timings.started();
 
-    ~LuceneDocument() {
-    }
-private:
-    Document doc_;
-};
+        IndexReader* reader = baton->lucene->acquire_reader(baton->index, baton->error);
+        baton->timings.reader = phase_timings_t::lap(phase);
 
-class Lucene : public ObjectWrap {
+        if (!baton->error.empty()) {
+            return;
+        }
 
-    static Persistent<FunctionTemplate> s_ct;
-    
-private:
-    int m_count;
-    typedef std::map<std::string,IndexReader*> IndexReaderMap;
-    IndexReaderMap readers_;
-    typedef std::map<std::string, FSDirectory*> FSDirectoryMap;
-    FSDirectoryMap directories_;
-    IndexWriter* writer_;
-    lucene::analysis::standard::StandardAnalyzer* an_;
-    
-private:
-    IndexReader* get_reader(const std::string &index, std::string &error) {
-        IndexReader* reader = 0;
-        //printf("Index: %s\n", index.c_str());
-        try {
-            IndexReaderMap::iterator it = readers_.find(index);
-            if (it == readers_.end()) {
-                //printf("Open: %s\n", index.c_str());
-                FSDirectory* directory = 0;
-                FSDirectoryMap::iterator dir_it = directories_.find(index);
-                if (dir_it == directories_.end()) {
-                    directory = FSDirectory::getDirectory(index.c_str());
-                    directories_[index] = directory;
-                } else {
-                    directory = dir_it->second;
-                }
-                reader = IndexReader::open(directory);
+        try {
+            if (baton->cache) {
+                baton->lucene->cached_terms(reader, baton->index, baton->field, baton->prefix,
+                    baton->minDocFreq, baton->limit, baton->terms, &baton->memory);
             } else {
-                //printf("Reopen: %s\n", index.c_str());
-                reader = it->second;
-                IndexReader* newreader = reader->reopen();
-                if (newreader != reader) {
-                    //printf("Newreader != reader: %s\n", index.c_str());
-                    //reader->close();
-                    _CLLDELETE(reader);
-                    reader = newreader;
-                }
+                enumerate_terms(reader, baton->field, baton->prefix, baton->minDocFreq, baton->limit, baton->terms,
+                    &baton->memory);
             }
-            //printf("Finished opening: %s\n", index.c_str());
-            readers_[index] = reader;
-
+            baton->timings.load = phase_timings_t::lap(phase);
+            baton->termsTime = (Misc::currentTimeMillis() - start);
+        } catch (memory_limit_exceeded&) {
+          baton->error = "ENOMEM: the results are above maxRequestMB";
         } catch (CLuceneError& E) {
-            printf("get_reader Exception: %s\n", E.what());
-            error.assign(E.what());
+          baton->error.assign(E.what());
         } catch(...) {
-            error = "Got an unknown exception \n";
-            printf("get_reader Exception:");
+          baton->error = "Got an unknown exception";
         }
-        return reader;
-    }
 
-    void close_reader(const std::string& index) {
-        IndexReader* reader = 0;
-        IndexReaderMap::iterator it = readers_.find(index);
-        if (it != readers_.end()) {
-            reader = it->second;
-            reader->close();
-            _CLLDELETE(reader);
-            reader = 0;
-            readers_.erase(index);
-        }
+        baton->lucene->release_reader(reader);
     }
-public:
 
-    static void Init(Handle<Object> target) {
+    static void AfterTerms(uv_work_t* req, int status)
+    {
         HandleScope scope;
+        terms_baton_t* baton = static_cast<terms_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_TERMS, baton->timings.elapsed(), !baton->error.empty());
+        baton->lucene->Unref();
 
-        Local<FunctionTemplate> t = FunctionTemplate::New(New);
-
-        s_ct = Persistent<FunctionTemplate>::New(t);
-        s_ct->InstanceTemplate()->SetInternalFieldCount(1);
-        s_ct->SetClassName(String::NewSymbol("Lucene"));
+        Handle<Value> argv[4];
 
-        NODE_SET_PROTOTYPE_METHOD(s_ct, "addDocument", AddDocumentAsync);
-        NODE_SET_PROTOTYPE_METHOD(s_ct, "addDocuments", AddDocumentsAsync);
-        NODE_SET_PROTOTYPE_METHOD(s_ct, "deleteDocument", DeleteDocumentAsync);
-        NODE_SET_PROTOTYPE_METHOD(s_ct, "deleteDocumentsByType", DeleteDocumentsByTypeAsync);
-        NODE_SET_PROTOTYPE_METHOD(s_ct, "search", SearchAsync);
-        NODE_SET_PROTOTYPE_METHOD(s_ct, "optimize", OptimizeAsync);
-        NODE_SET_PROTOTYPE_METHOD(s_ct, "closeWriter", CloseWriter);
-        NODE_SET_PROTOTYPE_METHOD(s_ct, "getDocumentCount", GetDocumentCountAsync);
+        if (baton->error.empty()) {
+            argv[0] = Null(); // Error arg, defaulting to no error
 
-        target->Set(String::NewSymbol("Lucene"), s_ct->GetFunction());
-    }
+            uint64_t phase = uv_hrtime();
+            Local<v8::Array> resultArray = v8::Array::New(baton->terms.size());
+            for (uint32_t i = 0; i < baton->terms.size(); ++i) {
+                Local<Object> term = Object::New();
+                term->Set(String::NewSymbol("term"), String::New(baton->terms[i].text.c_str()));
+                term->Set(String::NewSymbol("docFreq"), Integer::New(baton->terms[i].docFreq));
+                resultArray->Set(i, term);
+            }
+            baton->timings.convert = phase_timings_t::lap(phase);
 
-    Lucene() : ObjectWrap(), m_count(0), writer_(0), an_(0) {}
+            argv[1] = resultArray;
+            argv[2] = v8::Integer::NewFromUnsigned((uint32_t)baton->termsTime);
+        } else {
+            argv[0] = String::New(baton->error.c_str());
+            argv[1] = Null();
+            argv[2] = Null();
+        }
+        argv[3] = baton->timings.ToObject();
 
-    ~Lucene() { }
+        TryCatch tryCatch;
 
-    static Handle<Value> New(const Arguments& args) {
-        HandleScope scope;
-        Lucene* lucene = new Lucene();
-        lucene->writer_ = 0;
-        lucene->Wrap(args.This());
-        return scope.Close(args.This());
-    }
-    
-    typedef std::vector<std::pair<std::string, LuceneDocument*> > DocsAndIds;
+        baton->callback->Call(Context::GetCurrent()->Global(), baton->timings.enabled ? 4 : 3, argv);
 
-    struct index_baton_t {
-        Lucene* lucene;         
-        std::string index;
-        DocsAndIds docsAndIds;
-        Persistent<Function> callback;
-        uint64_t indexTime;
-        int32_t docCount;
-        std::string error;
-    };
-    
-    static Handle<Value> CloseWriter(const Arguments& args) {
-        HandleScope scope;
+        if (tryCatch.HasCaught()) {
+            FatalException(tryCatch);
+        }
 
-        REQ_OBJ_TYPE(args.This(), Lucene);
-        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
-        
-        if (lucene->writer_ != 0) {
-            lucene->writer_->flush();
-            lucene->writer_->close(true);
-            delete lucene->writer_;
-            lucene->writer_ = 0;
+        baton->callback.Dispose();
+        delete baton;
+        delete req;
+    }
 
-            delete lucene->an_;
-            lucene->an_ = 0;
+    // Picks the reader for a synchronous call; see acquire_cached_reader
+    IndexReader* sync_reader(const std::string& index, bool refresh, std::string& error) {
+        IndexReader* reader = refresh ? acquire_reader(index, error) : acquire_cached_reader(index);
+        if (reader == 0 && error.empty()) {
+            error = "Index has no open reader yet; call an asynchronous method on it first or pass {refresh: true}";
         }
-        //printf("Deleted index writer\n");
-
-        return scope.Close(Undefined());
+        return reader;
     }
 
+    // Runs a query on the calling thread against the cached reader.  Meant for
+    // tiny indexes where the threadpool round trip costs more than the search;
+    // throws instead of blocking the event loop when the query matches more
+    // than maxHits documents or runs longer than timeoutMs.
     // args:
-    //   String* docID
-    //   Document* doc
     //   String* indexPath
-    static Handle<Value> AddDocumentAsync(const Arguments& args) {
+    //   String* query or Object* query tree (see build_query)
+    //   Object* options (optional): {maxHits: 100, timeoutMs: 5, refresh: false, tenant: String*,
+    //                                scoring: true}
+    static Handle<Value> SearchSync(const Arguments& args) {
         HandleScope scope;
 
         REQ_STR_ARG(0);
-        REQ_OBJ_ARG(1);
-        REQ_STR_ARG(2);
-        REQ_FUN_ARG(3, callback);
 
         REQ_OBJ_TYPE(args.This(), Lucene);
         Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
-        
-        index_baton_t* baton = new index_baton_t;
-        baton->lucene = lucene;
-        baton->index.assign(*v8::String::Utf8Value(args[2]));
-        baton->callback = Persistent<Function>::New(callback);
-        baton->error.clear();
 
-        std::string docId = *v8::String::Utf8Value(args[0]);
-        LuceneDocument* doc = ObjectWrap::Unwrap<LuceneDocument>(args[1]->ToObject());
-        baton->docsAndIds.push_back(std::pair<std::string, LuceneDocument*>(docId, doc));
-        
-        lucene->Ref();
-        doc->Ref();
+        Local<Object> options = (args.Length() > 2 && args[2]->IsObject()) ? args[2]->ToObject() : Object::New();
+        REQ_TENANT(lucene, 0, options, tenant);
+        REQ_QUERY_ARG(1, tree);
+        size_t maxHits = opt_uint(options, "maxHits", 100);
+        uint32_t timeoutMs = opt_uint(options, "timeoutMs", 5);
+        bool refresh = opt_bool(options, "refresh", false);
 
-        uv_work_t *req = new uv_work_t;
-        req->data = baton;
+        std::string index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+        std::string error;
+        uint64_t started = uv_hrtime();
+        IndexReader* reader = lucene->sync_reader(index, refresh, error);
+        // Counted from here so a {refresh: true} reopen doesn't eat into it;
+        // 0 means no limit, as for the asynchronous calls
+        uint64_t deadline = timeoutMs > 0 ? uv_hrtime() + (uint64_t)timeoutMs * 1000000 : 0;
+
+        // Only held until the results are converted, but still bounded by maxRequestMB
+        memory_charge_t memory;
+        memory.init(Metrics::instance().forIndex(index), MEM_RESULTS, lucene->maxRequestBytes_);
+        std::vector<search_doc> docs;
+        Query* q = tree;
+        if (reader != 0) {
+            tenant_bits_t* tenantBits = 0;
+            try {
+                // Collecting tenant bits reads postings, so like the reader
+                // they are only built here when asked to refresh
+                tenantBits = lucene->acquire_tenant_bits(index, reader, tenant, refresh);
+                if (tenant.enabled() && tenantBits == 0) {
+                    throw CLuceneError(CL_ERR_Runtime,
+                        "The tenant filter is not cached yet; call search() for the tenant first or pass {refresh: true}", false);
+                }
+                if (q == 0) {
+                    q = parse_query(*v8::String::Utf8Value(args[1]), lucene->analyzer());
+                }
+                LimitedCollector collector(maxHits, deadline);
+                collect_hits(reader, q, collector, tenantBits, opt_bool(options, "scoring", true));
+                load_hits(reader, collector.hits, docs, &memory);
+            } catch (collect_limit_exceeded& E) {
+                error = E.reason == collect_limit_exceeded::MAX_HITS ?
+                    "searchSync matched more than maxHits documents; use search() instead" :
+                    "searchSync ran longer than timeoutMs; use search() instead";
+            } catch (memory_limit_exceeded&) {
+                error = "ENOMEM: the results are above maxRequestMB";
+            } catch (CLuceneError& E) {
+                error.assign(E.what());
+            } catch(...) {
+                error = "Got an unknown exception";
+            }
+            lucene->release_tenant_bits(tenantBits);
+            lucene->release_reader(reader);
+        }
+        _CLLDELETE(q);
+        Metrics::instance().recordOp(Metrics::instance().forIndex(index), OP_SEARCH, uv_hrtime() - started, !error.empty());
 
-        uv_queue_work(uv_default_loop(), req, Index, AfterIndex);
+        if (!error.empty()) {
+            return ThrowException(Exception::Error(String::New(error.c_str())));
+        }
 
-        return scope.Close(Undefined());
+        Local<v8::Array> resultArray = v8::Array::New(docs.size());
+        for (uint32_t i = 0; i < docs.size(); ++i) {
+            Local<Object> resultObject = search_doc_to_object(docs[i]);
+            resultObject->Set(String::New("score"), Number::New(docs[i].score));
+            resultArray->Set(i, resultObject);
+        }
+        return scope.Close(resultArray);
     }
-        
+
+    // Synchronous single-document getDocuments; returns the document or null.
     // args:
-    //   Object* {String* docId: Document* doc}
     //   String* indexPath
-    static Handle<Value> AddDocumentsAsync(const Arguments& args) {
+    //   String* docId
+    //   Object* options (optional): {fields: [String*], refresh: false, tenant: String*}
+    static Handle<Value> GetDocumentSync(const Arguments& args) {
         HandleScope scope;
 
-        REQ_OBJ_ARG(0);
+        REQ_STR_ARG(0);
         REQ_STR_ARG(1);
-        REQ_FUN_ARG(2, callback);
 
         REQ_OBJ_TYPE(args.This(), Lucene);
         Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
 
-        v8::Local<v8::Object> docsById = args[0]->ToObject();
+        Local<Object> options = (args.Length() > 2 && args[2]->IsObject()) ? args[2]->ToObject() : Object::New();
+        REQ_TENANT(lucene, 0, options, tenant);
+        std::vector<std::string> ids(1, *v8::String::Utf8Value(args[1]));
+        const char* keyField = tenant_keys(tenant, ids);
+        std::vector<std::string> fields;
+        opt_string_array(options, "fields", fields);
 
-        index_baton_t* baton = new index_baton_t;
-        baton->lucene = lucene;
-        baton->index = *v8::String::Utf8Value(args[1]);
-        baton->callback = Persistent<Function>::New(callback);
-        baton->error.clear();
+        std::string index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+        std::string error;
+        uint64_t started = uv_hrtime();
+        IndexReader* reader = lucene->sync_reader(index, opt_bool(options, "refresh", false), error);
 
-        v8::Local<v8::Array> docIds = docsById->GetOwnPropertyNames();
-        for (uint32_t i = 0; i<docIds->Length(); ++i ) {
-            v8::Local<v8::String> v8DocId = docIds->Get(i)->ToString();
-            std::string docId = *v8::String::Utf8Value(v8DocId);
-            v8::Local<v8::Value> v8Doc = docsById->Get(v8DocId);
-            if ( !v8Doc->IsObject() ) {
-                return scope.Close(ThrowException(Exception::TypeError(String::New("Expected an object with Lucene Documents as keys"))));
+        memory_charge_t memory;
+        memory.init(Metrics::instance().forIndex(index), MEM_RESULTS, lucene->maxRequestBytes_);
+        std::vector<search_doc> docs;
+        std::vector<bool> found;
+        if (reader != 0) {
+            try {
+                lookup_documents(reader, ids, fields, docs, found, keyField);
+                for (size_t i = 0; i < docs.size(); ++i) {
+                    memory.add(search_doc_bytes(docs[i]));
+                }
+            } catch (memory_limit_exceeded&) {
+                error = "ENOMEM: the results are above maxRequestMB";
+            } catch (CLuceneError& E) {
+                error.assign(E.what());
+            } catch(...) {
+                error = "Got an unknown exception";
             }
+            lucene->release_reader(reader);
+        }
+        Metrics::instance().recordOp(Metrics::instance().forIndex(index), OP_GET_DOCUMENTS, uv_hrtime() - started, !error.empty());
 
-            LuceneDocument* doc = ObjectWrap::Unwrap<LuceneDocument>(v8Doc->ToObject());
-            doc->Ref();
-            baton->docsAndIds.push_back(std::pair<std::string, LuceneDocument*>(docId, doc));
+        if (!error.empty()) {
+            return ThrowException(Exception::Error(String::New(error.c_str())));
         }
+        if (!found[0]) {
+            return scope.Close(Null());
+        }
+        return scope.Close(search_doc_to_object(docs[0]));
+    }
 
-        lucene->Ref();
+    struct optimize_baton_t
+    {
+        Lucene* lucene;
+        IndexMetrics* metrics;
+        phase_timings_t timings;
+        Persistent<Function> callback;
+        std::string index;
+        std::string error;
+    };
 
-        uv_work_t *req = new uv_work_t;
-        req->data = baton;
+    static Handle<Value> OptimizeAsync(const Arguments& args)
+    {
+        HandleScope scope;
 
-        uv_queue_work(uv_default_loop(), req, Index, AfterIndex);
+        REQ_STR_ARG(0);
+        REQ_FUN_ARG(1, callback);
 
-        return scope.Close(Undefined());
-    }
-    
-    static void Index(uv_work_t* req) {
-        index_baton_t* baton = static_cast<index_baton_t*>(req->data);
+        REQ_OBJ_TYPE(args.This(), Lucene);
+        Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_NOT_REBUILDING(lucene, 0);
 
-      try {
-          bool needsCreation = true;
-          std::string error;
-          if (IndexReader::indexExists(baton->index.c_str())) {
-              if (IndexReader::isLocked(baton->index.c_str())) {
-                  IndexReader::unlock(baton->index.c_str());
-              }
-              needsCreation = false;
-          }
-          
-          // We keep shared instances of the index modifiers because you can only have one per index
-          if (baton->lucene->writer_ == 0) {
-            baton->lucene->an_ = new lucene::analysis::standard::StandardAnalyzer;
-            baton->lucene->writer_ = new IndexWriter(baton->index.c_str(), baton->lucene->an_, needsCreation);
-            //printf("New index writer\n");
-            baton->lucene->writer_->setRAMBufferSizeMB(5);
+        optimize_baton_t* baton = new optimize_baton_t;
+        baton->lucene = lucene;
+        baton->callback = Persistent<Function>::New(callback);
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+        baton->error.clear();
+
+        lucene->Ref();
+
+        uv_work_t *req = new uv_work_t;
+        req->data = baton;
 
-              // To bypass a possible exception (we have no idea what we will be indexing...)
-              baton->lucene->writer_->setMaxFieldLength(0x7FFFFFFFL); // LUCENE_INT32_MAX_SHOULDBE
-              // Turn this off to make indexing faster; we'll turn it on later before optimizing
-              baton->lucene->writer_->setUseCompoundFile(false);
-          }
-            
-          uint64_t start = Misc::currentTimeMillis();
-          TCHAR key[CL_MAX_DIR];
-          STRCPY_AtoT(key, "_id", CL_MAX_DIR);
-          for ( DocsAndIds::const_iterator iter = baton->docsAndIds.begin(); iter != baton->docsAndIds.end(); ++iter ) {
-              std::string docId = iter->first;
-              LuceneDocument* doc = iter->second;
-
-              // replace document._id if it's also set in the document itself
-              TCHAR* value = STRDUP_AtoT(docId.c_str());
-              doc->document()->removeFields(key);
-              Field* field = _CLNEW Field(key, value, Field::STORE_YES|Field::INDEX_UNTOKENIZED);
-              doc->document()->add(*field);
-              Term* term = new Term(key, value);
-              //_tprintf(_T("Fields: %S\n"), baton->doc->document()->toString());
-              //_tprintf(_T("Term k(%S) v(%S)\n"), key, value);   
-              baton->lucene->writer_->updateDocument(term, doc->document());
-              _CLDECDELETE(term);
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<optimize_baton_t>(ADMIT_MAINTENANCE, req, Optimize, AfterOptimize);
 
-              delete value;
-          }
-          
-          // Make the index use as little files as possible, and optimize it
-          
-          //writer->optimize();
+        return scope.Close(Undefined());
+    }
 
-          baton->lucene->close_reader(baton->index);
-          /*
-          baton->lucene->writer_->flush();
-            baton->lucene->writer_->close(true);
-            delete baton->lucene->writer_;
-            baton->lucene->writer_ = 0;
-        */
+    static void Optimize(uv_work_t* req)
+    {
+        optimize_baton_t* baton = static_cast<optimize_baton_t*>(req->data);
+        baton->timings.started();
 
-          //writer->close();
-          //delete writer;
-          //writer = 0;
+        try {
+          
+        baton->lucene->close_reader(baton->index);
+        bool needsCreation = true;
+        if (IndexReader::indexExists(baton->index.c_str())) {
+            if (IndexReader::isLocked(baton->index.c_str())) {
+                IndexReader::unlock(baton->index.c_str());
+            }
+            needsCreation = false;
+        }
+        
+        IndexWriter* writer = baton->lucene->open_writer(baton->index, needsCreation);
+        writer->setUseCompoundFile(false);
+        writer->optimize();
+        Metrics::instance().addCounter(baton->metrics, &IndexMetrics::optimizes, 1);
 
-          baton->indexTime = (Misc::currentTimeMillis() - start);
+        writer->close();
+        
         } catch (CLuceneError& E) {
           baton->error.assign(E.what());
         } catch(...) {
           baton->error = "Got an unknown exception";
         }
-        
-        //(*(*baton->index), &an, false);
+
         return;
     }
 
-    static void AfterIndex(uv_work_t* req, int status)
+    static void AfterOptimize(uv_work_t* req, int status)
     {
         HandleScope scope;
-        index_baton_t* baton = static_cast<index_baton_t*>(req->data);
-        baton->lucene->Unref();
 
-        for ( DocsAndIds::const_iterator iter = baton->docsAndIds.begin(); iter != baton->docsAndIds.end(); ++iter ) {
-            iter->second->Unref();
-        }
+        optimize_baton_t* baton = static_cast<optimize_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_OPTIMIZE, baton->timings.elapsed(), !baton->error.empty());
+        
+        baton->lucene->Unref();
 
-        Handle<Value> argv[2];
+        Handle<Value> argv[1];
 
         if (!baton->error.empty()) {
             argv[0] = v8::String::New(baton->error.c_str());
-            argv[1] = Undefined();
         }
         else {
             argv[0] = Undefined();
-            argv[1] = v8::Integer::NewFromUnsigned((uint32_t)baton->indexTime);
         }
 
         TryCatch tryCatch;
 
-        baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+        baton->callback->Call(Context::GetCurrent()->Global(), 1, argv);
 
         if (tryCatch.HasCaught()) {
             FatalException(tryCatch);
@@ -446,124 +5092,132 @@ public:
         delete baton;
         delete req;
     }
-    
-    
-    struct indexdelete_baton_t {
-        Lucene* lucene;         
-        v8::String::Utf8Value* docID;
+
+    struct get_doc_count_baton_t
+    {
+        Lucene* lucene;
+        IndexMetrics* metrics;
+        phase_timings_t timings;
         std::string index;
+        uint32_t docCount;
+        uint64_t docCountTime;
         Persistent<Function> callback;
-        uint64_t indexTime;
-        uint64_t docsDeleted;
         std::string error;
     };
-    
+
     // args:
-    //   String* docID
     //   String* indexPath
-    static Handle<Value> DeleteDocumentAsync(const Arguments& args) {
+    //   Function* callback
+    static Handle<Value> GetDocumentCountAsync(const Arguments& args) {
         HandleScope scope;
 
         REQ_STR_ARG(0);
-        REQ_STR_ARG(1);
-        REQ_FUN_ARG(2, callback);
+        REQ_FUN_ARG(1, callback);
 
         REQ_OBJ_TYPE(args.This(), Lucene);
         Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_NO_TENANT(lucene, 0, "use tenantStats() to count a tenant's documents");
 
-        indexdelete_baton_t* baton = new indexdelete_baton_t;
+        get_doc_count_baton_t* baton = new get_doc_count_baton_t;
         baton->lucene = lucene;
-        baton->docID = new v8::String::Utf8Value(args[0]);
-        baton->index = *v8::String::Utf8Value(args[1]);
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[0]));
         baton->callback = Persistent<Function>::New(callback);
         baton->error.clear();
-        
+
         lucene->Ref();
 
         uv_work_t *req = new uv_work_t;
         req->data = baton;
 
-        uv_queue_work(uv_default_loop(), req, DeleteDocument, AfterDeleteDocument);
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<get_doc_count_baton_t>(ADMIT_SEARCH, req, GetDocumentCount, AfterGetDocumentCount);
 
         return scope.Close(Undefined());
     }
+
+    static void GetDocumentCount(uv_work_t* req)
+    {
+        get_doc_count_baton_t* baton = static_cast<get_doc_count_baton_t*>(req->data);
+        baton->timings.started();
+        uint64_t start = Misc::currentTimeMillis();
         
-    
-    static void DeleteDocument(uv_work_t* req) {
-        indexdelete_baton_t* baton = static_cast<indexdelete_baton_t*>(req->data);
+        if (!IndexReader::indexExists(baton->index.c_str())) {
+            baton->error.empty();
+            baton->docCount = 0;
+            return;
+        }
 
-        lucene::analysis::standard::StandardAnalyzer an;
+        IndexReader* reader = baton->lucene->acquire_reader(baton->index, baton->error);
         
-        IndexReader* reader = baton->lucene->get_reader(baton->index, baton->error);
         if (!baton->error.empty()) {
             return;
         }
-
-        uint64_t start = Misc::currentTimeMillis();
-          
-        TCHAR key[CL_MAX_DIR];
-        STRCPY_AtoT(key, "_id", CL_MAX_DIR);
-        TCHAR value[CL_MAX_DIR];
-        STRCPY_AtoT(value, *(*baton->docID), CL_MAX_DIR);
-          
+        
         try {
-            reader->deleteDocuments(new Term(key, value));
-
-            baton->indexTime = (Misc::currentTimeMillis() - start);
-            baton->lucene->close_reader(baton->index);
+            baton->docCount = reader->numDocs();
+            baton->docCountTime = (Misc::currentTimeMillis() - start);
         } catch (CLuceneError& E) {
-            baton->error.assign(E.what());
+          baton->error.assign(E.what());
         } catch(...) {
-            baton->error = "Got an unknown exception";
+          baton->error = "Got an unknown exception";
         }
-        //(*(*baton->index), &an, false);
-
+        baton->lucene->release_reader(reader);
+        
         return;
     }
 
-    static void AfterDeleteDocument(uv_work_t* req, int status)
+    static void AfterGetDocumentCount(uv_work_t* req, int status)
     {
         HandleScope scope;
-        indexdelete_baton_t* baton = static_cast<indexdelete_baton_t*>(req->data);
+        get_doc_count_baton_t* baton = static_cast<get_doc_count_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_DOC_COUNT, baton->timings.elapsed(), !baton->error.empty());
         baton->lucene->Unref();
 
-        Handle<Value> argv[2];
+        Handle<Value> argv[3];
 
-        if (!baton->error.empty()) {
-            argv[0] = v8::String::New(baton->error.c_str());
-            argv[1] = Undefined();
-        }
-        else {
-            argv[0] = Undefined();
-            argv[1] = v8::Integer::NewFromUnsigned((uint32_t)baton->indexTime);
+        if (baton->error.empty()) {
+            argv[0] = Null(); // Error arg, defaulting to no error
+            argv[1] = v8::Integer::NewFromUnsigned(baton->docCount);
+            argv[2] = v8::Integer::NewFromUnsigned((uint32_t)baton->docCountTime);
+        } else {
+            argv[0] = String::New(baton->error.c_str());
+            argv[1] = Null();
+            argv[2] = Null();
         }
 
         TryCatch tryCatch;
 
-        baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+        baton->callback->Call(Context::GetCurrent()->Global(), 3, argv);
 
         if (tryCatch.HasCaught()) {
             FatalException(tryCatch);
         }
-
-        baton->callback.Dispose();
+        
+        baton->callback.Dispose();  
         delete baton;
         delete req;
     }
-    
-    struct indexdeletebytype_baton_t {
-        Lucene* lucene;         
-        std::string type;
+
+    struct tenant_stats_baton_t
+    {
+        Lucene* lucene;
+        IndexMetrics* metrics;
+        phase_timings_t timings;
         std::string index;
+        tenant_scope_t tenant;
+        int32_t docs;           // live documents of the tenant
+        int32_t deletedDocs;    // deleted but not merged away yet
         Persistent<Function> callback;
-        uint64_t indexTime;
         std::string error;
     };
-    
+
+    // Calls back with {docs, deletedDocs} for one tenant of a tenant-mode index
     // args:
-    //   String* docID
     //   String* indexPath
-    static Handle<Value> DeleteDocumentsByTypeAsync(const Arguments& args) {
+    //   String* tenant
+    //   Function* callback
+    static Handle<Value> TenantStatsAsync(const Arguments& args) {
         HandleScope scope;
 
         REQ_STR_ARG(0);
@@ -573,68 +5227,89 @@ public:
         REQ_OBJ_TYPE(args.This(), Lucene);
         Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
 
-        indexdeletebytype_baton_t* baton = new indexdeletebytype_baton_t;
+        std::string index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+        std::map<std::string, std::string>::const_iterator it = lucene->tenantFields_.find(index);
+        if (it == lucene->tenantFields_.end()) {
+            return ThrowException(Exception::Error(String::New("The index is not in tenant mode")));
+        }
+
+        tenant_stats_baton_t* baton = new tenant_stats_baton_t;
         baton->lucene = lucene;
-        baton->type = *v8::String::Utf8Value(args[0]);
-        baton->index = *v8::String::Utf8Value(args[1]);
+        baton->index = index;
+        baton->tenant.field = it->second;
+        baton->tenant.tenant = *v8::String::Utf8Value(args[1]);
+        baton->docs = 0;
+        baton->deletedDocs = 0;
         baton->callback = Persistent<Function>::New(callback);
         baton->error.clear();
+
         lucene->Ref();
 
         uv_work_t *req = new uv_work_t;
         req->data = baton;
 
-        uv_queue_work(uv_default_loop(), req, DeleteDocumentsByType, AfterDeleteDocumentsByType);
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<tenant_stats_baton_t>(ADMIT_SEARCH, req, TenantStats, AfterTenantStats);
 
         return scope.Close(Undefined());
     }
-        
-    
-    static void DeleteDocumentsByType(uv_work_t* req) {
-        indexdeletebytype_baton_t* baton = static_cast<indexdeletebytype_baton_t*>(req->data);
 
-        lucene::analysis::standard::StandardAnalyzer an;
-        
-        try {
-          IndexReader* reader = baton->lucene->get_reader(baton->index, baton->error);
-          if (!baton->error.empty()) {
-              return;
-          }
-          
-          uint64_t start = Misc::currentTimeMillis();
+    static void TenantStats(uv_work_t* req)
+    {
+        tenant_stats_baton_t* baton = static_cast<tenant_stats_baton_t*>(req->data);
+        baton->timings.started();
 
-          TCHAR key[CL_MAX_DIR];
-          STRCPY_AtoT(key, "_type", CL_MAX_DIR);
-          TCHAR value[CL_MAX_DIR];
-          STRCPY_AtoT(value, baton->type.c_str(), CL_MAX_DIR);
-          reader->deleteDocuments(new Term(key, value));
+        if (!IndexReader::indexExists(baton->index.c_str())) {
+            return;
+        }
 
-          baton->indexTime = (Misc::currentTimeMillis() - start);
-          baton->lucene->close_reader(baton->index);
+        IndexReader* reader = baton->lucene->acquire_reader(baton->index, baton->error);
+        if (!baton->error.empty()) {
+            return;
+        }
+
+        Term* term = make_term(baton->tenant.field, baton->tenant.tenant);
+        TermDocs* termDocs = 0;
+        try {
+            // docFreq still counts deleted documents, TermDocs skips them
+            int32_t total = reader->docFreq(term);
+            termDocs = reader->termDocs(term);
+            while (termDocs->next()) {
+                ++baton->docs;
+            }
+            baton->deletedDocs = total - baton->docs;
         } catch (CLuceneError& E) {
           baton->error.assign(E.what());
         } catch(...) {
           baton->error = "Got an unknown exception";
         }
-
-        return;
+        if (termDocs != 0) {
+            termDocs->close();
+            _CLDELETE(termDocs);
+        }
+        _CLDECDELETE(term);
+        baton->lucene->release_reader(reader);
     }
 
-    static void AfterDeleteDocumentsByType(uv_work_t* req, int status)
+    static void AfterTenantStats(uv_work_t* req, int status)
     {
         HandleScope scope;
-        indexdeletebytype_baton_t* baton = static_cast<indexdeletebytype_baton_t*>(req->data);
+        tenant_stats_baton_t* baton = static_cast<tenant_stats_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_TENANT_STATS, baton->timings.elapsed(), !baton->error.empty());
         baton->lucene->Unref();
 
         Handle<Value> argv[2];
 
-        if (!baton->error.empty()) {
-            argv[0] = v8::String::New(baton->error.c_str());
-            argv[1] = Undefined();
-        }
-        else {
-            argv[0] = Undefined();
-            argv[1] = v8::Integer::NewFromUnsigned((uint32_t)baton->indexTime);
+        if (baton->error.empty()) {
+            Local<Object> stats = Object::New();
+            stats->Set(String::NewSymbol("docs"), Integer::New(baton->docs));
+            stats->Set(String::NewSymbol("deletedDocs"), Integer::New(baton->deletedDocs));
+            argv[0] = Null(); // Error arg, defaulting to no error
+            argv[1] = stats;
+        } else {
+            argv[0] = String::New(baton->error.c_str());
+            argv[1] = Null();
         }
 
         TryCatch tryCatch;
@@ -649,120 +5324,345 @@ public:
         delete baton;
         delete req;
     }
-    
 
-    struct search_field
+    struct segment_stats_t
     {
-        search_field(const std::string& key_, const std::string& value_) : key(key_), value(value_)
-        { }
-        std::string key;
-        std::string value;
+        segment_stats_t() : docCount(0), deletedDocs(0), delGen(-1), compound(false), files(0), sizeBytes(0) { }
+        std::string name;
+        int32_t docCount;
+        int32_t deletedDocs;
+        int64_t delGen;                // -1: no deletions file
+        bool compound;
+        std::string docStoreSegment;   // empty unless stored fields live in a shared doc store
+        uint32_t files;
+        int64_t sizeBytes;
+    };
+
+    struct index_stats_t
+    {
+        index_stats_t() : generation(-1), version(0), numDocs(0), maxDoc(0), files(0), sizeBytes(0),
+            writerOpen(false), ramBufferBytes(0) { }
+        int64_t generation;            // N of the current segments_N
+        int64_t version;
+        int32_t numDocs;
+        int32_t maxDoc;
+        std::vector<segment_stats_t> segments;
+        std::map<std::string, int64_t> fieldTerms;   // field -> number of distinct terms
+        uint32_t files;
+        int64_t sizeBytes;
+        bool writerOpen;
+        int64_t ramBufferBytes;
     };
 
-    struct search_doc
-    {
-        float score;
-        std::vector<search_field> fields;
-    };
+    // "_3.fdt", "_3_1.del" and "_3.s2" all belong to segment "_3"
+    static std::string segment_of(const std::string& file) {
+        if (file.empty() || file[0] != '_') {
+            return "";
+        }
+        return file.substr(0, file.find_first_of("_.", 1));
+    }
+
+    static std::string deletions_file(const segment_stats_t& segment) {
+        if (segment.delGen == 0) {
+            return segment.name + ".del";
+        }
+        return segment.name + "_" + base36(segment.delGen) + ".del";
+    }
+
+    static std::string read_string(IndexInput* input) {
+        TCHAR* value = input->readString();
+        char* converted = STRDUP_TtoA(value);
+        std::string result(converted);
+        free(converted);
+        _CLDELETE_LCARRAY(value);
+        return result;
+    }
+
+    // Number of documents marked deleted in a segment's .del bit vector
+    static int32_t read_deleted_count(Directory* directory, const std::string& file) {
+        IndexInput* input = directory->openInput(file.c_str());
+        int32_t count = 0;
+        try {
+            int32_t size = input->readInt();
+            if (size == -1) {
+                // d-gaps format: the real size follows the marker
+                input->readInt();
+            }
+            count = input->readInt();
+        } catch (...) {
+            input->close();
+            _CLDELETE(input);
+            throw;
+        }
+        input->close();
+        _CLDELETE(input);
+        return count;
+    }
+
+    // Version stamped into a segments_N file, -1 for formats older than 2.1
+    static int64_t segments_version(Directory* directory, const std::string& file) {
+        IndexInput* input = directory->openInput(file.c_str());
+        int64_t version = -1;
+        try {
+            if (input->readInt() < 0) {
+                version = input->readLong();
+            }
+        } catch (...) {
+            input->close();
+            _CLDELETE(input);
+            throw;
+        }
+        input->close();
+        _CLDELETE(input);
+        return version;
+    }
+
+    // Finds the segments_N of the commit reader has open (the one stamped
+    // with the reader's version) in directory and pins it, so it stays
+    // on disk until the caller unpins it.  Returns "" when that commit is no
+    // longer there: a newer one replaced it, which a reopen will pick up.
+    static std::string pin_reader_commit(IndexReader* reader, Directory* directory, SnapshotDeletionPolicy* policy) {
+        int64_t version = reader->getVersion();
+        std::vector<std::string> files;
+        directory->list(&files);
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (segments_generation(files[i]) < 0 || !policy->pin(files[i])) {
+                continue;
+            }
+            bool found = false;
+            try {
+                found = directory->fileExists(files[i].c_str()) && segments_version(directory, files[i]) == version;
+            } catch (CLuceneError&) {
+                // Deleted before the pin got there
+            }
+            if (found) {
+                return files[i];
+            }
+            policy->unpin(files[i]);
+        }
+        return "";
+    }
+
+    // Pins the newest segments_N in directory, the latest commit on disk.
+    // Returns "" when a newer commit replaced it before the pin got there.
+    static std::string pin_latest_commit(Directory* directory, SnapshotDeletionPolicy* policy) {
+        std::vector<std::string> files;
+        directory->list(&files);
+        std::string latest;
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (segments_generation(files[i]) > segments_generation(latest)) {
+                latest = files[i];
+            }
+        }
+        if (latest.empty()) {
+            throw CLuceneError(CL_ERR_IO, "No commit found in the index", false);
+        }
+        if (!policy->pin(latest)) {
+            return "";
+        }
+        if (!directory->fileExists(latest.c_str())) {
+            policy->unpin(latest);
+            return "";
+        }
+        return latest;
+    }
+
+    // Reads the segment list out of segments_N.  Understands the formats
+    // Lucene 2.1 to 2.3 write (-2 to -4), which is what CLucene 2.3 produces.
+    static void read_segments(Directory* directory, const std::string& file, index_stats_t& stats) {
+        IndexInput* input = directory->openInput(file.c_str());
+        try {
+            int32_t format = input->readInt();
+            if (format > -2 || format < -4) {
+                throw CLuceneError(CL_ERR_CorruptIndex, "Unsupported segments file format", false);
+            }
+            input->readLong();      // version
+            input->readInt();       // name counter
+            int32_t count = input->readInt();
+            for (int32_t i = 0; i < count; ++i) {
+                segment_stats_t segment;
+                segment.name = read_string(input);
+                segment.docCount = input->readInt();
+                segment.delGen = input->readLong();
+                if (format <= -4) {
+                    int32_t docStoreOffset = input->readInt();
+                    if (docStoreOffset != -1) {
+                        segment.docStoreSegment = read_string(input);
+                        input->readByte();  // doc store is compound
+                    }
+                }
+                if (format <= -3) {
+                    input->readByte();      // single norm file
+                }
+                int32_t normGens = input->readInt();
+                for (int32_t n = 0; n < normGens; ++n) {
+                    input->readLong();
+                }
+                segment.compound = input->readByte() == 1;
+                stats.segments.push_back(segment);
+            }
+        } catch (...) {
+            input->close();
+            _CLDELETE(input);
+            throw;
+        }
+        input->close();
+        _CLDELETE(input);
+
+        for (size_t i = 0; i < stats.segments.size(); ++i) {
+            if (stats.segments[i].delGen >= 0) {
+                stats.segments[i].deletedDocs = read_deleted_count(directory, deletions_file(stats.segments[i]));
+            }
+        }
+    }
+
+    // Stats of the commit reader has open, which segmentsFile (pinned by
+    // pin_reader_commit) holds
+    static void collect_index_stats(IndexReader* reader, const std::string& segmentsFile, index_stats_t& stats) {
+        stats.version = reader->getVersion();
+        stats.numDocs = reader->numDocs();
+        stats.maxDoc = reader->maxDoc();
+
+        // Files on disk, grouped by the segment they belong to
+        Directory* directory = reader->directory();
+        std::vector<std::string> files;
+        directory->list(&files);
+        std::map<std::string, std::pair<uint32_t, int64_t> > segmentFiles;
+        stats.generation = segments_generation(segmentsFile);
+        for (size_t i = 0; i < files.size(); ++i) {
+            int64_t length = directory->fileLength(files[i].c_str());
+            std::pair<uint32_t, int64_t>& group = segmentFiles[segment_of(files[i])];
+            group.first += 1;
+            group.second += length;
+            stats.files += 1;
+            stats.sizeBytes += length;
+        }
 
-    struct search_baton_t
+        read_segments(directory, segmentsFile, stats);
+        for (size_t i = 0; i < stats.segments.size(); ++i) {
+            std::pair<uint32_t, int64_t>& group = segmentFiles[stats.segments[i].name];
+            stats.segments[i].files = group.first;
+            stats.segments[i].sizeBytes = group.second;
+        }
+
+        // One pass over the term dictionary counts the terms of every field
+        StringArrayWithDeletor fieldNames;
+        reader->getFieldNames(IndexReader::ALL, fieldNames);
+        for (StringArrayWithDeletor::iterator it = fieldNames.begin(); it != fieldNames.end(); ++it) {
+            char* name = STRDUP_TtoA(*it);
+            stats.fieldTerms[name] = 0;
+            free(name);
+        }
+        TermEnum* termEnum = reader->terms();
+        try {
+            const TCHAR* lastField = 0;
+            int64_t* count = 0;
+            while (termEnum->next()) {
+                Term* term = termEnum->term(false);
+                // Field names are interned, and terms come grouped by field
+                if (term->field() != lastField) {
+                    lastField = term->field();
+                    char* name = STRDUP_TtoA(lastField);
+                    count = &stats.fieldTerms[name];
+                    free(name);
+                }
+                ++*count;
+            }
+        } catch (...) {
+            termEnum->close();
+            _CLDELETE(termEnum);
+            throw;
+        }
+        termEnum->close();
+        _CLDELETE(termEnum);
+    }
+
+    struct index_stats_baton_t
     {
         Lucene* lucene;
+        IndexMetrics* metrics;
+        phase_timings_t timings;
         std::string index;
-        std::string search;
-        uint64_t searchTime;
-        std::vector<search_doc> docs;
+        index_stats_t stats;
+        uint64_t statsTime;
         Persistent<Function> callback;
         std::string error;
     };
 
-    static Handle<Value> SearchAsync(const Arguments& args) {
+    // args:
+    //   String* indexPath
+    //   Function* callback
+    static Handle<Value> IndexStatsAsync(const Arguments& args) {
         HandleScope scope;
 
         REQ_STR_ARG(0);
-        REQ_STR_ARG(1);
-        REQ_FUN_ARG(2, callback);
+        REQ_FUN_ARG(1, callback);
 
         REQ_OBJ_TYPE(args.This(), Lucene);
         Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_NO_TENANT(lucene, 0, "indexStats() would report every tenant's documents");
 
-        search_baton_t* baton = new search_baton_t;
+        index_stats_baton_t* baton = new index_stats_baton_t;
         baton->lucene = lucene;
-        baton->index.assign(*v8::String::Utf8Value(args[0]));
-        baton->search.assign(*v8::String::Utf8Value(args[1]));
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[0]));
         baton->callback = Persistent<Function>::New(callback);
         baton->error.clear();
+        baton->stats.writerOpen = lucene->writer_index() == baton->index;
+        baton->stats.ramBufferBytes = baton->stats.writerOpen ? Metrics::instance().ramBufferBytes : 0;
 
         lucene->Ref();
 
         uv_work_t *req = new uv_work_t;
         req->data = baton;
 
-        uv_queue_work(uv_default_loop(), req, Search, AfterSearch);
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<index_stats_baton_t>(ADMIT_MAINTENANCE, req, IndexStats, AfterIndexStats);
 
         return scope.Close(Undefined());
     }
 
-    static void Search(uv_work_t* req)
+    static void IndexStats(uv_work_t* req)
     {
-        search_baton_t* baton = static_cast<search_baton_t*>(req->data);
+        index_stats_baton_t* baton = static_cast<index_stats_baton_t*>(req->data);
+        baton->timings.started();
         uint64_t start = Misc::currentTimeMillis();
-        
-        standard::StandardAnalyzer analyzer;
-        IndexReader* reader = baton->lucene->get_reader(baton->index, baton->error);
-        
-        if (!baton->error.empty()) {
-            return;
-        }
-        
-        IndexSearcher s(reader);
 
+        SnapshotDeletionPolicy* policy = baton->lucene->deletion_policy(baton->index);
+        IndexReader* reader = 0;
+        std::string pinned;
         try {
-            TCHAR* searchString = STRDUP_AtoT(baton->search.c_str());
-            Query* q = QueryParser::parse(searchString, _T("_id"), &analyzer);
-            Hits* hits = s.search(q);
-            free(searchString);
-            // Build the result array
-            for (size_t i=0; i < hits->length(); i++) {
-                Document& doc(hits->doc(i));
-                // {"id":"ab34", "score":1.0}
-                search_doc newDoc;
-                newDoc.score = hits->score(i);
-
-                Document::FieldsType* fields = const_cast<Document::FieldsType*>(doc.getFields());
-                DocumentFieldEnumeration fieldEnum(fields->begin(), fields->end());
-                while (fieldEnum.hasMoreElements()) {
-                    Field* curField = fieldEnum.nextElement();
-
-                    char* fieldName = STRDUP_TtoA(curField->name());
-                    char* fieldValue = STRDUP_TtoA(curField->stringValue());
-
-                    newDoc.fields.push_back(search_field(fieldName, fieldValue));
-
-                    free(fieldName);
-                    free(fieldValue);
+            // A commit can replace the reader's between reopening and pinning
+            // it; reopen and try again until the pin sticks
+            for (int attempt = 0; pinned.empty(); ++attempt) {
+                baton->lucene->release_reader(reader);
+                reader = baton->lucene->acquire_reader(baton->index, baton->error);
+                if (!baton->error.empty()) {
+                    return;
+                }
+                pinned = pin_reader_commit(reader, reader->directory(), policy);
+                if (pinned.empty() && attempt >= 10) {
+                    throw CLuceneError(CL_ERR_IO, "The index kept changing while reading its stats", false);
                 }
-                baton->docs.push_back(newDoc);
             }
-            s.close();
-            _CLLDELETE(hits);
-            _CLLDELETE(q);
-            baton->searchTime = (Misc::currentTimeMillis() - start);
+            collect_index_stats(reader, pinned, baton->stats);
+            baton->statsTime = (Misc::currentTimeMillis() - start);
         } catch (CLuceneError& E) {
           baton->error.assign(E.what());
         } catch(...) {
           baton->error = "Got an unknown exception";
         }
-
-        baton->lucene->close_reader(baton->index);
-        
-        return;
+        if (!pinned.empty()) {
+            policy->unpin(pinned);
+        }
+        baton->lucene->release_reader(reader);
     }
 
-    static void AfterSearch(uv_work_t* req, int status)
+    static void AfterIndexStats(uv_work_t* req, int status)
     {
         HandleScope scope;
-        search_baton_t* baton = static_cast<search_baton_t*>(req->data);
+        index_stats_baton_t* baton = static_cast<index_stats_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_INDEX_STATS, baton->timings.elapsed(), !baton->error.empty());
         baton->lucene->Unref();
 
         Handle<Value> argv[3];
@@ -770,20 +5670,45 @@ public:
         if (baton->error.empty()) {
             argv[0] = Null(); // Error arg, defaulting to no error
 
-            Local<v8::Array> resultArray = v8::Array::New();
-            for (uint32_t i = 0; i < baton->docs.size(); ++i) {
-                search_doc& doc(baton->docs[i]);
-                Local<Object> resultObject = Object::New();
-                for (uint32_t j = 0; j < doc.fields.size(); ++j) {
-                    search_field& field(doc.fields[j]);
-                    resultObject->Set(String::New(field.key.c_str()), String::New(field.value.c_str()));
+            const index_stats_t& stats(baton->stats);
+            Local<Object> result = Object::New();
+            result->Set(String::NewSymbol("generation"), Number::New((double)stats.generation));
+            result->Set(String::NewSymbol("version"), Number::New((double)stats.version));
+            result->Set(String::NewSymbol("numDocs"), Integer::New(stats.numDocs));
+            result->Set(String::NewSymbol("maxDoc"), Integer::New(stats.maxDoc));
+            result->Set(String::NewSymbol("deletedDocs"), Integer::New(stats.maxDoc - stats.numDocs));
+            result->Set(String::NewSymbol("files"), Integer::NewFromUnsigned(stats.files));
+            result->Set(String::NewSymbol("sizeBytes"), Number::New((double)stats.sizeBytes));
+            result->Set(String::NewSymbol("writerOpen"), Boolean::New(stats.writerOpen));
+            result->Set(String::NewSymbol("ramBufferBytes"), Number::New((double)stats.ramBufferBytes));
+
+            Local<v8::Array> segments = v8::Array::New(stats.segments.size());
+            for (uint32_t i = 0; i < stats.segments.size(); ++i) {
+                const segment_stats_t& segment(stats.segments[i]);
+                Local<Object> entry = Object::New();
+                entry->Set(String::NewSymbol("name"), String::New(segment.name.c_str()));
+                entry->Set(String::NewSymbol("docCount"), Integer::New(segment.docCount));
+                entry->Set(String::NewSymbol("deletedDocs"), Integer::New(segment.deletedDocs));
+                entry->Set(String::NewSymbol("compound"), Boolean::New(segment.compound));
+                if (!segment.docStoreSegment.empty()) {
+                    entry->Set(String::NewSymbol("docStoreSegment"), String::New(segment.docStoreSegment.c_str()));
                 }
-                resultObject->Set(String::New("score"), Number::New(doc.score));
-                resultArray->Set(i, resultObject);
+                entry->Set(String::NewSymbol("files"), Integer::NewFromUnsigned(segment.files));
+                entry->Set(String::NewSymbol("sizeBytes"), Number::New((double)segment.sizeBytes));
+                segments->Set(i, entry);
             }
+            result->Set(String::NewSymbol("segments"), segments);
 
-            argv[1] = resultArray;
-            argv[2] = v8::Integer::NewFromUnsigned((uint32_t)baton->searchTime);
+            Local<Object> fields = Object::New();
+            for (std::map<std::string, int64_t>::const_iterator it = stats.fieldTerms.begin(); it != stats.fieldTerms.end(); ++it) {
+                Local<Object> field = Object::New();
+                field->Set(String::NewSymbol("terms"), Number::New((double)it->second));
+                fields->Set(String::New(it->first.c_str()), field);
+            }
+            result->Set(String::NewSymbol("fields"), fields);
+
+            argv[1] = result;
+            argv[2] = v8::Integer::NewFromUnsigned((uint32_t)baton->statsTime);
         } else {
             argv[0] = String::New(baton->error.c_str());
             argv[1] = Null();
@@ -797,35 +5722,162 @@ public:
         if (tryCatch.HasCaught()) {
             FatalException(tryCatch);
         }
-        
-        baton->callback.Dispose();  
+
+        baton->callback.Dispose();
         delete baton;
         delete req;
-
     }
 
-    struct optimize_baton_t
+    struct snapshot_baton_t
     {
         Lucene* lucene;
-        Persistent<Function> callback;
+        IndexMetrics* metrics;
+        phase_timings_t timings;
         std::string index;
+        std::string destination;
+        bool link;                  // try hard links before copying
+        uint64_t bytesPerSecond;    // copy rate limit, 0 for none
+        int64_t generation;
+        uint32_t files;
+        uint32_t linked;
+        uint64_t bytes;
+        uint64_t snapshotTime;
+        Persistent<Function> callback;
         std::string error;
     };
 
-    static Handle<Value> OptimizeAsync(const Arguments& args)
+    static void throw_io_error(const std::string& what, const std::string& path) {
+        std::string message = what + " " + path + ": " + strerror(errno);
+        throw CLuceneError(CL_ERR_IO, message.c_str(), false);
+    }
+
+    // Every file the commit in segmentsFile needs: the segments file, and all
+    // files of its segments (and shared doc stores) except other generations'
+    // deletions.  Segment files are write once, so they can be copied while
+    // the writer keeps going.
+    static void commit_files(Directory* directory, const index_stats_t& commit, const std::string& segmentsFile,
+        std::vector<std::string>& out)
+    {
+        std::set<std::string> segments;
+        std::set<std::string> deletions;
+        for (size_t i = 0; i < commit.segments.size(); ++i) {
+            segments.insert(commit.segments[i].name);
+            if (!commit.segments[i].docStoreSegment.empty()) {
+                segments.insert(commit.segments[i].docStoreSegment);
+            }
+            if (commit.segments[i].delGen >= 0) {
+                deletions.insert(deletions_file(commit.segments[i]));
+            }
+        }
+
+        std::vector<std::string> files;
+        directory->list(&files);
+        out.push_back(segmentsFile);
+        for (size_t i = 0; i < files.size(); ++i) {
+            const std::string& file(files[i]);
+            if (segments.find(segment_of(file)) == segments.end()) {
+                continue;
+            }
+            bool isDeletions = file.size() > 4 && file.compare(file.size() - 4, 4, ".del") == 0;
+            if (!isDeletions || deletions.find(file) != deletions.end()) {
+                out.push_back(file);
+            }
+        }
+    }
+
+    // Copies source to destination, sleeping whenever the whole snapshot gets
+    // ahead of bytesPerSecond.  The copy is dropped from the page cache once
+    // it is on disk, so a backup doesn't push the live index out of it.
+    static void copy_file(const std::string& source, const std::string& destination, snapshot_baton_t* baton,
+        uint64_t startedAt)
     {
+        int in = open(source.c_str(), O_RDONLY);
+        if (in < 0) {
+            throw_io_error("Can't open", source);
+        }
+        int out = open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (out < 0) {
+            close(in);
+            throw_io_error("Can't create", destination);
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        std::vector<char> buffer(1024 * 1024);
+        for (;;) {
+            ssize_t length = read(in, &buffer[0], buffer.size());
+            if (length < 0 && errno == EINTR) {
+                continue;
+            }
+            if (length < 0) {
+                close(in);
+                close(out);
+                throw_io_error("Can't read", source);
+            }
+            if (length == 0) {
+                break;
+            }
+            for (ssize_t written = 0; written < length; ) {
+                ssize_t n = write(out, &buffer[written], length - written);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n < 0) {
+                    close(in);
+                    close(out);
+                    throw_io_error("Can't write", destination);
+                }
+                written += n;
+            }
+            baton->bytes += length;
+
+            if (baton->bytesPerSecond > 0) {
+                uint64_t due = startedAt + baton->bytes * 1000000000ull / baton->bytesPerSecond;
+                uint64_t now = uv_hrtime();
+                if (due > now) {
+                    usleep((useconds_t)((due - now) / 1000));
+                }
+            }
+        }
+
+        fdatasync(out);
+#ifdef POSIX_FADV_DONTNEED
+        posix_fadvise(out, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        close(in);
+        if (close(out) != 0) {
+            throw_io_error("Can't write", destination);
+        }
+    }
+
+    // args:
+    //   String* indexPath
+    //   String* destDir
+    //   Object* options (optional): {link: Boolean, mbPerSec: Number}
+    //   Function* callback
+    static Handle<Value> SnapshotAsync(const Arguments& args) {
         HandleScope scope;
 
         REQ_STR_ARG(0);
-        REQ_FUN_ARG(1, callback);
+        REQ_STR_ARG(1);
+        OPT_OBJ_REQ_FUN_ARGS(2, options, callback);
 
         REQ_OBJ_TYPE(args.This(), Lucene);
         Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
 
-        optimize_baton_t* baton = new optimize_baton_t;
+        snapshot_baton_t* baton = new snapshot_baton_t;
         baton->lucene = lucene;
+        baton->index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+        baton->destination = *v8::String::Utf8Value(args[1]);
+        baton->link = opt_bool(options, "link", true);
+        Local<Value> rate = options->Get(String::NewSymbol("mbPerSec"));
+        baton->bytesPerSecond = rate->IsNumber() && rate->NumberValue() > 0 ? (uint64_t)(rate->NumberValue() * 1024 * 1024) : 0;
+        baton->generation = -1;
+        baton->files = 0;
+        baton->linked = 0;
+        baton->bytes = 0;
         baton->callback = Persistent<Function>::New(callback);
-        baton->index = *v8::String::Utf8Value(args[0]);
         baton->error.clear();
 
         lucene->Ref();
@@ -833,62 +5885,99 @@ public:
         uv_work_t *req = new uv_work_t;
         req->data = baton;
 
-        uv_queue_work(uv_default_loop(), req, Optimize, AfterOptimize);
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<snapshot_baton_t>(ADMIT_MAINTENANCE, req, Snapshot, AfterSnapshot);
 
         return scope.Close(Undefined());
     }
 
-    static void Optimize(uv_work_t* req)
+    static void Snapshot(uv_work_t* req)
     {
-        optimize_baton_t* baton = static_cast<optimize_baton_t*>(req->data);
+        snapshot_baton_t* baton = static_cast<snapshot_baton_t*>(req->data);
+        uint64_t startedAt = baton->timings.started();
+        uint64_t start = Misc::currentTimeMillis();
 
+        SnapshotDeletionPolicy* policy = baton->lucene->deletion_policy(baton->index);
+        // Always the latest commit on disk, whatever the directory mode (a
+        // RAM copy's version says nothing about the segments on disk)
+        Directory* directory = 0;
+        std::string pinned;
         try {
-          
-        baton->lucene->close_reader(baton->index);
-        bool needsCreation = true;
-        if (IndexReader::indexExists(baton->index.c_str())) {
-            if (IndexReader::isLocked(baton->index.c_str())) {
-                IndexReader::unlock(baton->index.c_str());
+            directory = FSDirectory::getDirectory(baton->index.c_str());
+
+            // Another commit can replace the latest one between listing and
+            // pinning it; list again until the pin sticks
+            for (int attempt = 0; pinned.empty(); ++attempt) {
+                pinned = pin_latest_commit(directory, policy);
+                if (pinned.empty() && attempt >= 10) {
+                    throw CLuceneError(CL_ERR_IO, "The index kept changing while trying to snapshot it", false);
+                }
             }
-            needsCreation = false;
-        }
-        
-        standard::StandardAnalyzer an;
-        IndexWriter* writer = new IndexWriter(baton->index.c_str(), &an, needsCreation);
-        writer->setUseCompoundFile(false);
-        writer->optimize();
+            baton->generation = segments_generation(pinned);
 
-        writer->close();
-        
+            index_stats_t commit;
+            read_segments(directory, pinned, commit);
+            std::vector<std::string> files;
+            commit_files(directory, commit, pinned, files);
+
+            if (mkdir(baton->destination.c_str(), 0755) != 0 && errno != EEXIST) {
+                throw_io_error("Can't create", baton->destination);
+            }
+            for (size_t i = 0; i < files.size(); ++i) {
+                std::string source = baton->index + "/" + files[i];
+                std::string destination = baton->destination + "/" + files[i];
+                if (baton->link && ::link(source.c_str(), destination.c_str()) == 0) {
+                    ++baton->linked;
+                } else {
+                    copy_file(source, destination, baton, startedAt);
+                }
+                ++baton->files;
+            }
+            baton->snapshotTime = (Misc::currentTimeMillis() - start);
         } catch (CLuceneError& E) {
           baton->error.assign(E.what());
         } catch(...) {
           baton->error = "Got an unknown exception";
         }
 
-        return;
+        if (!pinned.empty()) {
+            policy->unpin(pinned);
+        }
+        if (directory != 0) {
+            release_directory(directory);
+        }
     }
 
-    static void AfterOptimize(uv_work_t* req, int status)
+    static void AfterSnapshot(uv_work_t* req, int status)
     {
         HandleScope scope;
-
-        optimize_baton_t* baton = static_cast<optimize_baton_t*>(req->data);
-        
+        snapshot_baton_t* baton = static_cast<snapshot_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_SNAPSHOT, baton->timings.elapsed(), !baton->error.empty());
         baton->lucene->Unref();
 
-        Handle<Value> argv[1];
+        Handle<Value> argv[3];
 
-        if (!baton->error.empty()) {
-            argv[0] = v8::String::New(baton->error.c_str());
-        }
-        else {
-            argv[0] = Undefined();
+        if (baton->error.empty()) {
+            argv[0] = Null(); // Error arg, defaulting to no error
+
+            Local<Object> result = Object::New();
+            result->Set(String::NewSymbol("generation"), Number::New((double)baton->generation));
+            result->Set(String::NewSymbol("files"), Integer::NewFromUnsigned(baton->files));
+            result->Set(String::NewSymbol("linked"), Integer::NewFromUnsigned(baton->linked));
+            result->Set(String::NewSymbol("copiedBytes"), Number::New((double)baton->bytes));
+
+            argv[1] = result;
+            argv[2] = v8::Integer::NewFromUnsigned((uint32_t)baton->snapshotTime);
+        } else {
+            argv[0] = String::New(baton->error.c_str());
+            argv[1] = Null();
+            argv[2] = Null();
         }
 
         TryCatch tryCatch;
 
-        baton->callback->Call(Context::GetCurrent()->Global(), 1, argv);
+        baton->callback->Call(Context::GetCurrent()->Global(), 3, argv);
 
         if (tryCatch.HasCaught()) {
             FatalException(tryCatch);
@@ -899,101 +5988,307 @@ public:
         delete req;
     }
 
-    struct get_doc_count_baton_t
+    // Deletes a flat index directory and everything in it; a missing
+    // directory is fine
+    static void remove_index_directory(const std::string& path) {
+        DIR* dir = opendir(path.c_str());
+        if (dir == 0) {
+            if (errno == ENOENT) {
+                return;
+            }
+            throw_io_error("Can't open", path);
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != 0) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                unlink((path + "/" + entry->d_name).c_str());
+            }
+        }
+        closedir(dir);
+        if (rmdir(path.c_str()) != 0) {
+            throw_io_error("Can't remove", path);
+        }
+    }
+
+    // One of the independent indexes a rebuild is split into
+    struct rebuild_part_t
+    {
+        Lucene* lucene;
+        std::string path;
+        DocsAndIds docsAndIds;
+        double ramBufferMB;
+        std::string error;
+    };
+
+    static void build_part(void* arg) {
+        rebuild_part_t* part = static_cast<rebuild_part_t*>(arg);
+        IndexWriter* writer = 0;
+        try {
+            writer = _CLNEW IndexWriter(part->path.c_str(), part->lucene->analyzer(), true);
+            writer->setRAMBufferSizeMB(part->ramBufferMB);
+            writer->setMaxFieldLength(0x7FFFFFFFL); // LUCENE_INT32_MAX_SHOULDBE
+            writer->setUseCompoundFile(false);
+
+            TCHAR key[CL_MAX_DIR];
+            STRCPY_AtoT(key, "_id", CL_MAX_DIR);
+            for (DocsAndIds::const_iterator iter = part->docsAndIds.begin(); iter != part->docsAndIds.end(); ++iter) {
+                // Every id is new in a fresh index, so there is nothing to update
+                TCHAR* value = STRDUP_AtoT(iter->first.c_str());
+                Document* doc = iter->second->document();
+                doc->removeFields(key);
+                doc->add(*_CLNEW Field(key, value, Field::STORE_YES|Field::INDEX_UNTOKENIZED));
+                free(value);
+                writer->addDocument(doc);
+            }
+            writer->close();
+        } catch (CLuceneError& E) {
+          part->error.assign(E.what());
+        } catch(...) {
+          part->error = "Got an unknown exception";
+        }
+        _CLDELETE(writer);
+    }
+
+    // Points index at the freshly built copy in staging.  Jobs that hold
+    // the old reader keep reading the old files (unlinking does not close
+    // them); everyone else opens the new index on their next acquire_reader.
+    // Refuses if an index job opened the writer on index after RebuildAsync
+    // checked; writerLock_ keeps one from opening it until the swap is done.
+    void swap_index(const std::string& index, const std::string& staging, const std::string& old) {
+        uv_mutex_lock(&readersLock_);
+        uv_mutex_lock(&writerLock_);
+        try {
+            if (writerIndex_ == index) {
+                throw CLuceneError(CL_ERR_IllegalState, "The writer was opened on this index during the rebuild", false);
+            }
+            close_directory(index);
+            if (rename(index.c_str(), old.c_str()) != 0 && errno != ENOENT) {
+                throw_io_error("Can't move aside", index);
+            }
+            if (rename(staging.c_str(), index.c_str()) != 0) {
+                int error = errno;
+                rename(old.c_str(), index.c_str());
+                errno = error;
+                throw_io_error("Can't move into place", staging);
+            }
+            // The rebuilt index numbers its commits from scratch, so what the
+            // old policy knows about deleted generations no longer applies
+            retire_deletion_policy(index);
+        } catch (...) {
+            uv_mutex_unlock(&writerLock_);
+            uv_mutex_unlock(&readersLock_);
+            throw;
+        }
+        uv_mutex_unlock(&writerLock_);
+        uv_mutex_unlock(&readersLock_);
+
+        drop_term_caches(index);
+        drop_tenant_bits(index);
+    }
+
+    struct rebuild_baton_t
     {
         Lucene* lucene;
+        IndexMetrics* metrics;
+        phase_timings_t timings;
         std::string index;
-        uint32_t docCount;
-        uint64_t docCountTime;
+        DocsAndIds docsAndIds;
+        uint32_t parallelism;
+        double ramBufferMB;       // per part
+        bool optimize;
+        uint64_t rebuildTime;
         Persistent<Function> callback;
         std::string error;
     };
 
+    // Replaces the contents of an index with docs: the documents are split
+    // over `parallelism` temporary indexes built on their own threads, which
+    // are then combined with addIndexesNoOptimize and swapped in for index.
     // args:
     //   String* indexPath
+    //   Object* {String* docId: Document* doc}
+    //   Object* options (optional): {parallelism: Integer, ramBufferMB: Number, optimize: Boolean}
     //   Function* callback
-    static Handle<Value> GetDocumentCountAsync(const Arguments& args) {
+    static Handle<Value> RebuildAsync(const Arguments& args) {
         HandleScope scope;
 
         REQ_STR_ARG(0);
-        REQ_FUN_ARG(1, callback);
+        REQ_OBJ_ARG(1);
+        OPT_OBJ_REQ_FUN_ARGS(2, options, callback);
 
         REQ_OBJ_TYPE(args.This(), Lucene);
         Lucene* lucene = ObjectWrap::Unwrap<Lucene>(args.This());
+        REQ_NOT_REBUILDING(lucene, 0);
 
-        get_doc_count_baton_t* baton = new get_doc_count_baton_t;
+        std::string index = lucene->resolve(*v8::String::Utf8Value(args[0]));
+        if (lucene->writer_index() == index) {
+            return ThrowException(Exception::Error(String::New("Close the writer on this index before rebuilding it")));
+        }
+        if (lucene->tenantFields_.find(index) != lucene->tenantFields_.end()) {
+            // The documents would come back without their tenant and _uid fields
+            return ThrowException(Exception::Error(String::New("A tenant-mode index can't be rebuilt")));
+        }
+
+        v8::Local<v8::Object> docsById = args[1]->ToObject();
+        v8::Local<v8::Array> docIds = docsById->GetOwnPropertyNames();
+        for (uint32_t i = 0; i < docIds->Length(); ++i) {
+            if (!docsById->Get(docIds->Get(i))->IsObject()) {
+                return ThrowException(Exception::TypeError(String::New("Expected an object with Lucene Documents as keys")));
+            }
+        }
+
+        rebuild_baton_t* baton = new rebuild_baton_t;
         baton->lucene = lucene;
-        baton->index = *v8::String::Utf8Value(args[0]);
+        baton->index = index;
+        baton->parallelism = std::max(opt_uint(options, "parallelism", 4), (uint32_t)1);
+        Local<Value> ramBufferMB = options->Get(String::NewSymbol("ramBufferMB"));
+        baton->ramBufferMB = ramBufferMB->IsNumber() && ramBufferMB->NumberValue() > 0 ? ramBufferMB->NumberValue() : 64;
+        baton->optimize = opt_bool(options, "optimize", false);
         baton->callback = Persistent<Function>::New(callback);
         baton->error.clear();
 
+        for (uint32_t i = 0; i < docIds->Length(); ++i) {
+            v8::Local<v8::String> v8DocId = docIds->Get(i)->ToString();
+            LuceneDocument* doc = ObjectWrap::Unwrap<LuceneDocument>(docsById->Get(v8DocId)->ToObject());
+            doc->Ref();
+            baton->docsAndIds.push_back(std::pair<std::string, LuceneDocument*>(*v8::String::Utf8Value(v8DocId), doc));
+        }
+
+        lucene->rebuilding_.insert(index);
         lucene->Ref();
 
         uv_work_t *req = new uv_work_t;
         req->data = baton;
 
-        uv_queue_work(uv_default_loop(), req, GetDocumentCount, AfterGetDocumentCount);
+        baton->metrics = Metrics::instance().forIndex(baton->index);
+        baton->timings.queued();
+        baton->lucene->admission_.admit<rebuild_baton_t>(ADMIT_MAINTENANCE, req, Rebuild, AfterRebuild);
 
         return scope.Close(Undefined());
     }
 
-    static void GetDocumentCount(uv_work_t* req)
+    static void Rebuild(uv_work_t* req)
     {
-        get_doc_count_baton_t* baton = static_cast<get_doc_count_baton_t*>(req->data);
+        rebuild_baton_t* baton = static_cast<rebuild_baton_t*>(req->data);
+        baton->timings.started();
         uint64_t start = Misc::currentTimeMillis();
-        
-        if (!IndexReader::indexExists(baton->index.c_str())) {
-            baton->error.empty();
-            baton->docCount = 0;
-            return;
-        }
 
-        IndexReader* reader = baton->lucene->get_reader(baton->index, baton->error);
-        
-        if (!baton->error.empty()) {
-            return;
+        // The temporary directories sit next to the index, not inside it
+        std::string base = baton->index;
+        while (base.size() > 1 && base[base.size() - 1] == '/') {
+            base.erase(base.size() - 1);
         }
-        
+        std::string staging = base + ".rebuild";
+        size_t partCount = std::max((size_t)1, std::min((size_t)baton->parallelism, baton->docsAndIds.size()));
+        std::vector<rebuild_part_t> parts(partCount);
+        std::vector<Directory*> partDirectories;
         try {
-            baton->docCount = reader->numDocs();
-            baton->docCountTime = (Misc::currentTimeMillis() - start);
-            baton->lucene->close_reader(baton->index);
+            remove_index_directory(staging);
+            for (size_t i = 0; i < partCount; ++i) {
+                std::ostringstream path;
+                path << staging << "-" << i;
+                parts[i].lucene = baton->lucene;
+                parts[i].path = path.str();
+                parts[i].ramBufferMB = baton->ramBufferMB;
+                remove_index_directory(parts[i].path);
+            }
+            for (size_t i = 0; i < baton->docsAndIds.size(); ++i) {
+                parts[i % partCount].docsAndIds.push_back(baton->docsAndIds[i]);
+            }
+
+            std::vector<uv_thread_t> threads(partCount);
+            for (size_t i = 0; i < partCount; ++i) {
+                uv_thread_create(&threads[i], build_part, &parts[i]);
+            }
+            for (size_t i = 0; i < partCount; ++i) {
+                uv_thread_join(&threads[i]);
+            }
+            for (size_t i = 0; i < partCount; ++i) {
+                if (!parts[i].error.empty()) {
+                    throw CLuceneError(CL_ERR_Runtime, parts[i].error.c_str(), false);
+                }
+            }
+
+            // The parts' segments get copied over as they are, unless asked to optimize
+            IndexWriter* writer = _CLNEW IndexWriter(staging.c_str(), baton->lucene->analyzer(), true);
+            try {
+                writer->setMergeScheduler(_CLNEW CountingMergeScheduler(baton->metrics));
+                writer->setUseCompoundFile(false);
+                ValueArray<Directory*> directories(partCount);
+                for (size_t i = 0; i < partCount; ++i) {
+                    partDirectories.push_back(FSDirectory::getDirectory(parts[i].path.c_str()));
+                    directories.values[i] = partDirectories.back();
+                }
+                writer->addIndexesNoOptimize(directories);
+                if (baton->optimize) {
+                    writer->optimize();
+                    Metrics::instance().addCounter(baton->metrics, &IndexMetrics::optimizes, 1);
+                }
+                writer->close();
+            } catch (...) {
+                _CLDELETE(writer);
+                throw;
+            }
+            _CLDELETE(writer);
+            Metrics::instance().addCounter(baton->metrics, &IndexMetrics::docsIndexed, baton->docsAndIds.size());
+
+            std::string old = base + ".old";
+            remove_index_directory(old);
+            baton->lucene->swap_index(baton->index, staging, old);
+            remove_index_directory(old);
+            baton->rebuildTime = (Misc::currentTimeMillis() - start);
         } catch (CLuceneError& E) {
           baton->error.assign(E.what());
         } catch(...) {
           baton->error = "Got an unknown exception";
         }
-        
-        return;
+
+        for (size_t i = 0; i < partDirectories.size(); ++i) {
+            release_directory(partDirectories[i]);
+        }
+        try {
+            for (size_t i = 0; i < partCount; ++i) {
+                remove_index_directory(parts[i].path);
+            }
+            if (!baton->error.empty()) {
+                remove_index_directory(staging);
+            }
+        } catch (...) {
+            // Leftovers get removed by the next rebuild
+        }
     }
 
-    static void AfterGetDocumentCount(uv_work_t* req, int status)
+    static void AfterRebuild(uv_work_t* req, int status)
     {
         HandleScope scope;
-        get_doc_count_baton_t* baton = static_cast<get_doc_count_baton_t*>(req->data);
+        rebuild_baton_t* baton = static_cast<rebuild_baton_t*>(req->data);
+        Metrics::instance().recordOp(baton->metrics, OP_REBUILD, baton->timings.elapsed(), !baton->error.empty());
+        baton->lucene->rebuilding_.erase(baton->index);
         baton->lucene->Unref();
 
-        Handle<Value> argv[3];
+        for (DocsAndIds::const_iterator iter = baton->docsAndIds.begin(); iter != baton->docsAndIds.end(); ++iter) {
+            iter->second->Unref();
+        }
 
-        if (baton->error.empty()) {
-            argv[0] = Null(); // Error arg, defaulting to no error
-            argv[1] = v8::Integer::NewFromUnsigned(baton->docCount);
-            argv[2] = v8::Integer::NewFromUnsigned((uint32_t)baton->docCountTime);
+        Handle<Value> argv[2];
+
+        if (!baton->error.empty()) {
+            argv[0] = v8::String::New(baton->error.c_str());
+            argv[1] = Undefined();
         } else {
-            argv[0] = String::New(baton->error.c_str());
-            argv[1] = Null();
-            argv[2] = Null();
+            argv[0] = Undefined();
+            argv[1] = v8::Integer::NewFromUnsigned((uint32_t)baton->rebuildTime);
         }
 
         TryCatch tryCatch;
 
-        baton->callback->Call(Context::GetCurrent()->Global(), 3, argv);
+        baton->callback->Call(Context::GetCurrent()->Global(), 2, argv);
 
         if (tryCatch.HasCaught()) {
             FatalException(tryCatch);
         }
-        
-        baton->callback.Dispose();  
+
+        baton->callback.Dispose();
         delete baton;
         delete req;
     }
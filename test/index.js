@@ -181,6 +181,767 @@ exports['the index can be optimized'] = function(test) {
     });
 };
 
+exports['add doc for directory mode test'] = function (test) {
+    var doc = new cl.Document();
+
+    doc.addField('name', 'Ram Directory', cl.STORE_YES|cl.INDEX_TOKENIZED);
+    doc.addField('_type', 'memory', cl.STORE_YES|cl.INDEX_UNTOKENIZED);
+
+    clucene.addDocument('20', doc, indexPath, function(err, indexTime) {
+        test.equal(err, null);
+        clucene.closeWriter();
+        test.done();
+    });
+};
+
+exports['query through a RAM directory'] = function (test) {
+    clucene.setDirectoryMode(indexPath, cl.DIRECTORY_RAM, 1000);
+    clucene.search(indexPath, '_type:"memory"', function(err, results, searchTime) {
+        test.equal(err, null);
+        test.equal(results.length, 1);
+        test.equal(results[0].name, 'Ram Directory');
+        clucene.setDirectoryMode(indexPath, cl.DIRECTORY_FS);
+        test.done();
+    });
+};
+
+exports['query through an mmap directory'] = function (test) {
+    clucene.setDirectoryMode(indexPath, cl.DIRECTORY_MMAP);
+    clucene.search(indexPath, '_type:"memory"', function(err, results, searchTime) {
+        test.equal(err, null);
+        test.equal(results.length, 1);
+        clucene.setDirectoryMode(indexPath, cl.DIRECTORY_FS);
+        test.done();
+    });
+};
+
+exports['look up documents by id'] = function (test) {
+    clucene.getDocuments(indexPath, ['missing', '20'], function(err, results, lookupTime) {
+        test.equal(err, null);
+        test.ok(is('Array', results));
+        test.ok(is('Number', lookupTime));
+        test.equal(results.length, 2);
+        test.equal(results[0], null);
+        test.equal(results[1]._id, '20');
+        test.equal(results[1].name, 'Ram Directory');
+        test.done();
+    });
+};
+
+exports['look up selected fields by id'] = function (test) {
+    clucene.getDocuments(indexPath, ['20'], {fields: ['name']}, function(err, results) {
+        test.equal(err, null);
+        test.equal(results[0]._id, '20');
+        test.equal(results[0].name, 'Ram Directory');
+        test.equal(results[0]._type, undefined);
+        test.done();
+    });
+};
+
+exports['search reports phase timings'] = function (test) {
+    clucene.search(indexPath, '_type:"memory"', {timings: true}, function(err, results, searchTime, timings) {
+        test.equal(err, null);
+        test.equal(results.length, 1);
+        ['queue', 'reader', 'parse', 'search', 'load', 'convert', 'total'].forEach(function(phase) {
+            test.ok(is('Number', timings[phase]));
+        });
+        test.ok(timings.total >= timings.search);
+        test.done();
+    });
+};
+
+exports['stats count operations per index'] = function (test) {
+    var stats = clucene.stats();
+    test.ok(is('Number', stats.queueDepth));
+    test.ok(stats.totals.operations.search.count > 0);
+    test.ok(stats.totals.docsIndexed > 0);
+
+    var index = stats.indexes[indexPath];
+    // Every closeWriter above had documents buffered to flush
+    test.ok(index.flushes > 0);
+    test.ok(is('Number', index.merges));
+    test.ok(index.operations.search.count > 0);
+    test.ok(index.operations.search.latency.p99 >= index.operations.search.latency.p50);
+    test.ok(index.operations.search.latency.max > 0);
+    test.done();
+};
+
+exports['search synchronously on a cached reader'] = function (test) {
+    var results = clucene.searchSync(indexPath, '_type:"memory"');
+    test.ok(is('Array', results));
+    test.equal(results.length, 1);
+    test.equal(results[0].name, 'Ram Directory');
+    test.ok(is('Number', results[0].score));
+    // timeoutMs: 0 is no limit, not an instant timeout
+    test.equal(clucene.searchSync(indexPath, '_type:"memory"', {timeoutMs: 0}).length, 1);
+
+    test.throws(function() {
+        clucene.searchSync(indexPath, '_type:"memory"', {maxHits: 0});
+    });
+    test.throws(function() {
+        clucene.searchSync('./not-opened.index', '_type:"memory"');
+    });
+    test.done();
+};
+
+exports['get a document synchronously'] = function (test) {
+    test.equal(clucene.getDocumentSync(indexPath, '20').name, 'Ram Directory');
+    test.equal(clucene.getDocumentSync(indexPath, 'missing'), null);
+    test.done();
+};
+
+exports['search many queries in one job'] = function (test) {
+    clucene.searchMany(indexPath, ['_type:"memory"', '_id:"missing"', 'name:Ram*'], function(err, results, searchTime) {
+        test.equal(err, null);
+        test.ok(is('Number', searchTime));
+        test.equal(results.length, 3);
+        test.equal(results[0].length, 1);
+        test.equal(results[1].length, 0);
+        test.equal(results[2][0].name, 'Ram Directory');
+        test.done();
+    });
+};
+
+exports['search many queries with a promise'] = function (test) {
+    var builtin = cl.Promise;
+
+    cl.Promise = undefined;
+    test.throws(function() {
+        clucene.searchMany(indexPath, ['_type:"memory"'], {limit: 1});
+    });
+
+    // A minimal then-able, so this runs on node versions without a Promise
+    cl.Promise = function (executor) {
+        var self = this;
+        executor(function (value) {
+            self.fulfilled(value);
+        }, function (reason) {
+            self.rejected(reason);
+        });
+    };
+    cl.Promise.prototype.then = function (fulfilled, rejected) {
+        this.fulfilled = fulfilled;
+        this.rejected = rejected;
+    };
+
+    var promise = clucene.searchMany(indexPath, ['_type:"memory"'], {limit: 1});
+    cl.Promise = builtin;
+    test.equal(typeof promise.abort, 'function');
+    promise.then(function(results) {
+        test.equal(results[0].length, 1);
+        test.done();
+    }, function(err) {
+        test.ok(false, err);
+        test.done();
+    });
+};
+
+exports['index with a per-field analyzer'] = function (test) {
+    test.throws(function() {
+        clucene.setFieldAnalyzer('tags', 'no-such-analyzer');
+    });
+    clucene.setFieldAnalyzer('tags', 'whitespace');
+
+    var doc = new cl.Document();
+    doc.addField('name', 'Whitespace Tags', cl.STORE_YES|cl.INDEX_TOKENIZED);
+    doc.addField('tags', 'Foo-Bar baz', cl.STORE_YES|cl.INDEX_TOKENIZED);
+
+    clucene.addDocument('30', doc, indexPath, function(err, indexTime) {
+        test.equal(err, null);
+        test.throws(function() {
+            clucene.setAnalyzer('simple');
+        });
+        clucene.closeWriter();
+        test.done();
+    });
+};
+
+exports['query a whitespace analyzed field'] = function (test) {
+    clucene.search(indexPath, 'tags:Foo-Bar', function(err, results) {
+        test.equal(err, null);
+        test.equal(results.length, 1);
+        test.equal(results[0]._id, '30');
+        test.done();
+    });
+};
+
+exports['index pre-tokenized field'] = function (test) {
+    var doc = new cl.Document();
+    doc.addField('name', 'Pre Tokenized', cl.STORE_YES|cl.INDEX_TOKENIZED);
+    doc.addTokens('stems', ['run', 'fast', 'Quick'], cl.STORE_NO|cl.INDEX_TOKENIZED);
+    doc.addTokens('phrase', ['new', 'york', 'city'], [0, 1, 1], [[0, 3], [4, 8], [4, 8]], cl.STORE_NO|cl.INDEX_TOKENIZED);
+
+    test.throws(function() {
+        doc.addTokens('stored', ['a'], cl.STORE_YES|cl.INDEX_TOKENIZED);
+    });
+    test.throws(function() {
+        doc.addTokens('backwards', ['a', 'b'], [1, 0], null, cl.STORE_NO|cl.INDEX_TOKENIZED);
+    });
+
+    clucene.addDocument('40', doc, indexPath, function(err, indexTime) {
+        test.equal(err, null);
+        clucene.closeWriter();
+        test.done();
+    });
+};
+
+exports['query pre-tokenized field'] = function (test) {
+    clucene.searchMany(indexPath, ['stems:fast', 'phrase:"new york"', 'phrase:"new city"'], function(err, results) {
+        test.equal(err, null);
+        test.equal(results[0].length, 1);
+        test.equal(results[0][0]._id, '40');
+        test.equal(results[1].length, 1);
+        test.equal(results[2].length, 1);
+        test.done();
+    });
+};
+
+exports['store binary fields'] = function (test) {
+    var doc = new cl.Document();
+    var json = JSON.stringify({name: 'Binary', tags: ['a', 'b']});
+    doc.addField('name', 'Binary Fields', cl.STORE_YES|cl.INDEX_TOKENIZED);
+    doc.addField('raw', new Buffer([0, 1, 2, 255]), cl.STORE_YES|cl.INDEX_NO);
+    doc.addField('json', new Buffer(json), cl.STORE_COMPRESS|cl.INDEX_NO);
+
+    test.throws(function() {
+        doc.addField('indexed', new Buffer('x'), cl.STORE_YES|cl.INDEX_UNTOKENIZED);
+    });
+
+    clucene.addDocument('50', doc, indexPath, function(err, indexTime) {
+        test.equal(err, null);
+        clucene.closeWriter();
+        clucene.getDocuments(indexPath, ['50'], function(err, results) {
+            test.equal(err, null);
+            test.ok(Buffer.isBuffer(results[0].raw));
+            test.equal(results[0].raw.length, 4);
+            test.equal(results[0].raw[3], 255);
+            test.equal(results[0].json.toString(), json);
+            test.equal(results[0].name, 'Binary Fields');
+            test.done();
+        });
+    });
+};
+
+exports['highlight fragments from term vectors'] = function (test) {
+    var doc = new cl.Document();
+    doc.addField('name', 'Highlight', cl.STORE_YES|cl.INDEX_TOKENIZED);
+    doc.addField('bio', 'Jenny grew up by the sea. Years later Jenny moved inland.',
+        cl.STORE_YES|cl.INDEX_TOKENIZED|cl.TERMVECTOR_WITH_POSITIONS_OFFSETS);
+    doc.addField('note', 'A quiet note about jenny', cl.STORE_YES|cl.INDEX_TOKENIZED);
+
+    clucene.addDocument('60', doc, indexPath, function(err, indexTime) {
+        test.equal(err, null);
+        clucene.closeWriter();
+        clucene.search(indexPath, 'bio:jenny', {highlight: {field: 'bio', fragments: 2, size: 30}}, function(err, results) {
+            test.equal(err, null);
+            test.equal(results.length, 1);
+            test.equal(results[0]._highlight.length, 2);
+            test.equal(results[0]._highlight[0], '<em>Jenny</em> grew up by the sea. Years');
+            test.ok(results[0]._highlight[1].indexOf('<em>Jenny</em> moved') >= 0);
+            test.done();
+        });
+    });
+};
+
+exports['highlight fragments by re-analyzing stored text'] = function (test) {
+    clucene.search(indexPath, 'note:jenny', {highlight: {field: 'note', pre: '[', post: ']'}}, function(err, results) {
+        test.equal(err, null);
+        test.equal(results.length, 1);
+        test.deepEqual(results[0]._highlight, ['A quiet note about [jenny]']);
+        test.done();
+    });
+};
+
+exports['enumerate terms by prefix'] = function (test) {
+    clucene.terms(indexPath, 'bio', {prefix: 'y'}, function(err, terms) {
+        test.equal(err, null);
+        test.deepEqual(terms, [{term: 'years', docFreq: 1}]);
+        clucene.terms(indexPath, '_type', {limit: 1}, function(err, terms) {
+            test.equal(err, null);
+            test.equal(terms.length, 1);
+            test.done();
+        });
+    });
+};
+
+exports['enumerate terms from the cached snapshot'] = function (test) {
+    clucene.terms(indexPath, 'bio', {prefix: 'y'}, function(err, direct) {
+        test.equal(err, null);
+        clucene.terms(indexPath, 'bio', {prefix: 'y', cache: true}, function(err, cached) {
+            test.equal(err, null);
+            test.deepEqual(cached, direct);
+            clucene.terms(indexPath, 'bio', {prefix: 'j', minDocFreq: 2, cache: true}, function(err, cached) {
+                test.equal(err, null);
+                test.deepEqual(cached, []);
+                test.done();
+            });
+        });
+    });
+};
+
+exports['index statistics'] = function (test) {
+    clucene.indexStats(indexPath, function(err, stats, statsTime) {
+        test.equal(err, null);
+        test.ok(stats.generation > 0);
+        test.ok(stats.numDocs > 0);
+        test.equal(stats.deletedDocs, stats.maxDoc - stats.numDocs);
+        test.ok(stats.segments.length > 0);
+        var docs = 0;
+        stats.segments.forEach(function(segment) {
+            test.ok(segment.sizeBytes > 0);
+            docs += segment.docCount - segment.deletedDocs;
+        });
+        test.equal(docs, stats.numDocs);
+        test.ok(stats.fields._id.terms > 0);
+        test.equal(stats.fields.raw.terms, 0);
+        test.equal(stats.writerOpen, false);
+        test.done();
+    });
+};
+
+exports['snapshot a live index'] = function (test) {
+    var snapshotPath = './test.snapshot';
+    if (path.existsSync(snapshotPath)) {
+        wrench.rmdirSyncRecursive(snapshotPath);
+    }
+
+    var doc = new cl.Document();
+    doc.addField('name', 'Snapshot Pending', cl.STORE_YES|cl.INDEX_TOKENIZED);
+
+    // Leave the writer open: the snapshot must not need it closed
+    clucene.addDocument('70', doc, indexPath, function(err) {
+        test.equal(err, null);
+        clucene.snapshot(indexPath, snapshotPath, {mbPerSec: 64}, function(err, snapshot, snapshotTime) {
+            test.equal(err, null);
+            test.ok(snapshot.generation > 0);
+            test.ok(snapshot.files > 0);
+            clucene.closeWriter();
+
+            var backup = new cl.Lucene();
+            backup.search(snapshotPath, 'name:eric', function(err, results) {
+                test.equal(err, null);
+                test.equal(results.length, 1);
+                wrench.rmdirSyncRecursive(snapshotPath);
+                test.done();
+            });
+        });
+    });
+};
+
+exports['rebuild an index in parallel'] = function (test) {
+    var rebuildPath = './test.rebuild.index';
+    var docs = {};
+    for (var i = 0; i < 50; ++i) {
+        var doc = new cl.Document();
+        doc.addField('name', 'Rebuilt ' + i, cl.STORE_YES|cl.INDEX_TOKENIZED);
+        doc.addField('_type', 'rebuilt', cl.STORE_YES|cl.INDEX_UNTOKENIZED);
+        docs[String(i)] = doc;
+    }
+
+    clucene.rebuild(rebuildPath, docs, {parallelism: 3}, function(err, rebuildTime) {
+        test.equal(err, undefined);
+        test.ok(is('Number', rebuildTime));
+        clucene.getDocumentCount(rebuildPath, function(err, count) {
+            test.equal(err, null);
+            test.equal(count, 50);
+            clucene.search(rebuildPath, 'name:rebuilt', function(err, results) {
+                test.equal(err, null);
+                test.equal(results.length, 50);
+                test.done();
+            });
+        });
+    });
+    test.throws(function() {
+        clucene.addDocuments({}, rebuildPath, function() {});
+    });
+};
+
+exports['search through an alias'] = function (test) {
+    test.equal(clucene.alias('contacts', indexPath), undefined);
+    test.equal(clucene.alias('contacts'), indexPath);
+    clucene.search('contacts', 'name:eric', function(err, results) {
+        test.equal(err, null);
+        test.equal(results.length, 1);
+
+        // Repoint to the rebuilt index; the old one stays usable by path
+        test.equal(clucene.alias('contacts', './test.rebuild.index'), indexPath);
+        clucene.search('contacts', 'name:rebuilt', function(err, results) {
+            test.equal(err, null);
+            test.equal(results.length, 50);
+            clucene.alias('contacts', null);
+            test.equal(clucene.alias('contacts'), undefined);
+            clucene.search(indexPath, 'name:eric', function(err, results) {
+                test.equal(err, null);
+                test.equal(results.length, 1);
+                wrench.rmdirSyncRecursive('./test.rebuild.index');
+                test.done();
+            });
+        });
+    });
+};
+
+exports['evict idle indexes beyond the pool limit'] = function (test) {
+    var pool = new cl.Lucene();
+    var paths = ['./test.pool.a', './test.pool.b'];
+    var doc = new cl.Document();
+    doc.addField('name', 'Pooled', cl.STORE_YES|cl.INDEX_TOKENIZED);
+
+    pool.addDocument('1', doc, paths[0], function(err) {
+        test.equal(err, undefined);
+        pool.closeWriter();
+        pool.addDocument('1', doc, paths[1], function(err) {
+            test.equal(err, undefined);
+            pool.closeWriter();
+            pool.setPoolLimits({maxOpen: 1});
+            pool.search(paths[0], 'name:pooled', function(err, results) {
+                test.equal(err, null);
+                pool.search(paths[1], 'name:pooled', function(err, results) {
+                    test.equal(err, null);
+                    test.equal(results.length, 1);
+                    test.ok(pool.stats().indexes[paths[0]].evictions >= 1);
+
+                    pool.close(paths[1]);
+                    pool.search(paths[1], 'name:pooled', function(err, results) {
+                        test.equal(err, null);
+                        test.equal(results.length, 1);
+                        paths.forEach(function(p) { wrench.rmdirSyncRecursive(p); });
+                        test.done();
+                    });
+                });
+            });
+        });
+    });
+};
+
+exports['keep tenants apart in one index'] = function (test) {
+    var tenantPath = './test.tenants';
+    var shared = new cl.Lucene();
+    shared.setTenantField(tenantPath, '_tenant');
+
+    function contact(name) {
+        var doc = new cl.Document();
+        doc.addField('name', name, cl.STORE_YES|cl.INDEX_TOKENIZED);
+        doc.addField('_type', 'contact', cl.STORE_YES|cl.INDEX_UNTOKENIZED);
+        return doc;
+    }
+
+    test.throws(function() { shared.search(tenantPath, 'name:shared', function() {}); });
+    test.throws(function() { shared.terms(tenantPath, 'name', function() {}); });
+    test.throws(function() { shared.getDocumentCount(tenantPath, function() {}); });
+    test.throws(function() { shared.indexStats(tenantPath, function() {}); });
+    test.throws(function() { shared.search(tenantPath, 'name:shared', {tenant: 'acme\x1f1'}, function() {}); }, TypeError);
+    shared.addDocument('1', contact('Shared Acme'), tenantPath, {tenant: 'acme'}, function(err) {
+        test.equal(err, undefined);
+        shared.addDocuments({'1': contact('Shared Initech'), '2': contact('Shared Initech')}, tenantPath, {tenant: 'initech'}, function(err) {
+            test.equal(err, undefined);
+            shared.closeWriter();
+            shared.search(tenantPath, 'name:shared', {tenant: 'acme'}, function(err, results) {
+                test.equal(err, null);
+                test.equal(results.length, 1);
+                test.equal(results[0]._tenant, 'acme');
+                shared.getDocuments(tenantPath, ['1'], {tenant: 'initech'}, function(err, docs) {
+                    test.equal(err, null);
+                    test.equal(docs[0].name, 'Shared Initech');
+                    shared.deleteDocument('1', tenantPath, {tenant: 'initech'}, function(err) {
+                        test.equal(err, undefined);
+                        shared.tenantStats(tenantPath, 'initech', function(err, stats) {
+                            test.equal(err, null);
+                            test.equal(stats.docs, 1);
+                            test.equal(stats.deletedDocs, 1);
+                            shared.deleteDocumentsByType('contact', tenantPath, {tenant: 'acme'}, function(err) {
+                                test.equal(err, undefined);
+                                shared.search(tenantPath, 'name:shared', {tenant: 'initech'}, function(err, results) {
+                                    test.equal(err, null);
+                                    test.equal(results.length, 1);
+                                    test.equal(results[0]._id, '2');
+                                    shared.close(tenantPath);
+                                    wrench.rmdirSyncRecursive(tenantPath);
+                                    test.done();
+                                });
+                            });
+                        });
+                    });
+                });
+            });
+        });
+    });
+};
+
+exports['search with query trees'] = function (test) {
+    var treePath = './test.tree';
+    var docs = {'user:1/a': new cl.Document(), 'user:2/b': new cl.Document()};
+    docs['user:1/a'].addField('name', 'Quick Brown Fox', cl.STORE_YES|cl.INDEX_TOKENIZED);
+    docs['user:1/a'].addField('year', '2011', cl.STORE_YES|cl.INDEX_UNTOKENIZED);
+    docs['user:2/b'].addField('name', 'Quick Red Fox', cl.STORE_YES|cl.INDEX_TOKENIZED);
+    docs['user:2/b'].addField('year', '2013', cl.STORE_YES|cl.INDEX_UNTOKENIZED);
+
+    test.throws(function() { clucene.search(treePath, {type: 'fuzzy', field: 'name', value: 'x'}, function() {}); });
+    test.throws(function() { clucene.search(treePath, {type: 'bool'}, function() {}); });
+    clucene.addDocuments(docs, treePath, function(err) {
+        test.equal(err, undefined);
+        clucene.closeWriter();
+        clucene.searchMany(treePath, [
+            {type: 'term', field: '_id', value: 'user:1/a'},
+            {type: 'bool', must: [{type: 'prefix', field: 'name', value: 'qui'}],
+                mustNot: [{type: 'phrase', field: 'name', terms: ['red', 'fox']}]},
+            {type: 'range', field: 'year', from: '2012', boost: 2},
+            'name:fox'
+        ], function(err, results) {
+            test.equal(err, null);
+            test.equal(results[0].length, 1);
+            test.equal(results[0][0]._id, 'user:1/a');
+            test.equal(results[1].length, 1);
+            test.equal(results[1][0]._id, 'user:1/a');
+            test.equal(results[2].length, 1);
+            test.equal(results[2][0]._id, 'user:2/b');
+            test.equal(results[3].length, 2);
+            clucene.close(treePath);
+            wrench.rmdirSyncRecursive(treePath);
+            test.done();
+        });
+    });
+};
+
+exports['search without scoring'] = function (test) {
+    var unscoredPath = './test.unscored';
+    var docs = {};
+    ['Fox', 'Fox Fox Fox', 'Red Fox'].forEach(function(name, i) {
+        docs[String(i + 1)] = new cl.Document();
+        docs[String(i + 1)].addField('name', name, cl.STORE_YES|cl.INDEX_TOKENIZED);
+    });
+    clucene.addDocuments(docs, unscoredPath, function(err) {
+        test.equal(err, undefined);
+        clucene.closeWriter();
+        clucene.search(unscoredPath, 'name:fox', {scoring: false}, function(err, results) {
+            test.equal(err, null);
+            test.deepEqual(results.map(function(r) { return r._id; }), ['1', '2', '3']);
+            test.equal(results[1].score, 1);
+            clucene.searchMany(unscoredPath, ['name:fox'], {scoring: false, limit: 2}, function(err, results) {
+                test.equal(err, null);
+                test.deepEqual(results[0].map(function(r) { return r._id; }), ['1', '2']);
+                // Several terms: each match once, still in index order
+                clucene.search(unscoredPath, 'name:red name:f*', {scoring: false}, function(err, results) {
+                    test.equal(err, null);
+                    test.deepEqual(results.map(function(r) { return r._id; }), ['1', '2', '3']);
+                    clucene.close(unscoredPath);
+                    wrench.rmdirSyncRecursive(unscoredPath);
+                    test.done();
+                });
+            });
+        });
+    });
+};
+
+exports['count matching documents'] = function (test) {
+    var countPath = './test.count';
+    var docs = {};
+    ['Fox', 'Red Fox', 'Hound'].forEach(function(name, i) {
+        docs[String(i + 1)] = new cl.Document();
+        docs[String(i + 1)].addField('name', name, cl.STORE_YES|cl.INDEX_TOKENIZED);
+    });
+    clucene.addDocuments(docs, countPath, function(err) {
+        test.equal(err, undefined);
+        clucene.closeWriter();
+        clucene.count(countPath, 'name:fox', function(err, count) {
+            test.equal(err, null);
+            test.equal(count, 2);
+            clucene.count(countPath, {type: 'prefix', field: 'name', value: ''}, {limit: 1}, function(err, count) {
+                test.equal(err, null);
+                test.equal(count, 1);
+                clucene.count(countPath, 'name:cat', function(err, count) {
+                    test.equal(err, null);
+                    test.equal(count, 0);
+                    clucene.close(countPath);
+                    wrench.rmdirSyncRecursive(countPath);
+                    test.done();
+                });
+            });
+        });
+    });
+};
+
+exports['abort a running search'] = function (test) {
+    var abortPath = './test.abort';
+    var docs = {};
+    ['Fox', 'Red Fox', 'Old Fox'].forEach(function(name, i) {
+        docs[String(i + 1)] = new cl.Document();
+        docs[String(i + 1)].addField('name', name, cl.STORE_YES|cl.INDEX_TOKENIZED);
+    });
+    clucene.addDocuments(docs, abortPath, function(err) {
+        test.equal(err, undefined);
+        clucene.closeWriter();
+        // With one search in flight the second waits in the admission queue,
+        // so it is certain not to have started when it gets aborted
+        clucene.setAdmissionLimits({search: {maxInFlight: 1, maxQueued: 1}});
+        var pending = 2;
+        function done() {
+            if (--pending > 0) {
+                return;
+            }
+            clucene.setAdmissionLimits({search: null});
+            clucene.searchMany(abortPath, ['name:fox', 'name:red'], {timeoutMs: 1000}, function(err, results) {
+                test.equal(err, null);
+                test.equal(results.truncated, undefined);
+                test.equal(results[0].length, 3);
+                clucene.close(abortPath);
+                wrench.rmdirSyncRecursive(abortPath);
+                test.done();
+            });
+        }
+        clucene.search(abortPath, 'name:fox', function(err, results) {
+            test.equal(err, null);
+            test.equal(results.length, 3);
+            done();
+        });
+        var handle = clucene.search(abortPath, 'name:fox', {timeoutMs: 1000}, function(err, results) {
+            test.equal(err, null);
+            test.equal(results.truncated, true);
+            test.equal(results.length, 0);
+            test.equal(handle.abort(), false);
+            done();
+        });
+        test.equal(handle.abort(), true);
+    });
+};
+
+exports['reject and shed searches beyond the admission limits'] = function (test) {
+    var admitPath = './test.admit';
+    var doc = new cl.Document();
+    doc.addField('name', 'Fox', cl.STORE_YES|cl.INDEX_TOKENIZED);
+    clucene.addDocument('1', doc, admitPath, function(err) {
+        test.equal(err, undefined);
+        clucene.closeWriter();
+        clucene.setAdmissionLimits({search: {maxInFlight: 1, maxQueued: 0}});
+        var errors = [];
+        function done(err) {
+            errors.push(err);
+            if (errors.length < 3) {
+                return;
+            }
+            // The first one runs, the other two find no room
+            test.deepEqual(errors.sort(), ['EBUSY: search queue is full', 'EBUSY: search queue is full', null]);
+            test.equal(clucene.stats().admission.search.rejected, 2);
+            clucene.setAdmissionLimits({search: {maxInFlight: 1, maxQueued: 1, policy: 'shedOldest'}});
+            var outcomes = {}, pending = 3;
+            ['first', 'second', 'third'].forEach(function(name) {
+                clucene.search(admitPath, 'name:fox', function(err, results) {
+                    outcomes[name] = err || results.length;
+                    if (--pending > 0) {
+                        return;
+                    }
+                    // The queued second search made room for the third
+                    test.deepEqual(outcomes, {first: 1, second: 'EBUSY: search request shed for a newer one', third: 1});
+                    test.equal(clucene.stats().admission.search.shed, 1);
+                    clucene.setAdmissionLimits({search: null});
+                    test.equal(clucene.stats().admission.search.maxInFlight, 0);
+                    clucene.close(admitPath);
+                    wrench.rmdirSyncRecursive(admitPath);
+                    test.done();
+                });
+            });
+        }
+        for (var i = 0; i < 3; ++i) {
+            clucene.search(admitPath, 'name:fox', done);
+        }
+    });
+};
+
+exports['cap the native memory of a request'] = function (test) {
+    var memoryPath = './test.memory';
+    var doc = new cl.Document();
+    doc.addField('name', 'Fox ' + new Array(1000).join('x'), cl.STORE_YES|cl.INDEX_TOKENIZED);
+    clucene.addDocument('1', doc, memoryPath, function(err) {
+        test.equal(err, undefined);
+        clucene.closeWriter();
+        clucene.setMemoryLimits({maxRequestMB: 0.001});
+        test.throws(function() {
+            clucene.addDocument('2', doc, memoryPath, function() {});
+        }, RangeError);
+        clucene.search(memoryPath, 'name:fox', function(err, results) {
+            test.equal(err, 'ENOMEM: the results are above maxRequestMB');
+            test.throws(function() {
+                clucene.searchSync(memoryPath, 'name:fox');
+            }, /ENOMEM/);
+            clucene.setMemoryLimits({maxRequestMB: 0});
+            clucene.search(memoryPath, 'name:fox', function(err, results) {
+                test.equal(err, null);
+                test.equal(results.length, 1);
+                var memory = clucene.stats().memory;
+                test.ok(memory.results > 0);
+                test.equal(memory.total, memory.results + memory.batches + memory.writer + memory.caches + memory.readers);
+                test.equal(memory.maxRequestBytes, 0);
+                clucene.close(memoryPath);
+                wrench.rmdirSyncRecursive(memoryPath);
+                test.done();
+            });
+        });
+    });
+};
+
+exports['index JSON documents'] = function (test) {
+    var jsonPath = './test.json';
+    var mapping = {
+        'obj.data.from.name': cl.STORE_YES|cl.INDEX_TOKENIZED,
+        'obj.data.images': cl.STORE_NO|cl.INDEX_UNTOKENIZED,
+        'type': cl.STORE_YES|cl.INDEX_UNTOKENIZED
+    };
+    clucene.addJSON(jsonPath, 'fb1', fs.readFileSync(__dirname + '/facebook.json'), mapping, function(err) {
+        test.equal(err, undefined);
+        clucene.addJSON(jsonPath, 'bad', '{"type": "photo",', mapping, function(err) {
+            test.ok(/^Invalid JSON: /.test(err));
+            clucene.closeWriter();
+            clucene.search(jsonPath, 'obj.data.from.name:muldowney', function(err, results) {
+                test.equal(err, null);
+                test.equal(results.length, 1);
+                test.equal(results[0]._id, 'fb1');
+                test.equal(results[0]['obj.data.from.name'], 'Thomas Muldowney');
+                test.equal(results[0].type, 'photo/facebook');
+                // Fields no mapping covers are left out
+                test.equal(results[0].via, undefined);
+                // Every element of images.width is a value of the field
+                clucene.search(jsonPath, {type: 'term', field: 'obj.data.images.width', value: '127'}, function(err, results) {
+                    test.equal(err, null);
+                    test.equal(results.length, 1);
+                    clucene.close(jsonPath);
+                    wrench.rmdirSyncRecursive(jsonPath);
+                    test.done();
+                });
+            });
+        });
+    });
+};
+
+exports['deletes are committed before they call back'] = function (test) {
+    var deletePath = './test.deletes';
+    var docs = {};
+    ['Fox', 'Red Fox', 'Old Fox'].forEach(function(name, i) {
+        docs[String(i + 1)] = new cl.Document();
+        docs[String(i + 1)].addField('name', name, cl.STORE_YES|cl.INDEX_TOKENIZED);
+    });
+    clucene.addDocuments(docs, deletePath, function(err) {
+        test.equal(err, undefined);
+        clucene.closeWriter();
+        // Searches leasing the cached reader must not hold the deletes back
+        clucene.search(deletePath, 'name:fox', function(err) {
+            test.equal(err, null);
+        });
+        clucene.deleteDocument('1', deletePath, function(err) {
+            test.equal(err, undefined);
+            clucene.deleteDocument('2', deletePath, function(err) {
+                test.equal(err, undefined);
+                clucene.search(deletePath, 'name:fox', function(err, results) {
+                    test.equal(err, null);
+                    test.equal(results.length, 1);
+                    test.equal(results[0]._id, '3');
+                    clucene.close(deletePath);
+                    wrench.rmdirSyncRecursive(deletePath);
+                    test.done();
+                });
+            });
+        });
+    });
+};
+
 function is(type, obj) {
     var clas = Object.prototype.toString.call(obj).slice(8, -1);
     return obj !== undefined && obj !== null && clas === type;